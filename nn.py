@@ -1,6 +1,8 @@
 import os
 import argparse
 import json
+import time
+from multiprocessing import Pool
 
 from annoy import AnnoyIndex
 
@@ -35,6 +37,8 @@ def get_arguments():
         '--idxFile', help='index file path', required=True)
     nn_parser.add_argument(
         '--output', help='output file path', required=True)
+    nn_parser.add_argument(
+        '--workers', help='number of query processes', type=int, default=os.cpu_count())
 
     all_parser = sub_parsers.add_parser(
         'all', help='Create a forest of trees and Get cloesest items')
@@ -52,10 +56,33 @@ def get_arguments():
         '--input', help='workflow start yyyymmddhh', required=True)
     all_parser.add_argument(
         '--output', help='output file path', required=True)
+    all_parser.add_argument(
+        '--workers', help='number of query processes', type=int, default=os.cpu_count())
 
 
     return parser.parse_args()
 
+# per process state of the nn query workers
+_index = None
+_idx2id = None
+
+
+def _init_worker(dim, treeFile, idx2id):
+    global _index, _idx2id
+    # the tree file is mmap'ed, so every worker shares the same pages
+    _index = AnnoyIndex(dim, 'angular')
+    _index.load(treeFile)
+    _idx2id = idx2id
+
+
+def _query(indices):
+    lines = []
+    for idx in indices:
+        neghbors = [_idx2id[nn_idx] for nn_idx in _index.get_nns_by_item(idx, 10)]
+        lines.append((idx, neghbors))
+    return lines
+
+
 class Ann:
     @staticmethod
     def build(id_name, dim, input, ntree, treeFile, idxFile):
@@ -99,8 +126,9 @@ class Ann:
                 ofs.write(line + '\n')
 
     @staticmethod
-    def nn(id_name, dim, treeFile, idxFile, output):
+    def nn(id_name, dim, treeFile, idxFile, output, workers):
         print(f'nn search {id_name}')
+        start = time.time()
         if os.path.exists(output):
             os.remove(output)
 
@@ -110,27 +138,24 @@ class Ann:
                 pair = json.loads(line)
                 idx2id[pair['idx']] = pair[id_name]
 
-        annoyIndex = AnnoyIndex(dim, 'angular')
-        annoyIndex.load(treeFile)
-
-        with open(output, 'a') as ofs:
-            for idx in idx2id:
-                nn_indices = annoyIndex.get_nns_by_item(idx, 10)
-
-                neghbors = []
+        indices = list(idx2id)
+        chunk = 10000
+        chunks = [indices[i:i + chunk] for i in range(0, len(indices), chunk)]
 
-                for nn_idx in nn_indices:
-                    id = idx2id[nn_idx]
-                    neghbors.append(id)
+        with open(output, 'a') as ofs, \
+                Pool(workers, _init_worker, (dim, treeFile, idx2id)) as pool:
+            for lines in pool.imap(_query, chunks):
+                for idx, neghbors in lines:
+                    item = {
+                        id_name: idx2id[idx],
+                        'nn': neghbors
+                    }
 
-                item = {
-                    id_name: idx2id[idx],
-                    'nn': neghbors
-                }
+                    line = json.dumps(item)
 
-                line = json.dumps(item)
+                    ofs.write(line + '\n')
 
-                ofs.write(line + '\n')
+        print(f'>> nn search {len(indices)} items in {time.time() - start:.1f} sec on {workers} workers')
 
 
 def main():
@@ -152,8 +177,9 @@ def main():
         print(f'>> output: {args.output} ')
         print(f'>> treeFile: {args.treeFile} ')
         print(f'>> idxFile: {args.idxFile} ')
+        print(f'>> workers: {args.workers} ')
         Ann.nn(id_name=args.id_name, dim=args.dim, output=args.output,
-               treeFile=args.treeFile, idxFile=args.idxFile)
+               treeFile=args.treeFile, idxFile=args.idxFile, workers=args.workers)
     elif args.task == 'all':
         print(f'>> id_name: {args.id_name} ')
         print(f'>> dim: {args.dim} ')
@@ -161,10 +187,11 @@ def main():
         print(f'>> output: {args.output} ')
         print(f'>> treeFile: {args.treeFile} ')
         print(f'>> idxFile: {args.idxFile} ')
+        print(f'>> workers: {args.workers} ')
         Ann.build(id_name=args.id_name, dim=args.dim, input=args.input,
                   ntree=args.ntree, treeFile=args.treeFile, idxFile=args.idxFile)
         Ann.nn(id_name=args.id_name, dim=args.dim, output=args.output,
-               treeFile=args.treeFile, idxFile=args.idxFile)
+               treeFile=args.treeFile, idxFile=args.idxFile, workers=args.workers)
 
     else:
         raise Exception(f"Invalid task: {args.task}")
@@ -0,0 +1,50 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "adagrad.h"
+
+namespace track2vec
+{
+
+constexpr double Adagrad::EPSILON;
+
+Adagrad::Adagrad(int64_t rows) : sums_(new std::atomic<float>[rows]), rows_(rows)
+{
+    for (int64_t i = 0; i < rows; i++)
+    {
+        sums_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Adagrad::repair()
+{
+    for (int64_t i = 0; i < rows_; i++)
+    {
+        if (!std::isfinite(sums_[i].load(std::memory_order_relaxed)))
+        {
+            sums_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+std::vector<float> Adagrad::sums() const
+{
+    std::vector<float> sums(rows_);
+    for (int64_t i = 0; i < rows_; i++)
+    {
+        sums[i] = sums_[i].load(std::memory_order_relaxed);
+    }
+    return sums;
+}
+
+void Adagrad::setSums(const std::vector<float> &sums)
+{
+    for (int64_t i = 0; i < rows_; i++)
+    {
+        sums_[i].store(sums[i], std::memory_order_relaxed);
+    }
+}
+
+} // namespace track2vec
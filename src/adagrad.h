@@ -0,0 +1,54 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace track2vec
+{
+
+// Row-wise sparse Adagrad. Every row keeps one float, the sum of the mean
+// squared gradients it received, and its updates are scaled by the inverse
+// square root of that sum. Rows that are updated constantly slow down while
+// rarely seen rows keep the full rate. The sums are read and written without
+// locks like the rows themselves, a lost increment only makes a step larger.
+class Adagrad
+{
+private:
+    static constexpr double EPSILON = 1e-10;
+    
+    std::unique_ptr<std::atomic<float>[]> sums_;
+    int64_t rows_;
+
+public:
+    explicit Adagrad(int64_t);
+    
+    // restart the rows whose sums are no longer finite, after a rollback
+    void repair();
+    
+    // the sums as plain floats, for checkpoints
+    std::vector<float> sums() const;
+    void setSums(const std::vector<float> &);
+    
+    // add the mean squared gradient of row i and return the scale of its step
+    inline double scale(int64_t i, double meanSquare)
+    {
+        const float sum = sums_[i].load(std::memory_order_relaxed) + meanSquare;
+        sums_[i].store(sum, std::memory_order_relaxed);
+        return 1.0 / std::sqrt(sum + EPSILON);
+    }
+    
+    inline int64_t rows() const
+    {
+        return rows_;
+    }
+};
+
+} // namespace track2vec
@@ -19,19 +19,71 @@ Args::Args()
     ws = 3;           // size of the context window
     discard_t = 1e-4; // sampling threshold [0.0001]
     neg = 100;
+    model = "skipgram";
+    optimizer = "sgd";
+    loss = "ns";
     thread = sysconf(_SC_NPROCESSORS_ONLN);
+    threadAuto = 0;
+    autoGain = 0.05;
+    autoWindow = 2; // second
     epoch = 10;
     seed = 0;
     printInterval = 5; // second
     threadInterval = 1000;
     logBufferSize = 1000;
     lrUpdateRate = 100000; // token count
+    lrSchedule = "linear";
+    lrWarmup = 0; // fraction of training
+    lrMin = 0.001;
     pretrained_lr = 0.2;
+    pretrainedSchedule = "";
     loadPretrained = 1;
     verbose = 1;
-    es = 0.1;
+    es = 0;
+    esPatience = 0; // progress reports
+    esDelta = 0.001;
+    evalInput = "";
+    evalInterval = 60; // second
+    evalK = 10;
+    evalCases = 10000;
+    evalThreads = 1;
+    checkInterval = 10; // second
+    checkRows = 1000;
+    maxNorm = 100;
+    snapshotInterval = 0; // second
+    rollbackLr = 0.5;
+    checkpointInterval = 0; // second
+    checkpointTokens = 0;
+    resume = 0;
+    exportEpochs = 0;
+    exportInterval = 0; // second
+    serveLr = 0.005;
+    refreshInterval = 300; // second
     yyyymmddhh = "0000000000";
     memory = 0;
+    prefetch = 1;
+    hotCount = 0;
+    hotFlush = 256; // backprop count
+    numa = 0;
+    numaSync = 5; // second
+    alloc = "aligned";
+    pad = 1;
+    mmapDir = ""; // -output
+    lockRows = 100000; // tracks
+    chunkSize = 256; // sequences
+    affinity = 0;
+    smt = 1;
+    reserveCores = 0;
+    rank = 0;
+    world = 1;
+    coordinator = "127.0.0.1:7070";
+    distSync = 10; // second
+    deterministic = 0;
+    detRound = 64; // chunks
+    sweep = "";
+    sweepParallel = 0;
+    benchRows = 1000000;
+    benchPairs = 1000000;
 }
 
 void Args::printHelp() { std::cerr << "Print Help TBD" << std::endl; }
@@ -46,7 +98,11 @@ void Args::printValue()
     std::cerr << "yyyymmddhh: " << yyyymmddhh << std::endl;
     std::cerr << "lr: " << lr << std::endl;
     std::cerr << "lrUpdateRate: " << lrUpdateRate << std::endl;
+    std::cerr << "lrSchedule: " << lrSchedule << std::endl;
+    std::cerr << "lrWarmup: " << lrWarmup << std::endl;
+    std::cerr << "lrMin: " << lrMin << std::endl;
     std::cerr << "pretrained_lr: " << pretrained_lr << std::endl;
+    std::cerr << "pretrainedSchedule: " << pretrainedSchedule << std::endl;
     std::cerr << "loadPretrained: " << loadPretrained << std::endl;
     std::cerr << "memory: " << memory << std::endl;
     std::cerr << "discard_t: " << discard_t << std::endl;
@@ -54,12 +110,58 @@ void Args::printValue()
     std::cerr << "ws: " << ws << std::endl;
     std::cerr << "epoch: " << epoch << std::endl;
     std::cerr << "neg: " << neg << std::endl;
+    std::cerr << "model: " << model << std::endl;
+    std::cerr << "optimizer: " << optimizer << std::endl;
+    std::cerr << "loss: " << loss << std::endl;
     std::cerr << "printInterval: " << printInterval << std::endl;
     std::cerr << "logBufferSize: " << logBufferSize << std::endl;
     std::cerr << "thread: " << thread << std::endl;
+    std::cerr << "threadAuto: " << threadAuto << std::endl;
+    std::cerr << "autoGain: " << autoGain << std::endl;
+    std::cerr << "autoWindow: " << autoWindow << std::endl;
     std::cerr << "threadInterval: " << threadInterval << std::endl;
     std::cerr << "verbose: " << verbose << std::endl;
     std::cerr << "es: " << es << std::endl;
+    std::cerr << "esPatience: " << esPatience << std::endl;
+    std::cerr << "esDelta: " << esDelta << std::endl;
+    std::cerr << "evalInput: " << evalInput << std::endl;
+    std::cerr << "evalInterval: " << evalInterval << std::endl;
+    std::cerr << "evalK: " << evalK << std::endl;
+    std::cerr << "evalCases: " << evalCases << std::endl;
+    std::cerr << "evalThreads: " << evalThreads << std::endl;
+    std::cerr << "checkInterval: " << checkInterval << std::endl;
+    std::cerr << "checkRows: " << checkRows << std::endl;
+    std::cerr << "maxNorm: " << maxNorm << std::endl;
+    std::cerr << "snapshotInterval: " << snapshotInterval << std::endl;
+    std::cerr << "rollbackLr: " << rollbackLr << std::endl;
+    std::cerr << "checkpointInterval: " << checkpointInterval << std::endl;
+    std::cerr << "checkpointTokens: " << checkpointTokens << std::endl;
+    std::cerr << "resume: " << resume << std::endl;
+    std::cerr << "exportEpochs: " << exportEpochs << std::endl;
+    std::cerr << "exportInterval: " << exportInterval << std::endl;
+    std::cerr << "serveLr: " << serveLr << std::endl;
+    std::cerr << "refreshInterval: " << refreshInterval << std::endl;
+    std::cerr << "prefetch: " << prefetch << std::endl;
+    std::cerr << "hotCount: " << hotCount << std::endl;
+    std::cerr << "hotFlush: " << hotFlush << std::endl;
+    std::cerr << "numa: " << numa << std::endl;
+    std::cerr << "numaSync: " << numaSync << std::endl;
+    std::cerr << "alloc: " << alloc << std::endl;
+    std::cerr << "pad: " << pad << std::endl;
+    std::cerr << "mmapDir: " << mmapDir << std::endl;
+    std::cerr << "lockRows: " << lockRows << std::endl;
+    std::cerr << "chunkSize: " << chunkSize << std::endl;
+    std::cerr << "affinity: " << affinity << std::endl;
+    std::cerr << "smt: " << smt << std::endl;
+    std::cerr << "reserveCores: " << reserveCores << std::endl;
+    std::cerr << "rank: " << rank << std::endl;
+    std::cerr << "world: " << world << std::endl;
+    std::cerr << "coordinator: " << coordinator << std::endl;
+    std::cerr << "distSync: " << distSync << std::endl;
+    std::cerr << "deterministic: " << deterministic << std::endl;
+    std::cerr << "detRound: " << detRound << std::endl;
+    std::cerr << "sweep: " << sweep << std::endl;
+    std::cerr << "sweepParallel: " << sweepParallel << std::endl;
 }
 
 void Args::parseArgs(const std::vector<std::string> &args)
@@ -115,10 +217,26 @@ void Args::parseArgs(const std::vector<std::string> &args)
             {
                 lrUpdateRate = std::stoi(args.at(i + 1));
             }
+            else if (param == "-lrSchedule")
+            {
+                lrSchedule = std::string(args.at(i + 1));
+            }
+            else if (param == "-lrWarmup")
+            {
+                lrWarmup = std::stof(args.at(i + 1));
+            }
+            else if (param == "-lrMin")
+            {
+                lrMin = std::stof(args.at(i + 1));
+            }
             else if (param == "-pretrained_lr")
             {
                 pretrained_lr = std::stof(args.at(i + 1));
             }
+            else if (param == "-pretrainedSchedule")
+            {
+                pretrainedSchedule = std::string(args.at(i + 1));
+            }
             else if (param == "-discard_t")
             {
                 discard_t = std::stof(args.at(i + 1));
@@ -139,6 +257,18 @@ void Args::parseArgs(const std::vector<std::string> &args)
             {
                 neg = std::stoi(args.at(i + 1));
             }
+            else if (param == "-model")
+            {
+                model = std::string(args.at(i + 1));
+            }
+            else if (param == "-optimizer")
+            {
+                optimizer = std::string(args.at(i + 1));
+            }
+            else if (param == "-loss")
+            {
+                loss = std::string(args.at(i + 1));
+            }
             else if (param == "-printInterval")
             {
                 printInterval = std::stoi(args.at(i + 1));
@@ -149,7 +279,25 @@ void Args::parseArgs(const std::vector<std::string> &args)
             }
             else if (param == "-thread")
             {
-                thread = std::stoi(args.at(i + 1));
+                // "auto" starts from every online cpu and lets training pick the count
+                if (args.at(i + 1) == "auto")
+                {
+                    thread = sysconf(_SC_NPROCESSORS_ONLN);
+                    threadAuto = 1;
+                }
+                else
+                {
+                    thread = std::stoi(args.at(i + 1));
+                    threadAuto = 0;
+                }
+            }
+            else if (param == "-autoGain")
+            {
+                autoGain = std::stof(args.at(i + 1));
+            }
+            else if (param == "-autoWindow")
+            {
+                autoWindow = std::stoi(args.at(i + 1));
             }
             else if (param == "-threadInterval")
             {
@@ -163,6 +311,82 @@ void Args::parseArgs(const std::vector<std::string> &args)
             {
                 es = std::stof(args.at(i + 1));
             }
+            else if (param == "-esPatience")
+            {
+                esPatience = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-esDelta")
+            {
+                esDelta = std::stof(args.at(i + 1));
+            }
+            else if (param == "-evalInput")
+            {
+                evalInput = std::string(args.at(i + 1));
+            }
+            else if (param == "-evalInterval")
+            {
+                evalInterval = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-evalK")
+            {
+                evalK = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-evalCases")
+            {
+                evalCases = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-evalThreads")
+            {
+                evalThreads = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-checkInterval")
+            {
+                checkInterval = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-checkRows")
+            {
+                checkRows = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-maxNorm")
+            {
+                maxNorm = std::stof(args.at(i + 1));
+            }
+            else if (param == "-snapshotInterval")
+            {
+                snapshotInterval = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-rollbackLr")
+            {
+                rollbackLr = std::stof(args.at(i + 1));
+            }
+            else if (param == "-checkpointInterval")
+            {
+                checkpointInterval = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-checkpointTokens")
+            {
+                checkpointTokens = std::stoll(args.at(i + 1));
+            }
+            else if (param == "-resume")
+            {
+                resume = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-exportEpochs")
+            {
+                exportEpochs = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-exportInterval")
+            {
+                exportInterval = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-serveLr")
+            {
+                serveLr = std::stof(args.at(i + 1));
+            }
+            else if (param == "-refreshInterval")
+            {
+                refreshInterval = std::stoi(args.at(i + 1));
+            }
             else if (param == "-memory")
             {
                 memory = std::stoi(args.at(i + 1));
@@ -171,6 +395,98 @@ void Args::parseArgs(const std::vector<std::string> &args)
             {
                 loadPretrained = std::stoi(args.at(i + 1));
             }
+            else if (param == "-prefetch")
+            {
+                prefetch = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-hotCount")
+            {
+                hotCount = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-hotFlush")
+            {
+                hotFlush = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-numa")
+            {
+                numa = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-numaSync")
+            {
+                numaSync = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-alloc")
+            {
+                alloc = std::string(args.at(i + 1));
+            }
+            else if (param == "-pad")
+            {
+                pad = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-mmapDir")
+            {
+                mmapDir = std::string(args.at(i + 1));
+            }
+            else if (param == "-lockRows")
+            {
+                lockRows = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-chunkSize")
+            {
+                chunkSize = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-affinity")
+            {
+                affinity = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-smt")
+            {
+                smt = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-reserveCores")
+            {
+                reserveCores = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-rank")
+            {
+                rank = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-world")
+            {
+                world = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-coordinator")
+            {
+                coordinator = std::string(args.at(i + 1));
+            }
+            else if (param == "-distSync")
+            {
+                distSync = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-deterministic")
+            {
+                deterministic = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-detRound")
+            {
+                detRound = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-sweep")
+            {
+                sweep = std::string(args.at(i + 1));
+            }
+            else if (param == "-sweepParallel")
+            {
+                sweepParallel = std::stoi(args.at(i + 1));
+            }
+            else if (param == "-benchRows")
+            {
+                benchRows = std::stoll(args.at(i + 1));
+            }
+            else if (param == "-benchPairs")
+            {
+                benchPairs = std::stoll(args.at(i + 1));
+            }
             else
             {
                 std::cerr << "Unknown argument: " << args[i] << std::endl;
@@ -188,6 +504,50 @@ void Args::parseArgs(const std::vector<std::string> &args)
     
     printValue();
     
+    if (model != "skipgram" && model != "cbow")
+    {
+        std::cerr << "-model must be skipgram or cbow" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    for (const std::string &schedule : {lrSchedule, pretrainedSchedule.empty() ? lrSchedule : pretrainedSchedule})
+    {
+        if (schedule != "linear" && schedule != "cosine" && schedule != "constant")
+        {
+            std::cerr << "-lrSchedule and -pretrainedSchedule must be linear, cosine or constant" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (lrWarmup < 0 || lrWarmup >= 1)
+    {
+        std::cerr << "-lrWarmup must be a fraction of training in [0, 1)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (optimizer != "sgd" && optimizer != "adagrad")
+    {
+        std::cerr << "-optimizer must be sgd or adagrad" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (loss != "ns" && loss != "hs")
+    {
+        std::cerr << "-loss must be ns (negative sampling) or hs (hierarchical softmax)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    // matrix files belong on a disk, /tmp is often tmpfs and thus in RAM
+    if (mmapDir.empty())
+    {
+        mmapDir = outputDir.empty() ? "." : outputDir;
+    }
+    
+    if (args[1] == "bench" || args[1] == "coordinator")
+    {
+        return;
+    }
+    
     if (input.empty() || outputDir.empty() || metaFileName.empty())
     {
         std::cerr << "One of the requried inputs is empty (input, meta or output)"
@@ -195,6 +555,49 @@ void Args::parseArgs(const std::vector<std::string> &args)
         printHelp();
         exit(EXIT_FAILURE);
     }
+    
+    if (deterministic > 0 && memory == 0)
+    {
+        std::cerr << "-deterministic requires the training data in memory (-memory 1)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (optimizer == "adagrad" && deterministic > 0)
+    {
+        std::cerr << "-optimizer adagrad cannot be combined with -deterministic" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (threadAuto > 0 && deterministic > 0)
+    {
+        std::cerr << "-thread auto cannot be combined with -deterministic" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (world > 1 && (memory == 0 || deterministic > 0 || numa > 0))
+    {
+        std::cerr << "-world > 1 requires -memory 1 and cannot be combined with -deterministic or -numa" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (rank < 0 || rank >= world)
+    {
+        std::cerr << "-rank must be in [0, world)" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (args[1] == "sweep" && (sweep.empty() || memory == 0 || numa > 0 || world > 1 || affinity > 0))
+    {
+        std::cerr << "sweep requires -sweep and -memory 1 and cannot be combined with -numa, -world or -affinity" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    if (args[1] == "serve-train" && (exportInterval <= 0 || memory > 0 || deterministic > 0 ||
+                                   numa > 0 || world > 1 || threadAuto > 0))
+    {
+        std::cerr << "serve-train requires -exportInterval and cannot be combined with -memory, -deterministic, -numa, -world or -thread auto" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 }
 
 } // namespace track2vec
@@ -32,12 +32,21 @@ public:
     std::string s3Log;
     std::string localLog;
     double lr;
+    std::string lrSchedule;
+    double lrWarmup;
+    double lrMin;
     int64_t dim;
     int64_t ntree;
     int64_t ws;
     int64_t epoch;
     int64_t neg;
+    std::string model;
+    std::string optimizer;
+    std::string loss;
     int64_t thread;
+    int64_t threadAuto;
+    double autoGain;
+    int64_t autoWindow;
     int64_t threadInterval;
     int64_t verbose;
     double discard_t;
@@ -46,9 +55,52 @@ public:
     int64_t lrUpdateRate;
     int64_t logBufferSize;
     double pretrained_lr;
+    std::string pretrainedSchedule;
     double es;
+    int64_t esPatience;
+    double esDelta;
+    std::string evalInput;
+    int64_t evalInterval;
+    int64_t evalK;
+    int64_t evalCases;
+    int64_t evalThreads;
+    int64_t checkInterval;
+    int64_t checkRows;
+    double maxNorm;
+    int64_t snapshotInterval;
+    double rollbackLr;
+    int64_t checkpointInterval;
+    int64_t checkpointTokens;
+    int64_t resume;
+    int64_t exportEpochs;
+    int64_t exportInterval;
+    double serveLr;
+    int64_t refreshInterval;
     int64_t memory;
     int64_t loadPretrained;
+    int64_t prefetch;
+    int64_t hotCount;
+    int64_t hotFlush;
+    int64_t numa;
+    int64_t numaSync;
+    std::string alloc;
+    int64_t pad;
+    std::string mmapDir;
+    int64_t lockRows;
+    int64_t chunkSize;
+    int64_t affinity;
+    int64_t smt;
+    int64_t reserveCores;
+    int64_t rank;
+    int64_t world;
+    std::string coordinator;
+    int64_t distSync;
+    int64_t deterministic;
+    int64_t detRound;
+    std::string sweep;
+    int64_t sweepParallel;
+    int64_t benchRows;
+    int64_t benchPairs;
 };
 
 
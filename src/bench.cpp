@@ -0,0 +1,358 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "bench.h"
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "loss.h"
+#include "matrix.h"
+#include "model.h"
+#include "utils.h"
+
+namespace track2vec
+{
+
+namespace
+{
+
+// resident anonymous huge pages of this process in kB, -1 when unknown
+int64_t anonHugePages()
+{
+    std::ifstream ifs("/proc/self/smaps_rollup");
+    for (std::string line; std::getline(ifs, line);)
+    {
+        if (0 == line.compare(0, 14, "AnonHugePages:"))
+        {
+            return std::stoll(line.substr(14));
+        }
+    }
+    return -1;
+}
+
+// ns per random dotRow + addVectorToRow on the matrix
+double randomRows(Matrix &matrix, const Args &args, double &sum)
+{
+    Vector vec(args.dim);
+    Random rng(args.seed);
+    
+    for (int64_t j = 0; j < args.dim; j++)
+    {
+        vec[j] = rng.uniform() - 0.5;
+    }
+    
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int64_t i = 0; i < args.benchPairs; i++)
+    {
+        int64_t row = rng.uniformInt(matrix.size(0));
+        sum += matrix.dotRow(vec, row);
+        matrix.addVectorToRow(vec, row, 1e-9);
+    }
+    
+    return 1e9 * utils::getDuration(start, std::chrono::steady_clock::now()) / args.benchPairs;
+}
+
+// upper tail of the chi-square distribution, Wilson-Hilferty approximation
+double chiSquareTail(double chi2, int64_t df)
+{
+    const double k = 2.0 / (9.0 * df);
+    const double z = (std::cbrt(chi2 / df) - (1 - k)) / std::sqrt(k);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+} // namespace
+
+Bench::Bench(std::shared_ptr<Args> args) : args_(args) {}
+
+void Bench::run()
+{
+    std::cerr << ">> bench rows: " << args_->benchRows << " dim: " << args_->dim;
+    std::cerr << " neg: " << args_->neg << " pairs: " << args_->benchPairs << std::endl;
+    
+    // the draws of the training loop against the std::minstd_rand and
+    // distributions they replaced
+    const int64_t ws = args_->ws;
+    sampling("window", ws + 1,
+             [&](Random &rng) { return 1 + rng.uniformInt(ws); },
+             [&](std::minstd_rand &rng) { return std::uniform_int_distribution<>(1, ws)(rng); });
+    
+    // a table with sqrt(zipf count) slots per track, as initNegative() builds
+    const int64_t tracks = 1000;
+    std::vector<int64_t> table;
+    for (int64_t i = 0; i < tracks; i++)
+    {
+        table.insert(table.end(), int64_t(std::ceil(std::sqrt(1000000.0 / (i + 1)))), i);
+    }
+    sampling("negative", tracks,
+             [&](Random &rng) { return table[rng.uniformInt(table.size())]; },
+             [&](std::minstd_rand &rng) {
+                 return table[std::uniform_int_distribution<size_t>(0, table.size() - 1)(rng)];
+             });
+    
+    // keep probabilities are compared to the draw, so its histogram decides
+    const int64_t bins = 1000;
+    sampling("discard", bins,
+             [&](Random &rng) { return int64_t(rng.uniform() * bins); },
+             [&](std::minstd_rand &rng) { return int64_t(std::uniform_real_distribution<>(0, 1)(rng) * bins); });
+    
+    double base = lossForward(false);
+    double prefetch = lossForward(true);
+    report("loss forward (prefetch)", base, prefetch);
+    report("loss forward (hierarchical softmax)", prefetch, lossForward(false, true));
+    
+    double shared = sharedRows(false);
+    double buffered = sharedRows(true);
+    report("shared row backprop (thread-local hot rows)", shared, buffered);
+    
+    double standard = rowAccess("standard");
+    double aligned = rowAccess("aligned");
+    double huge = rowAccess("huge");
+    report("random row access (aligned)", standard, aligned);
+    report("random row access (huge)", standard, huge);
+    
+    // throughput penalty of the tail of a file-backed matrix living on disk
+    double resident = mappedAccess(1.0);
+    for (double fraction : {0.5, 0.1, 0.0})
+    {
+        std::ostringstream name;
+        name << "random row access (mmap, " << int(100 * fraction) << " % resident)";
+        report(name.str(), resident, mappedAccess(fraction));
+    }
+}
+
+// Two-sample chi-square test of benchPairs draws of each generator over
+// [0, bins). Throws when the histograms differ at the 0.1 % level.
+void Bench::sampling(const std::string &name, int64_t bins,
+                     const std::function<int64_t(Random &)> &draw,
+                     const std::function<int64_t(std::minstd_rand &)> &baseline) const
+{
+    Random rng(args_->seed);
+    std::minstd_rand minstd(args_->seed);
+    std::vector<int64_t> counts(bins), baseCounts(bins);
+    
+    for (int64_t i = 0; i < args_->benchPairs; i++)
+    {
+        counts[draw(rng)]++;
+        baseCounts[baseline(minstd)]++;
+    }
+    
+    double chi2 = 0.0;
+    int64_t df = -1;
+    for (int64_t b = 0; b < bins; b++)
+    {
+        const int64_t n = counts[b] + baseCounts[b];
+        if (n > 0)
+        {
+            chi2 += double(counts[b] - baseCounts[b]) * (counts[b] - baseCounts[b]) / n;
+            df++;
+        }
+    }
+    const double p = df > 0 ? chiSquareTail(chi2, df) : 1.0;
+    
+    std::cout << std::fixed;
+    std::cout << "sampling " << name << " (xoshiro vs minstd): chi2 " << chi2 << " df " << df;
+    std::cout << " p " << p << std::endl;
+    
+    if (p < 0.001)
+    {
+        throw std::runtime_error("sampling " + name + " differs from the std::minstd_rand baseline");
+    }
+}
+
+void Bench::report(const std::string &name, double base, double value) const
+{
+    std::cout << std::fixed;
+    std::cout << name << ": " << base << " -> " << value << " ns/op";
+    std::cout << " saved: " << base - value << " ns/op";
+    std::cout << " (" << 100.0 * (base - value) / base << " %)" << std::endl;
+}
+
+// Skipgram-shaped workload on a synthetic output matrix: every center draws
+// a window of zipf-distributed targets and runs the loss for each of them.
+double Bench::lossForward(bool prefetch, bool hs)
+{
+    const int64_t rows = args_->benchRows;
+    std::shared_ptr<Matrix> output = std::make_shared<Matrix>(rows, args_->dim);
+    output->randomInit(args_->seed, args_->thread);
+    
+    std::vector<int64_t> counts(rows);
+    for (int64_t i = 0; i < rows; i++)
+    {
+        counts[i] = 1 + 1000000 / (i + 1);
+    }
+    
+    std::shared_ptr<Loss> loss;
+    if (hs)
+    {
+        loss = std::make_shared<HierarchicalSoftmaxLoss>(output, HierarchicalSoftmaxLoss::buildTree(counts));
+    }
+    else
+    {
+        auto negativeSampling = std::make_shared<NegativeSamplingLoss>(output, args_->neg, prefetch);
+        negativeSampling->initNegative(counts);
+        loss = negativeSampling;
+    }
+    
+    model::State state(args_->dim, rows, args_->seed);
+    for (int64_t j = 0; j < args_->dim; j++)
+    {
+        state.hidden[j] = state.rng.uniform() - 0.5;
+    }
+    
+    const int64_t window = 2 * args_->ws;
+    int64_t pairs = 0;
+    std::set<int64_t> outputs;
+    
+    auto start = std::chrono::steady_clock::now();
+    uint64_t cycles = utils::cycles();
+    
+    while (pairs < args_->benchPairs)
+    {
+        outputs.clear();
+        for (int64_t c = 0; c < window; c++)
+        {
+            outputs.insert(state.rng.uniformInt(rows));
+        }
+        
+        if (prefetch)
+        {
+            loss->drawNegatives(outputs.size(), outputs, state);
+        }
+        
+        for (int64_t output_idx : outputs)
+        {
+            state.grad.zero();
+            loss->forward(output_idx, outputs, state, 0.0);
+            pairs++;
+        }
+    }
+    
+    cycles = utils::cycles() - cycles;
+    double ns = 1e9 * utils::getDuration(start, std::chrono::steady_clock::now()) / pairs;
+    
+    std::cerr << ">> loss forward " << (hs ? "hs" : "ns") << " prefetch=" << prefetch << ": " << ns << " ns/pair";
+    if (cycles > 0)
+    {
+        std::cerr << " " << double(cycles) / pairs << " cycles/pair";
+    }
+    std::cerr << std::endl;
+    
+    return ns;
+}
+
+// Every thread backprops into its own track rows plus a handful of artist and
+// genre rows shared by all threads, which is what makes cache lines bounce.
+double Bench::sharedRows(bool buffered)
+{
+    const int64_t nhot = 16;
+    const int64_t rows = args_->benchRows + nhot;
+    std::shared_ptr<Matrix> input = std::make_shared<Matrix>(rows, args_->dim);
+    std::shared_ptr<Matrix> output = std::make_shared<Matrix>(1, args_->dim);
+    input->zero(args_->thread);
+    output->zero();
+    
+    std::shared_ptr<Loss> loss = std::make_shared<NegativeSamplingLoss>(output, args_->neg);
+    Model model(input, output, loss);
+    
+    if (buffered)
+    {
+        std::vector<int64_t> hot;
+        for (int64_t i = 0; i < nhot; i++)
+        {
+            hot.push_back(args_->benchRows + i);
+        }
+        model.setHotRows(hot, args_->hotFlush);
+    }
+    
+    const int64_t updates = args_->benchPairs;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (int64_t t = 0; t < args_->thread; t++)
+    {
+        threads.push_back(std::thread([&, t]() {
+            model::State state(args_->dim, 1, args_->seed + t);
+            std::vector<int64_t> artists(1), genres(1);
+            
+            for (int64_t i = 0; i < updates; i++)
+            {
+                int64_t track = state.rng.uniformInt(args_->benchRows);
+                artists[0] = args_->benchRows + state.rng.uniformInt(nhot - 2);
+                genres[0] = args_->benchRows + nhot - 1 - state.rng.uniformInt(2);
+                
+                state.grad[0] = 1.0;
+                model.backprop(track, artists, genres, state.grad, 1.0, state);
+            }
+            model.flush(state);
+        }));
+    }
+    
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    
+    double ns = 1e9 * utils::getDuration(start, std::chrono::steady_clock::now()) / updates;
+    
+    std::cerr << ">> shared row backprop buffered=" << buffered << " thread=" << args_->thread;
+    std::cerr << ": " << ns << " ns/update/thread" << std::endl;
+    
+    return ns;
+}
+
+// Dot product and update of uniformly random rows, the access pattern of
+// negative sampling, so most of the cost is cache and TLB misses.
+double Bench::rowAccess(const std::string &name)
+{
+    std::shared_ptr<Allocator> allocator = Allocator::create(name, args_->pad > 0);
+    Matrix matrix(args_->benchRows, args_->dim, allocator);
+    matrix.zero(args_->thread);
+    
+    double sum = 0.0;
+    double ns = randomRows(matrix, *args_, sum);
+    
+    std::cerr << ">> random row access alloc=" << name << ": " << ns << " ns/row";
+    std::cerr << " AnonHugePages: " << anonHugePages() << " kB";
+    std::cerr << " (checksum " << sum << ")" << std::endl;
+    
+    return ns;
+}
+
+// Random row access on a file-backed matrix after every row past the given
+// fraction was written back and dropped from memory
+double Bench::mappedAccess(double fraction)
+{
+    const int64_t rows = args_->benchRows;
+    std::shared_ptr<MappedFileAllocator> allocator =
+        std::make_shared<MappedFileAllocator>(args_->pad > 0, args_->mmapDir);
+    Matrix matrix(rows, args_->dim, allocator);
+    matrix.zero(args_->thread);
+    
+    const double *base = &matrix.at(0, 0);
+    const size_t bytes = (rows > 1 ? &matrix.at(1, 0) - base : args_->dim) * rows * sizeof(double);
+    const size_t keep = size_t(fraction * bytes);
+    allocator->evict(base + keep / sizeof(double), bytes - keep);
+    
+    const double before = MappedFileAllocator::resident(base, bytes);
+    double sum = 0.0;
+    double ns = randomRows(matrix, *args_, sum);
+    const double after = MappedFileAllocator::resident(base, bytes);
+    
+    std::cerr << ">> random row access alloc=mmap dir=" << args_->mmapDir << ": " << ns << " ns/row";
+    std::cerr << " resident: " << 100.0 * before << " % -> " << 100.0 * after << " %";
+    std::cerr << " (checksum " << sum << ")" << std::endl;
+    
+    return ns;
+}
+
+} // namespace track2vec
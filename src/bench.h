@@ -0,0 +1,38 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+
+#include "args.h"
+#include "random.h"
+
+namespace track2vec
+{
+
+class Bench
+{
+private:
+    std::shared_ptr<Args> args_;
+    
+    void sampling(const std::string &, int64_t,
+                  const std::function<int64_t(Random &)> &,
+                  const std::function<int64_t(std::minstd_rand &)> &) const;
+    double lossForward(bool, bool hs = false);
+    double sharedRows(bool);
+    double rowAccess(const std::string &);
+    double mappedAccess(double);
+    void report(const std::string &, double, double) const;
+    
+public:
+    explicit Bench(std::shared_ptr<Args>);
+    void run();
+};
+
+} // namespace track2vec
@@ -0,0 +1,246 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+
+#include "pool.h"
+
+namespace track2vec
+{
+
+namespace
+{
+
+const char MAGIC[8] = {'T', '2', 'V', 'C', 'K', 'P', 'T', '1'};
+
+static_assert(std::is_trivially_copyable<Random>::value, "Random is written as raw bytes");
+
+template <typename T>
+void put(std::ostream &os, const T &value)
+{
+    os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+void putVector(std::ostream &os, const std::vector<T> &values)
+{
+    put<int64_t>(os, values.size());
+    os.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(T));
+}
+
+// the same layout as putVector, one averaged row at a time
+void putRows(std::ostream &os, const std::vector<std::shared_ptr<Matrix>> &copies)
+{
+    const Matrix &first = *copies[0];
+    const int64_t dim = first.cols();
+    put<int64_t>(os, first.rows() * dim);
+    
+    std::vector<double> row(dim);
+    for (int64_t i = 0; i < first.rows(); i++)
+    {
+        if (copies.size() == 1)
+        {
+            os.write(reinterpret_cast<const char *>(&first.at(i, 0)), dim * sizeof(double));
+            continue;
+        }
+        
+        std::fill(row.begin(), row.end(), 0.0);
+        for (const std::shared_ptr<Matrix> &matrix : copies)
+        {
+            for (int64_t j = 0; j < dim; j++)
+            {
+                row[j] += matrix->at(i, j);
+            }
+        }
+        for (int64_t j = 0; j < dim; j++)
+        {
+            row[j] /= copies.size();
+        }
+        os.write(reinterpret_cast<const char *>(row.data()), dim * sizeof(double));
+    }
+}
+
+template <typename T>
+void get(std::istream &is, T &value)
+{
+    is.read(reinterpret_cast<char *>(&value), sizeof(T));
+}
+
+template <typename T>
+void getVector(std::istream &is, std::vector<T> &values)
+{
+    int64_t n = 0;
+    get(is, n);
+    if (!is || n < 0)
+        return;
+    
+    values.resize(n);
+    is.read(reinterpret_cast<char *>(values.data()), n * sizeof(T));
+}
+
+// the size of a putVector and where its values start, which are skipped
+void skipVector(std::istream &is, int64_t &size, int64_t &offset)
+{
+    get(is, size);
+    offset = is.tellg();
+    is.seekg(size * sizeof(double), std::ios_base::cur);
+}
+
+} // namespace
+
+Checkpoint::Checkpoint()
+: version(0),
+mode(STREAM),
+processed(0),
+epoch(0),
+next(0),
+lrFactor(1.0),
+loss(-1),
+bestLoss(-1),
+staleReports(0),
+dim(0),
+inputSize(0),
+outputSize(0),
+inputOffset(0),
+outputOffset(0) {}
+
+void Checkpoint::write(const std::string &filename) const
+{
+    const std::string tmp = filename + ".tmp";
+    std::ofstream ofs(tmp, std::ofstream::binary);
+    if (!ofs.is_open())
+    {
+        throw std::invalid_argument(tmp + " cannot be opened for saving a checkpoint!");
+    }
+    
+    ofs.write(MAGIC, sizeof(MAGIC));
+    put(ofs, version);
+    put(ofs, mode);
+    put(ofs, processed);
+    put(ofs, epoch);
+    put(ofs, next);
+    putVector(ofs, chunks);
+    
+    put<int64_t>(ofs, trainers.size());
+    for (const Trainer &trainer : trainers)
+    {
+        put(ofs, trainer.rng);
+        put(ofs, trainer.position);
+    }
+    
+    put(ofs, lrFactor);
+    put(ofs, loss);
+    put(ofs, bestLoss);
+    put(ofs, staleReports);
+    put(ofs, dim);
+    putRows(ofs, input);
+    putRows(ofs, output);
+    putVector(ofs, inputSums);
+    putVector(ofs, outputSums);
+    
+    ofs.close();
+    if (!ofs)
+    {
+        throw std::runtime_error(tmp + " could not be written!");
+    }
+    
+    if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+    {
+        throw std::runtime_error(tmp + " could not be renamed to " + filename);
+    }
+}
+
+std::shared_ptr<Checkpoint> Checkpoint::read(const std::string &filename)
+{
+    std::ifstream ifs(filename, std::ifstream::binary);
+    if (!ifs.is_open())
+    {
+        throw std::invalid_argument(filename + " cannot be opened for resuming!");
+    }
+    
+    char magic[sizeof(MAGIC)];
+    ifs.read(magic, sizeof(magic));
+    if (!ifs || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+    {
+        throw std::invalid_argument(filename + " is not a track2vec checkpoint!");
+    }
+    
+    auto checkpoint = std::make_shared<Checkpoint>();
+    get(ifs, checkpoint->version);
+    get(ifs, checkpoint->mode);
+    get(ifs, checkpoint->processed);
+    get(ifs, checkpoint->epoch);
+    get(ifs, checkpoint->next);
+    getVector(ifs, checkpoint->chunks);
+    
+    int64_t ntrainers = 0;
+    get(ifs, ntrainers);
+    for (int64_t i = 0; ifs && i < ntrainers; i++)
+    {
+        Trainer trainer{Random(0), -1};
+        get(ifs, trainer.rng);
+        get(ifs, trainer.position);
+        checkpoint->trainers.push_back(trainer);
+    }
+    
+    get(ifs, checkpoint->lrFactor);
+    get(ifs, checkpoint->loss);
+    get(ifs, checkpoint->bestLoss);
+    get(ifs, checkpoint->staleReports);
+    get(ifs, checkpoint->dim);
+    skipVector(ifs, checkpoint->inputSize, checkpoint->inputOffset);
+    skipVector(ifs, checkpoint->outputSize, checkpoint->outputOffset);
+    getVector(ifs, checkpoint->inputSums);
+    getVector(ifs, checkpoint->outputSums);
+    
+    if (!ifs)
+    {
+        throw std::invalid_argument(filename + " is truncated!");
+    }
+    checkpoint->filename = filename;
+    return checkpoint;
+}
+
+void Checkpoint::paste(Matrix &input, Matrix &output) const
+{
+    std::ifstream ifs(filename, std::ifstream::binary);
+    auto rows = [&](int64_t offset, Matrix &matrix) {
+        std::vector<double> row(matrix.cols());
+        ifs.seekg(offset);
+        for (int64_t i = 0; i < matrix.rows(); i++)
+        {
+            ifs.read(reinterpret_cast<char *>(row.data()), row.size() * sizeof(double));
+            matrix.setRow(i, row.data());
+        }
+    };
+    
+    rows(inputOffset, input);
+    rows(outputOffset, output);
+    if (!ifs)
+    {
+        throw std::invalid_argument(filename + " is truncated!");
+    }
+}
+
+std::shared_ptr<Matrix> Checkpoint::copy(const Matrix &matrix)
+{
+    auto data = std::make_shared<Matrix>(matrix.rows(), matrix.cols());
+    ThreadPool::global().parallelFor(matrix.rows(), [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            data->setRow(i, &matrix.at(i, 0));
+        }
+    }, 4096);
+    return data;
+}
+
+} // namespace track2vec
@@ -0,0 +1,86 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "matrix.h"
+#include "random.h"
+
+namespace track2vec
+{
+
+// Everything a run needs to go on where it stopped: both matrices and the
+// Adagrad sums, the processed token count, the rate factor left by rollbacks
+// and the position of the trainers. A checkpoint belongs to the dictionary it
+// was trained on, see Dictionary::version(). write() goes through a temporary
+// file, so a crash while writing keeps the previous one. The matrices are
+// streamed row by row both ways and never held in memory as a whole.
+struct Checkpoint
+{
+    enum Mode : int64_t
+    {
+        STREAM = 0,
+        MEMORY = 1,
+        DETERMINISTIC = 2
+    };
+    
+    struct Trainer
+    {
+        Random rng;
+        // byte offset in -input when streaming
+        int64_t position;
+    };
+    
+    uint64_t version;
+    int64_t mode;
+    int64_t processed;
+    
+    // in memory the chunks of epoch nobody took yet, deterministic runs go
+    // on with the round starting at chunk next of epoch
+    int64_t epoch;
+    int64_t next;
+    std::vector<int64_t> chunks;
+    
+    std::vector<Trainer> trainers;
+    double lrFactor;
+    double loss;
+    double bestLoss;
+    int64_t staleReports;
+    
+    int64_t dim;
+    std::vector<float> inputSums;
+    std::vector<float> outputSums;
+    
+    // the rows write() streams, read as the average of the copies (the -numa
+    // replicas). The live matrices unless the run is deterministic, which
+    // writes exact copies, see Track2Vec::capture.
+    std::vector<std::shared_ptr<Matrix>> input;
+    std::vector<std::shared_ptr<Matrix>> output;
+    
+    // where read() found the rows, for paste()
+    std::string filename;
+    int64_t inputSize;
+    int64_t outputSize;
+    int64_t inputOffset;
+    int64_t outputOffset;
+    
+    Checkpoint();
+    
+    void write(const std::string &) const;
+    static std::shared_ptr<Checkpoint> read(const std::string &);
+    
+    // reads the rows of both matrices back from the file
+    void paste(Matrix &, Matrix &) const;
+    
+    // row by row on the thread pool, the copy drops the padding
+    static std::shared_ptr<Matrix> copy(const Matrix &);
+};
+
+} // namespace track2vec
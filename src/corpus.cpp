@@ -0,0 +1,26 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "corpus.h"
+
+namespace track2vec
+{
+
+Corpus::Corpus(std::shared_ptr<Allocator> allocator)
+: offsets_(allocator), tokens_(allocator)
+{
+    offsets_.push_back(0);
+}
+
+void Corpus::add(const std::vector<int64_t> &tracks)
+{
+    for (int64_t track : tracks)
+    {
+        tokens_.push_back(int32_t(track));
+    }
+    offsets_.push_back(tokens_.size());
+}
+
+} // namespace track2vec
@@ -0,0 +1,53 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "memory.h"
+
+namespace track2vec
+{
+
+// In-memory training sequences in CSR form: the track row indices of all
+// sequences back to back, and the offset of every sequence into them.
+class Corpus
+{
+private:
+    Buffer<int64_t> offsets_;
+    Buffer<int32_t> tokens_;
+    
+public:
+    explicit Corpus(std::shared_ptr<Allocator>);
+    
+    void add(const std::vector<int64_t> &);
+    
+    inline int64_t size() const
+    {
+        return offsets_.size() - 1;
+    }
+    inline int64_t ntokens() const
+    {
+        return tokens_.size();
+    }
+    inline const int32_t *sequence(int64_t i) const
+    {
+        return tokens_.data() + offsets_[i];
+    }
+    inline int64_t length(int64_t i) const
+    {
+        return offsets_[i + 1] - offsets_[i];
+    }
+    // tokens of the sequences [begin, end)
+    inline int64_t ntokens(int64_t begin, int64_t end) const
+    {
+        return offsets_[end] - offsets_[begin];
+    }
+};
+
+} // namespace track2vec
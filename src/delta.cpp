@@ -0,0 +1,60 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "delta.h"
+
+#include <algorithm>
+
+#include "matrix.h"
+#include "vector.h"
+
+namespace track2vec
+{
+
+Delta::Delta(int64_t dim) : dim_(dim) {}
+
+void Delta::add(int64_t row, const Vector &vec, double a)
+{
+    auto it = slots_.find(row);
+    int64_t slot;
+    
+    if (it == slots_.end())
+    {
+        slot = rows_.size();
+        slots_.emplace(row, slot);
+        rows_.push_back(row);
+        data_.resize(data_.size() + dim_, 0.0);
+    }
+    else
+    {
+        slot = it->second;
+    }
+    
+    double *delta = data_.data() + slot * dim_;
+    for (int64_t j = 0; j < dim_; j++)
+    {
+        delta[j] += a * vec[j];
+    }
+}
+
+void Delta::clear()
+{
+    slots_.clear();
+    rows_.clear();
+    data_.clear();
+}
+
+void Delta::apply(Matrix &matrix, int64_t part, int64_t nparts) const
+{
+    for (size_t slot = 0; slot < rows_.size(); slot++)
+    {
+        if (rows_[slot] % nparts == part)
+        {
+            matrix.addArrayToRow(data_.data() + slot * dim_, rows_[slot]);
+        }
+    }
+}
+
+} // namespace track2vec
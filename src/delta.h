@@ -0,0 +1,43 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace track2vec
+{
+
+class Matrix;
+class Vector;
+
+// Sparse row updates of one matrix, accumulated in a fixed order and applied
+// later instead of being written straight into the shared matrix
+class Delta
+{
+private:
+    int64_t dim_;
+    std::unordered_map<int64_t, int64_t> slots_;
+    std::vector<int64_t> rows_;
+    std::vector<double> data_;
+    
+public:
+    explicit Delta(int64_t);
+    
+    void add(int64_t, const Vector &, double);
+    void clear();
+    
+    // apply the rows with row % nparts == part
+    void apply(Matrix &, int64_t, int64_t) const;
+    
+    inline int64_t size() const
+    {
+        return rows_.size();
+    }
+};
+
+} // namespace track2vec
@@ -5,12 +5,14 @@
 
 #include "dictionary.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <set>
 #include <nlohmann/json.hpp>
 
+#include "pool.h"
 #include "utils.h"
 
 namespace track2vec
@@ -18,6 +20,13 @@ namespace track2vec
 
 using json = nlohmann::json;
 
+namespace
+{
+
+const size_t LINE_BLOCK = 65536;
+
+} // namespace
+
 Dictionary::Dictionary(std::shared_ptr<Args> args)
 : ntokens_(0), args_(args) {}
 
@@ -36,6 +45,38 @@ int64_t Dictionary::getGenreIdx(const std::string &genre_id) const
     return genres_.count(genre_id) ? genres_.at(genre_id).idx : -1;
 }
 
+// FNV-1a over every track id, count and artist/genre row in index order, so
+// a checkpoint only resumes on the dictionary it was trained with
+uint64_t Dictionary::version() const
+{
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](const void *data, size_t n) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < n; i++)
+        {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    };
+    
+    for (const trackEntry *entry : trackIndex_)
+    {
+        mix(entry->track_id.c_str(), entry->track_id.size() + 1);
+        mix(&entry->count, sizeof(entry->count));
+        for (int64_t idx : entry->artist_matrix_indices)
+        {
+            mix(&idx, sizeof(idx));
+        }
+        for (int64_t idx : entry->genre_matrix_indices)
+        {
+            mix(&idx, sizeof(idx));
+        }
+    }
+    
+    const int64_t sizes[3] = {ntokens_, nartists(), ngenres()};
+    mix(sizes, sizeof(sizes));
+    return hash;
+}
+
 std::vector<int64_t> Dictionary::getTrackCount() const
 {
     std::vector<int64_t> track_cnt(tracks_.size());
@@ -47,6 +88,33 @@ std::vector<int64_t> Dictionary::getTrackCount() const
     return track_cnt;
 }
 
+void Dictionary::addCounts(const std::vector<int64_t> &counts)
+{
+    for (size_t idx = 0; idx < counts.size(); idx++)
+    {
+        trackIndex_[idx]->count += counts[idx];
+        ntokens_ += counts[idx];
+    }
+}
+
+// Input matrix indices of the artists and genres shared by at least minCount
+// tracks. Every update of those tracks also writes these rows.
+std::vector<int64_t> Dictionary::getHotIndices(int64_t minCount) const
+{
+    std::vector<int64_t> indices;
+    for (const auto &pair : artists_)
+    {
+        if (pair.second.count >= minCount)
+            indices.push_back(pair.second.idx);
+    }
+    for (const auto &pair : genres_)
+    {
+        if (pair.second.count >= minCount)
+            indices.push_back(pair.second.idx);
+    }
+    return indices;
+}
+
 void Dictionary::addTrack(const std::string &track_id,
                           int64_t count,
                           std::vector<std::string> &artist_id_list,
@@ -96,35 +164,57 @@ void Dictionary::readMeta(const std::string &filename)
         throw std::invalid_argument(filename + " cannot be opened for loading!");
     }
     
+    struct Meta
+    {
+        std::string track_id;
+        int64_t ntoken;
+        std::vector<std::string> artist_ids;
+        std::vector<std::string> genre_ids;
+    };
+    
     int64_t ntracks = 0;
+    std::vector<std::string> lines;
+    std::vector<Meta> metas;
     
     try
     {
-        for (std::string line; std::getline(ifs, line);)
+        // lines are parsed on the pool, tracks are added in file order
+        while (utils::readLines(ifs, lines, LINE_BLOCK))
         {
-            json j = json::parse(line);
-            
-            int64_t track_id_num = j["track_id"];
-            std::string track_id = std::to_string(track_id_num);
-            
-            int64_t ntoken = j["ntoken"];
+            metas.resize(lines.size());
+            ThreadPool::global().parallelFor(lines.size(), [&](int64_t begin, int64_t end) {
+                for (int64_t i = begin; i < end; i++)
+                {
+                    json j = json::parse(lines[i]);
+                    Meta &meta = metas[i];
+                    
+                    int64_t track_id_num = j["track_id"];
+                    meta.track_id = std::to_string(track_id_num);
+                    
+                    meta.ntoken = j["ntoken"];
+                    
+                    std::vector<int64_t> artist_id_int_list = j["artist_id_list"];
+                    meta.artist_ids.clear();
+                    meta.artist_ids.reserve(artist_id_int_list.size());
+                    
+                    for (int64_t elem : artist_id_int_list)
+                    {
+                        meta.artist_ids.push_back(std::to_string(elem));
+                    }
+                    
+                    meta.genre_ids = j["reco_genre_id_list"].get<std::vector<std::string>>();
+                }
+            });
             
-            std::vector<int64_t> artist_id_int_list = j["artist_id_list"];
-            std::vector<std::string> artist_ids(artist_id_int_list.size());
-            
-            for (int64_t elem : artist_id_int_list)
+            for (Meta &meta : metas)
             {
-                artist_ids.push_back(std::to_string(elem));
+                addTrack(meta.track_id, meta.ntoken, meta.artist_ids, meta.genre_ids);
+                
+                ntracks++;
+                
+                if (args_->verbose > 2 && ntracks % 1000 == 0)
+                    std::cerr << ">> Read " << ntracks / 1000 << "K track meta data" << std::endl;
             }
-            
-            std::vector<std::string> genre_ids = j["reco_genre_id_list"];
-            
-            addTrack(track_id, ntoken, artist_ids, genre_ids);
-            
-            ntracks++;
-            
-            if (args_->verbose > 2 && ntracks % 1000 == 0)
-                std::cerr << ">> Read " << ntracks / 1000 << "K track meta data" << std::endl;
         }
     }
     catch (std::runtime_error)
@@ -132,9 +222,10 @@ void Dictionary::readMeta(const std::string &filename)
         std::cerr << " Invild json format in meta file: " << filename << std::endl;
     }
     
-    if (ntracks > MAX_TRACK_SIZE)
+    // file-backed matrices page the tail of the vocabulary out to disk
+    if (ntracks > MAX_TRACK_SIZE && args_->alloc != "mmap")
     {
-        throw std::out_of_range("The number of tracks exceeded the limitation of the number of tracks");
+        throw std::out_of_range("The number of tracks exceeded the limitation of the number of tracks (use -alloc mmap)");
     }
     
     if (args_->verbose > 0)
@@ -157,16 +248,52 @@ void Dictionary::loadMeta(const std::string &meta, const std::string &input)
     }
 }
 
-void Dictionary::indexing()
+namespace
+{
+
+// word2vec subsampling, the probability of keeping a track with frequency f
+double keepProbability(double t, double f)
 {
-    int64_t index = 0;
+    return std::sqrt(t / f) + t / f;
+}
+
+// Assign consecutive row indices by descending count (ties by id) so the
+// frequently sampled rows form one contiguous hot region of the matrices.
+template <typename Entry>
+int64_t indexByCount(std::unordered_map<std::string, Entry> &entries, int64_t index)
+{
+    typedef typename std::unordered_map<std::string, Entry>::value_type Pair;
+    
+    std::vector<Pair *> order;
+    order.reserve(entries.size());
+    for (auto &elem : entries)
+    {
+        order.push_back(&elem);
+    }
+    
+    std::sort(order.begin(), order.end(), [](const Pair *a, const Pair *b) {
+        if (a->second.count != b->second.count)
+            return a->second.count > b->second.count;
+        return a->first < b->first;
+    });
+    
+    for (Pair *elem : order)
+    {
+        elem->second.idx = index++;
+    }
     
+    return index;
+}
+
+} // namespace
+
+void Dictionary::indexing()
+{
     for (auto &elem : tracks_)
     {
         auto &track_entry = elem.second;
-        track_entry.idx = index++;
         double f = double(track_entry.count) / double(ntokens_);
-        track_entry.pdiscard = std::sqrt(args_->discard_t / f) + args_->discard_t / f;
+        track_entry.pdiscard = keepProbability(args_->discard_t, f);
         
         for (const std::string &genre_id : track_entry.genre_ids)
         {
@@ -178,15 +305,17 @@ void Dictionary::indexing()
         }
     }
     
-    for (auto &elem : artists_)
-    {
-        elem.second.idx = index++;
-    }
+    // tracks first, then artists, then genres
+    int64_t index = indexByCount(tracks_, 0);
     
-    for (auto &elem : genres_)
+    trackIndex_.resize(tracks_.size());
+    for (auto &elem : tracks_)
     {
-        elem.second.idx = index++;
+        trackIndex_[elem.second.idx] = &elem.second;
     }
+
+    index = indexByCount(artists_, index);
+    indexByCount(genres_, index);
     
     for (auto &elem : tracks_)
     {
@@ -212,16 +341,26 @@ void Dictionary::indexing()
     }
 }
 
-bool Dictionary::discard(const std::string &track_id, double rand) const
+bool Dictionary::discard(int64_t idx, double rand) const
 {
-    return 0 == tracks_.count(track_id) ? true : rand > tracks_.at(track_id).pdiscard;
+    return rand > trackIndex_[idx]->pdiscard;
+}
+
+std::vector<double> Dictionary::discardTable(double t) const
+{
+    std::vector<double> table(trackIndex_.size());
+    for (size_t idx = 0; idx < trackIndex_.size(); idx++)
+    {
+        table[idx] = keepProbability(t, double(trackIndex_[idx]->count) / double(ntokens_));
+    }
+    return table;
 }
 
 int64_t Dictionary::getSequence(std::istream &ifs,
-                                std::vector<std::string> &tracks,
-                                std::minstd_rand &rng) const
+                                std::vector<int64_t> &tracks,
+                                Random &rng,
+                                std::vector<double> &uniforms) const
 {
-    std::uniform_real_distribution<> uniform(0, 1);
     std::string track;
     int64_t read_cnt = 0;
     
@@ -244,18 +383,19 @@ int64_t Dictionary::getSequence(std::istream &ifs,
         //int64_t character_id = j["c"];
         //int64_t length = j["l"];
         std::vector<int64_t> track_seq = j["t"];
+        rng.uniform(uniforms, track_seq.size());
         
-        for (int64_t track_id : track_seq)
+        for (size_t i = 0; i < track_seq.size(); i++)
         {
-            std::string track = std::to_string(track_id);
+            int64_t idx = getTrackIdx(std::to_string(track_seq[i]));
             
-            if (0 == tracks_.count(track))
+            if (0 > idx)
                 continue;
             
             read_cnt++;
-            if (false == discard(track, uniform(rng)))
+            if (false == discard(idx, uniforms[i]))
             {
-                tracks.push_back(track);
+                tracks.push_back(idx);
             }
         }
     }
@@ -267,20 +407,25 @@ int64_t Dictionary::getSequence(std::istream &ifs,
     return read_cnt;
 }
 
-int64_t Dictionary::getRecord(std::istream &ifs, std::vector<std::string> &tracks) const
+int64_t Dictionary::getRecord(std::istream &ifs, std::vector<int64_t> &tracks) const
 {
     std::string line;
     
-    try
+    do
     {
-        do
+        if (std::getline(ifs, line).eof())
         {
-            if (std::getline(ifs, line).eof())
-            {
-                return 0;
-            }
-        } while (0 == line.length());
-        
+            return 0;
+        }
+    } while (0 == line.length());
+    
+    return parseRecord(line, tracks);
+}
+
+int64_t Dictionary::parseRecord(const std::string &line, std::vector<int64_t> &tracks) const
+{
+    try
+    {
         json j = json::parse(line);
         //int64_t character_id = j["c"];
         int64_t length = j["l"];
@@ -290,12 +435,12 @@ int64_t Dictionary::getRecord(std::istream &ifs, std::vector<std::string> &track
         
         for (int64_t track_id : track_seq)
         {
-            std::string track = std::to_string(track_id);
+            int64_t idx = getTrackIdx(std::to_string(track_id));
             
-            if (0 == tracks_.count(track))
+            if (0 > idx)
                 continue;
             
-            tracks.push_back(track);
+            tracks.push_back(idx);
         }
     }
     catch (std::logic_error)
@@ -7,11 +7,11 @@
 
 #include <memory>
 #include <string>
-#include <random>
 #include <unordered_map>
 
 #include "args.h"
 #include "entry.h"
+#include "random.h"
 
 namespace track2vec
 {
@@ -25,6 +25,7 @@ private:
     std::unordered_map<std::string, trackEntry> tracks_;
     std::unordered_map<std::string, artistEntry> artists_;
     std::unordered_map<std::string, genreEntry> genres_;
+    std::vector<trackEntry *> trackIndex_;
     
     std::vector<double> pdiscard_;
     int64_t ntokens_;
@@ -38,17 +39,30 @@ public:
     Dictionary(std::shared_ptr<Args>);
     
     void loadMeta(const std::string &, const std::string &);
-    bool discard(const std::string &, double) const;
+    bool discard(int64_t, double) const;
+    
+    // keep probabilities by track index for another sampling threshold
+    std::vector<double> discardTable(double) const;
     void addTrack(const std::string &, int64_t, std::vector<std::string> &, std::vector<std::string> &);
     bool addGenre(const std::string &);
     bool addArtist(const std::string &);
-    int64_t getSequence(std::istream &, std::vector<std::string> &, std::minstd_rand &) const;
-    int64_t getRecord(std::istream &, std::vector<std::string> &) const;
+    // the last argument holds the discard draws, e.g. model::State::uniforms
+    int64_t getSequence(std::istream &, std::vector<int64_t> &, Random &, std::vector<double> &) const;
+    int64_t getRecord(std::istream &, std::vector<int64_t> &) const;
+    int64_t parseRecord(const std::string &, std::vector<int64_t> &) const;
     int64_t getTrackIdx(const std::string &) const;
     int64_t getArtistIdx(const std::string &) const;
     int64_t getGenreIdx(const std::string &) const;
     
     std::vector<int64_t> getTrackCount() const;
+    
+    // add counts by track index, e.g. of sessions streamed since the meta
+    void addCounts(const std::vector<int64_t> &);
+    
+    // fingerprint of the indexed vocabulary and its counts
+    uint64_t version() const;
+    
+    std::vector<int64_t> getHotIndices(int64_t) const;
     const std::vector<int64_t> &getArtistMatrixIndices(const std::string &) const;
     const std::vector<int64_t> &getGenreMatrixIndices(const std::string &) const;
     
@@ -66,6 +80,11 @@ public:
     }
     
     trackEntry &getTrackEntry(const std::string &);
+    
+    inline const trackEntry &getTrackEntry(int64_t idx) const
+    {
+        return *trackIndex_[idx];
+    }
     artistEntry &getArtistEntry(const std::string &);
     genreEntry &getGenreEntry(const std::string &);
     
@@ -0,0 +1,517 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "distributed.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+namespace track2vec
+{
+
+namespace
+{
+
+const int64_t MAGIC = 0x7432766364697374; // "t2vcdist"
+const int64_t CONNECT_TIMEOUT = 30;       // second
+
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+const int SEND_FLAGS = 0;
+#endif
+
+void writeAll(int fd, const void *data, size_t size)
+{
+    const char *p = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = send(fd, p, size, SEND_FLAGS);
+        if (n <= 0)
+        {
+            throw std::runtime_error(std::string("send failed: ") + std::strerror(errno));
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+void readAll(int fd, void *data, size_t size)
+{
+    char *p = static_cast<char *>(data);
+    while (size > 0)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0)
+        {
+            throw std::runtime_error("connection closed by peer");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+template <typename T>
+void append(std::vector<char> &buf, const T *data, size_t n)
+{
+    const char *p = reinterpret_cast<const char *>(data);
+    buf.insert(buf.end(), p, p + n * sizeof(T));
+}
+
+int64_t readInt(int fd)
+{
+    int64_t value;
+    readAll(fd, &value, sizeof(value));
+    return value;
+}
+
+// "host:port", host may be empty to listen on every interface
+void splitAddress(const std::string &address, std::string &host, std::string &port)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+    {
+        throw std::invalid_argument(address + " is not a host:port address");
+    }
+    host = address.substr(0, colon);
+    port = address.substr(colon + 1);
+}
+
+addrinfo *resolve(const std::string &address, bool passive)
+{
+    std::string host, port;
+    splitAddress(address, host, port);
+    
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    
+    addrinfo *result = nullptr;
+    int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if (err != 0)
+    {
+        throw std::invalid_argument(address + " cannot be resolved: " + gai_strerror(err));
+    }
+    return result;
+}
+
+void noDelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int listenOn(const std::string &address)
+{
+    addrinfo *result = resolve(address, true);
+    int fd = -1;
+    for (addrinfo *ai = result; ai != nullptr && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 64) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot listen on " + address);
+    }
+    return fd;
+}
+
+// the coordinator may come up after the ranks, so keep retrying for a while
+int connectTo(const std::string &address)
+{
+    auto start = std::chrono::steady_clock::now();
+    while (true)
+    {
+        addrinfo *result = resolve(address, false);
+        int fd = -1;
+        for (addrinfo *ai = result; ai != nullptr && fd < 0; ai = ai->ai_next)
+        {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+            {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        
+        if (fd >= 0)
+        {
+            noDelay(fd);
+            return fd;
+        }
+        if (utils::getDuration(start, std::chrono::steady_clock::now()) > CONNECT_TIMEOUT)
+        {
+            throw std::runtime_error("cannot connect to coordinator " + address);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+// Running sum and count of every row received in the current round
+struct RowSum
+{
+    std::unordered_map<int64_t, size_t> slots;
+    std::vector<int64_t> rows;
+    std::vector<int64_t> counts;
+    std::vector<double> sums;
+};
+
+} // namespace
+
+Coordinator::Coordinator(std::shared_ptr<Args> args)
+: args_(args), listen_(listenOn(args->coordinator)), dim_(0) {}
+
+Coordinator::~Coordinator()
+{
+    for (int fd : ranks_)
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+    close(listen_);
+}
+
+// Admits exactly -world ranks. Every rank must agree on the world size and on
+// the shape of the matrices, which follows from training on the same
+// dictionary.
+void Coordinator::accept()
+{
+    ranks_.assign(args_->world, -1);
+    
+    for (int64_t joined = 0; joined < args_->world; joined++)
+    {
+        int fd = ::accept(listen_, nullptr, nullptr);
+        if (fd < 0)
+        {
+            throw std::runtime_error(std::string("accept failed: ") + std::strerror(errno));
+        }
+        noDelay(fd);
+        
+        int64_t hello[6];
+        readAll(fd, hello, sizeof(hello));
+        const int64_t rank = hello[1];
+        
+        if (hello[0] != MAGIC || hello[2] != args_->world || rank < 0 || rank >= args_->world || ranks_[rank] >= 0)
+        {
+            close(fd);
+            throw std::runtime_error("rejected rank [" + std::to_string(rank) + "]");
+        }
+        if (joined == 0)
+        {
+            dim_ = hello[3];
+            rows_ = {hello[4], hello[5]};
+        }
+        else if (hello[3] != dim_ || hello[4] != rows_[0] || hello[5] != rows_[1])
+        {
+            close(fd);
+            throw std::runtime_error("rank [" + std::to_string(rank) + "] has a different model shape");
+        }
+        
+        ranks_[rank] = fd;
+        if (args_->verbose > 0)
+        {
+            std::cerr << "Rank [" << rank << "] joined (" << joined + 1 << "/" << args_->world << ")" << std::endl;
+        }
+    }
+    
+    for (int fd : ranks_)
+    {
+        writeAll(fd, &MAGIC, sizeof(MAGIC));
+    }
+}
+
+void Coordinator::run()
+{
+    accept();
+    
+    int64_t round = 0;
+    bool finished = false;
+    std::vector<double> values;
+    
+    while (!finished)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<RowSum> sums(rows_.size());
+        int64_t done = 0;
+        int64_t received = 0;
+        
+        for (int fd : ranks_)
+        {
+            done += readInt(fd) != 0;
+            
+            for (RowSum &sum : sums)
+            {
+                const int64_t k = readInt(fd);
+                std::vector<int64_t> rows(k);
+                values.resize(k * dim_);
+                readAll(fd, rows.data(), k * sizeof(int64_t));
+                readAll(fd, values.data(), values.size() * sizeof(double));
+                received += k;
+                
+                for (int64_t i = 0; i < k; i++)
+                {
+                    auto it = sum.slots.find(rows[i]);
+                    if (it == sum.slots.end())
+                    {
+                        it = sum.slots.emplace(rows[i], sum.rows.size()).first;
+                        sum.rows.push_back(rows[i]);
+                        sum.counts.push_back(0);
+                        sum.sums.resize(sum.sums.size() + dim_, 0.0);
+                    }
+                    double *dst = sum.sums.data() + it->second * dim_;
+                    const double *src = values.data() + i * dim_;
+                    for (int64_t j = 0; j < dim_; j++)
+                    {
+                        dst[j] += src[j];
+                    }
+                    sum.counts[it->second]++;
+                }
+            }
+        }
+        
+        finished = done == int64_t(ranks_.size());
+        
+        std::vector<char> reply;
+        const int64_t flag = finished;
+        append(reply, &flag, 1);
+        for (RowSum &sum : sums)
+        {
+            for (size_t s = 0; s < sum.rows.size(); s++)
+            {
+                for (int64_t j = 0; j < dim_; j++)
+                {
+                    sum.sums[s * dim_ + j] /= sum.counts[s];
+                }
+            }
+            const int64_t k = sum.rows.size();
+            append(reply, &k, 1);
+            append(reply, sum.rows.data(), k);
+            append(reply, sum.sums.data(), sum.sums.size());
+        }
+        
+        for (int fd : ranks_)
+        {
+            writeAll(fd, reply.data(), reply.size());
+        }
+        
+        round++;
+        if (args_->verbose > 1)
+        {
+            std::cerr << ">> Round " << round << ": averaged " << received << " rows into ";
+            std::cerr << sums[0].rows.size() << " input / " << sums[1].rows.size() << " output rows in ";
+            std::cerr << utils::getDuration(start, std::chrono::steady_clock::now()) << " sec" << std::endl;
+        }
+    }
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << "All ranks finished after " << round << " rounds" << std::endl;
+    }
+}
+
+Peer::Peer(std::shared_ptr<Args> args, std::shared_ptr<Matrix> input, std::shared_ptr<Matrix> output)
+: args_(args), matrices_({input, output}), socket_(-1), running_(false), rounds_(0), sentRows_(0)
+{
+    input->trackRows();
+    output->trackRows();
+    
+    socket_ = connectTo(args_->coordinator);
+    
+    const int64_t hello[6] = {MAGIC, args_->rank, args_->world, args_->dim, input->size(0), output->size(0)};
+    writeAll(socket_, hello, sizeof(hello));
+    
+    // blocks until every rank has joined
+    if (readInt(socket_) != MAGIC)
+    {
+        throw std::runtime_error("unexpected reply from coordinator " + args_->coordinator);
+    }
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << "Rank [" << args_->rank << "/" << args_->world << "] connected to " << args_->coordinator << std::endl;
+    }
+}
+
+Peer::~Peer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    cv_.notify_all();
+    if (sync_.joinable())
+    {
+        sync_.join();
+    }
+    close(socket_);
+}
+
+void Peer::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_)
+        return;
+    
+    running_ = true;
+    sync_ = std::thread([this]() { syncLoop(); });
+}
+
+// Keeps joining rounds, with nothing new to send, until every rank is done so
+// that all ranks finish with the same averaged rows.
+void Peer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    cv_.notify_all();
+    
+    if (sync_.joinable())
+    {
+        sync_.join();
+    }
+    
+    while (!exchange(true))
+    {
+    }
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << ">> Rank [" << args_->rank << "] synced " << sentRows_ << " rows in " << rounds_ << " rounds" << std::endl;
+    }
+}
+
+// One round: send the touched rows and apply the rows the coordinator
+// averaged. The trainers keep writing while the round waits for the other
+// ranks, so a row this rank sent moves by the average minus what it sent and
+// keeps the updates made meanwhile. A row only other ranks sent is
+// overwritten, unless it was written since the send: the next round sends it.
+// Returns true once all ranks are done.
+bool Peer::exchange(bool done)
+{
+    const int64_t dim = args_->dim;
+    std::vector<char> request;
+    const int64_t flag = done;
+    append(request, &flag, 1);
+    
+    std::vector<std::vector<int64_t>> sentRows(matrices_.size());
+    std::vector<std::vector<double>> sentValues(matrices_.size());
+    for (size_t m = 0; m < matrices_.size(); m++)
+    {
+        std::vector<int64_t> &rows = sentRows[m];
+        std::vector<double> &values = sentValues[m];
+        rows = matrices_[m]->takeTouched();
+        values.resize(rows.size() * dim);
+        for (size_t i = 0; i < rows.size(); i++)
+        {
+            matrices_[m]->getRow(rows[i], values.data() + i * dim);
+        }
+        
+        const int64_t k = rows.size();
+        append(request, &k, 1);
+        append(request, rows.data(), k);
+        append(request, values.data(), values.size());
+        sentRows_ += k;
+    }
+    writeAll(socket_, request.data(), request.size());
+    
+    const bool finished = readInt(socket_) != 0;
+    std::vector<double> values;
+    for (size_t m = 0; m < matrices_.size(); m++)
+    {
+        Matrix &matrix = *matrices_[m];
+        const std::vector<int64_t> &sent = sentRows[m];
+        const int64_t k = readInt(socket_);
+        std::vector<int64_t> rows(k);
+        values.resize(k * dim);
+        readAll(socket_, rows.data(), k * sizeof(int64_t));
+        readAll(socket_, values.data(), values.size() * sizeof(double));
+        
+        for (int64_t i = 0; i < k; i++)
+        {
+            const double *avg = values.data() + i * dim;
+            
+            // takeTouched() lists rows in ascending order
+            auto it = std::lower_bound(sent.begin(), sent.end(), rows[i]);
+            if (it != sent.end() && *it == rows[i])
+            {
+                // not through addArrayToRow, which would mark it for sending
+                const double *before = sentValues[m].data() + (it - sent.begin()) * dim;
+                for (int64_t j = 0; j < dim; j++)
+                {
+                    matrix.at(rows[i], j) += avg[j] - before[j];
+                }
+            }
+            else if (!matrix.touched(rows[i]))
+            {
+                matrix.setRow(rows[i], avg);
+            }
+        }
+    }
+    
+    rounds_++;
+    return finished;
+}
+
+void Peer::syncLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    
+    while (running_)
+    {
+        cv_.wait_for(lock, std::chrono::seconds(args_->distSync));
+        if (!running_)
+            break;
+        
+        lock.unlock();
+        auto start = std::chrono::steady_clock::now();
+        try
+        {
+            exchange(false);
+        }
+        catch (const std::exception &e)
+        {
+            // stop() retries and reports the failure to the main thread
+            std::cerr << ">> Rank [" << args_->rank << "] sync failed: " << e.what() << std::endl;
+            return;
+        }
+        if (args_->verbose > 1)
+        {
+            std::cerr << ">> Rank [" << args_->rank << "] round " << rounds_ << " in ";
+            std::cerr << utils::getDuration(start, std::chrono::steady_clock::now()) << " sec" << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+} // namespace track2vec
@@ -0,0 +1,72 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "args.h"
+#include "matrix.h"
+
+namespace track2vec
+{
+
+// Data-parallel training over TCP. Every rank trains its own copy of the
+// matrices on 1/world of the sequences. The coordinator admits the ranks,
+// then runs synchronous rounds: each rank sends the rows it wrote since the
+// previous round, the coordinator averages every row over the ranks that sent
+// it and returns the result to all ranks. Rows nobody touched are not sent.
+class Coordinator
+{
+public:
+    explicit Coordinator(std::shared_ptr<Args>);
+    ~Coordinator();
+    
+    void run();
+    
+private:
+    std::shared_ptr<Args> args_;
+    int listen_;
+    std::vector<int> ranks_;
+    int64_t dim_;
+    std::vector<int64_t> rows_;
+    
+    void accept();
+};
+
+// The training side of one rank, syncs every -distSync seconds from a
+// background thread while the trainers keep running.
+class Peer
+{
+public:
+    Peer(std::shared_ptr<Args>, std::shared_ptr<Matrix>, std::shared_ptr<Matrix>);
+    ~Peer();
+    
+    void start();
+    void stop();
+    
+private:
+    std::shared_ptr<Args> args_;
+    std::vector<std::shared_ptr<Matrix>> matrices_;
+    int socket_;
+    
+    std::thread sync_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_;
+    
+    int64_t rounds_;
+    int64_t sentRows_;
+    
+    bool exchange(bool);
+    void syncLoop();
+};
+
+} // namespace track2vec
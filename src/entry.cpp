@@ -5,7 +5,7 @@ namespace track2vec
     trackEntry::trackEntry(const std::string &track_id)
         : track_id(track_id),
           idx(-1),
-          lr_alpha(1.0),
+          pretrained(false),
           count(1),
           pdiscard(1),
           artist_ids(0),
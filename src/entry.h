@@ -1,3 +1,5 @@
+#pragma once
+
 #include <vector>
 #include <string>
 
@@ -8,7 +10,7 @@ namespace track2vec
         explicit trackEntry(const std::string &);
         std::string track_id;
         int64_t idx;
-        double lr_alpha;
+        bool pretrained;
         int64_t count;
         double pdiscard;
         std::vector<std::string> artist_ids;
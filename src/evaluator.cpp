@@ -0,0 +1,238 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "evaluator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include "pool.h"
+#include "utils.h"
+
+namespace track2vec
+{
+
+namespace
+{
+
+// eight independent partial sums, so the loop maps onto vector registers
+// without reassociating a single float sum
+inline float dot(const float *a, const float *b, int64_t n)
+{
+    float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    int64_t j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        for (int64_t k = 0; k < 8; k++)
+        {
+            acc[k] += a[j + k] * b[j + k];
+        }
+    }
+    for (; j < n; j++)
+    {
+        acc[0] += a[j] * b[j];
+    }
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+// log of sigmoid(x) without overflow, path scores are sums of these
+inline float logSigmoid(float x)
+{
+    return x >= 0 ? -std::log1p(std::exp(-x)) : x - std::log1p(std::exp(x));
+}
+
+} // namespace
+
+Evaluator::Evaluator(std::shared_ptr<Args> args, std::shared_ptr<Dictionary> dict)
+: args_(args), dict_(dict)
+{
+    std::ifstream ifs(args_->evalInput);
+    if (!ifs.is_open())
+    {
+        throw std::invalid_argument(args_->evalInput + " cannot be opened for evaluation!");
+    }
+    
+    // consecutive pairs in file order up to -evalCases, tracks missing from
+    // the dictionary are skipped like in training
+    std::vector<int64_t> tracks;
+    for (std::string line; size() < args_->evalCases && std::getline(ifs, line);)
+    {
+        if (line.empty())
+            continue;
+        
+        tracks.clear();
+        dict_->parseRecord(line, tracks);
+        for (size_t i = 1; i < tracks.size() && size() < args_->evalCases; i++)
+        {
+            queries_.push_back(tracks[i - 1]);
+            targets_.push_back(tracks[i]);
+        }
+    }
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << "Number of evaluation cases: " << size() << std::endl;
+    }
+}
+
+void Evaluator::setTree(std::shared_ptr<const HierarchicalSoftmaxLoss::Tree> tree)
+{
+    tree_ = tree;
+}
+
+Evaluator::Metrics Evaluator::evaluate(const Matrix &input, const Matrix &output) const
+{
+    auto start = std::chrono::steady_clock::now();
+    const int64_t dim = output.cols();
+    const int64_t ntracks = output.rows();
+    const int64_t ncases = size();
+    
+    // snapshot, the trainers keep writing to the matrices meanwhile
+    std::vector<float> rows(ntracks * dim);
+    std::vector<float> hidden(ncases * dim);
+    
+    ThreadPool::global().parallelFor(ntracks, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            for (int64_t j = 0; j < dim; j++)
+            {
+                rows[i * dim + j] = output.at(i, j);
+            }
+        }
+    }, 1024);
+    
+    ThreadPool::global().parallelFor(ncases, [&](int64_t begin, int64_t end) {
+        std::vector<double> h(dim);
+        for (int64_t c = begin; c < end; c++)
+        {
+            const trackEntry &entry = dict_->getTrackEntry(queries_[c]);
+            std::fill(h.begin(), h.end(), 0.0);
+            
+            int64_t z = 0;
+            auto add = [&](int64_t row) {
+                for (int64_t j = 0; j < dim; j++)
+                {
+                    h[j] += input.at(row, j);
+                }
+                z++;
+            };
+            add(queries_[c]);
+            std::for_each(entry.artist_matrix_indices.begin(), entry.artist_matrix_indices.end(), add);
+            std::for_each(entry.genre_matrix_indices.begin(), entry.genre_matrix_indices.end(), add);
+            
+            for (int64_t j = 0; j < dim; j++)
+            {
+                hidden[c * dim + j] = h[j] / z;
+            }
+        }
+    }, 64);
+    
+    // rank of the target = number of tracks scoring strictly higher
+    std::vector<int64_t> ranks(ncases, 0);
+    
+    if (tree_)
+    {
+        ThreadPool::global().parallelFor(ncases, [&](int64_t begin, int64_t end) {
+            for (int64_t c = begin; c < end; c++)
+            {
+                ranks[c] = treeRank(rows, &hidden[c * dim], targets_[c], dim);
+            }
+        }, 16);
+    }
+    else
+    {
+        const int64_t nblocks = (ncases + CASE_BLOCK - 1) / CASE_BLOCK;
+        ThreadPool::global().parallelFor(nblocks, [&](int64_t begin, int64_t end) {
+            for (int64_t b = begin; b < end; b++)
+            {
+                const int64_t first = b * CASE_BLOCK;
+                const int64_t last = std::min(ncases, first + CASE_BLOCK);
+                float target[CASE_BLOCK];
+                
+                for (int64_t c = first; c < last; c++)
+                {
+                    target[c - first] = dot(&hidden[c * dim], &rows[targets_[c] * dim], dim);
+                }
+                
+                for (int64_t r0 = 0; r0 < ntracks; r0 += ROW_BLOCK)
+                {
+                    const int64_t r1 = std::min(ntracks, r0 + ROW_BLOCK);
+                    for (int64_t c = first; c < last; c++)
+                    {
+                        const float *h = &hidden[c * dim];
+                        const float t = target[c - first];
+                        int64_t higher = 0;
+                        for (int64_t r = r0; r < r1; r++)
+                        {
+                            higher += dot(h, &rows[r * dim], dim) > t;
+                        }
+                        ranks[c] += higher;
+                    }
+                }
+            }
+        });
+    }
+    
+    double hits = 0;
+    double rr = 0;
+    for (int64_t rank : ranks)
+    {
+        hits += rank < args_->evalK;
+        rr += 1.0 / (rank + 1);
+    }
+    
+    Metrics metrics;
+    metrics["hr@" + std::to_string(args_->evalK)] = ncases > 0 ? hits / ncases : 0;
+    metrics["mrr"] = ncases > 0 ? rr / ncases : 0;
+    metrics["eval_sec"] = utils::getDuration(start, std::chrono::steady_clock::now());
+    return metrics;
+}
+
+// Depth first from the root. The score of a subtree only drops further down,
+// so one that does not beat the target any more cannot hold a higher track.
+int64_t Evaluator::treeRank(const std::vector<float> &rows, const float *h, int64_t target, int64_t dim) const
+{
+    const HierarchicalSoftmaxLoss::Tree &tree = *tree_;
+    const int64_t ninner = tree.left.size();
+    if (ninner == 0)
+        return 0;
+    
+    float t = 0;
+    for (int64_t k = tree.offsets[target]; k < tree.offsets[target + 1]; k++)
+    {
+        const float s = dot(h, &rows[tree.nodes[k] * dim], dim);
+        t += logSigmoid(tree.codes[k] ? s : -s);
+    }
+    
+    int64_t higher = 0;
+    std::vector<std::pair<int64_t, float>> stack(1, std::make_pair(ninner - 1, 0.0f));
+    while (!stack.empty())
+    {
+        const std::pair<int64_t, float> top = stack.back();
+        stack.pop_back();
+        
+        const float s = dot(h, &rows[top.first * dim], dim);
+        const int64_t children[2] = {tree.left[top.first], tree.right[top.first]};
+        const float scores[2] = {top.second + logSigmoid(-s), top.second + logSigmoid(s)};
+        
+        for (int64_t j = 0; j < 2; j++)
+        {
+            if (scores[j] <= t)
+                continue;
+            
+            if (children[j] < 0)
+                higher += -1 - children[j] != target;
+            else
+                stack.push_back(std::make_pair(children[j], scores[j]));
+        }
+    }
+    return higher;
+}
+
+} // namespace track2vec
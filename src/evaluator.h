@@ -0,0 +1,59 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "args.h"
+#include "dictionary.h"
+#include "loss.h"
+#include "matrix.h"
+
+namespace track2vec
+{
+
+// Next-track evaluation on held-out sessions. Every consecutive pair of a
+// session is a case: the current track's hidden vector (its input row averaged
+// with its artist and genre rows, as in Model::computeHidden) scores the
+// output rows of all tracks, and the rank of the next track gives HR@k and
+// MRR. Scoring runs on a float snapshot of the matrices, blocks of cases
+// against blocks of output rows so a block of rows is reused from cache.
+// With -loss hs a track scores its path probability instead, and only the
+// subtrees that can still beat the target are visited.
+class Evaluator
+{
+public:
+    using Metrics = std::map<std::string, double>;
+    
+    Evaluator(std::shared_ptr<Args>, std::shared_ptr<Dictionary>);
+    
+    Metrics evaluate(const Matrix &, const Matrix &) const;
+    
+    // score paths of this tree, the output rows are its inner nodes
+    void setTree(std::shared_ptr<const HierarchicalSoftmaxLoss::Tree>);
+    
+    inline int64_t size() const
+    {
+        return queries_.size();
+    }
+    
+private:
+    static const int64_t CASE_BLOCK = 8;
+    static const int64_t ROW_BLOCK = 256;
+    
+    std::shared_ptr<Args> args_;
+    std::shared_ptr<Dictionary> dict_;
+    std::vector<int64_t> queries_;
+    std::vector<int64_t> targets_;
+    std::shared_ptr<const HierarchicalSoftmaxLoss::Tree> tree_;
+    
+    int64_t treeRank(const std::vector<float> &, const float *, int64_t, int64_t) const;
+};
+
+} // namespace track2vec
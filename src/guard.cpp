@@ -0,0 +1,110 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "guard.h"
+
+#include <atomic>
+#include <cmath>
+
+#include "pool.h"
+#include "utils.h"
+
+namespace track2vec
+{
+
+Guard::Guard(std::shared_ptr<Args> args, std::shared_ptr<Matrix> input, std::shared_ptr<Matrix> output)
+: args_(args), input_(input), output_(output), rng_(args->seed), saved_(false) {}
+
+bool Guard::healthy(const Matrix &matrix, int64_t i) const
+{
+    double sum = 0;
+    for (int64_t j = 0; j < matrix.cols(); j++)
+    {
+        sum += matrix.at(i, j) * matrix.at(i, j);
+    }
+    return std::isfinite(sum) && sum <= args_->maxNorm * args_->maxNorm;
+}
+
+bool Guard::healthy(const Matrix &matrix) const
+{
+    std::atomic<bool> ok(true);
+    ThreadPool::global().parallelFor(matrix.rows(), [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end && ok; i++)
+        {
+            if (!healthy(matrix, i))
+                ok = false;
+        }
+    }, 4096);
+    return ok;
+}
+
+bool Guard::check()
+{
+    for (const Matrix *matrix : {input_.get(), output_.get()})
+    {
+        for (int64_t k = 0; k < args_->checkRows && matrix->rows() > 0; k++)
+        {
+            if (!healthy(*matrix, rng_.uniformInt(matrix->rows())))
+                return false;
+        }
+    }
+    return true;
+}
+
+void Guard::copy(const Matrix &matrix, std::vector<float> &data) const
+{
+    const int64_t dim = matrix.cols();
+    data.resize(matrix.rows() * dim);
+    ThreadPool::global().parallelFor(matrix.rows(), [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            for (int64_t j = 0; j < dim; j++)
+            {
+                data[i * dim + j] = matrix.at(i, j);
+            }
+        }
+    }, 4096);
+}
+
+void Guard::paste(const std::vector<float> &data, Matrix &matrix) const
+{
+    const int64_t dim = matrix.cols();
+    ThreadPool::global().parallelFor(matrix.rows(), [&](int64_t begin, int64_t end) {
+        std::vector<double> row(dim);
+        for (int64_t i = begin; i < end; i++)
+        {
+            std::copy(data.begin() + i * dim, data.begin() + (i + 1) * dim, row.begin());
+            matrix.setRow(i, row.data());
+        }
+    }, 4096);
+}
+
+// The trainers keep running, so the copy mixes rows of slightly different
+// ages like any Hogwild read. A row that goes bad between the full check and
+// the copy is caught by the next check.
+bool Guard::save()
+{
+    if (!healthy(*input_) || !healthy(*output_))
+        return false;
+    
+    copy(*input_, inputCopy_);
+    copy(*output_, outputCopy_);
+    saved_ = true;
+    savedAt_ = std::chrono::steady_clock::now();
+    return true;
+}
+
+void Guard::restore(Matrix &input, Matrix &output) const
+{
+    paste(inputCopy_, input);
+    paste(outputCopy_, output);
+}
+
+double Guard::age() const
+{
+    return utils::getDuration(savedAt_, std::chrono::steady_clock::now());
+}
+
+} // namespace track2vec
@@ -0,0 +1,58 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "args.h"
+#include "matrix.h"
+#include "random.h"
+
+namespace track2vec
+{
+
+// Divergence check and rollback point of a training run. check() looks at
+// -checkRows random rows of each matrix and fails when a norm is not finite
+// or above -maxNorm, so the training kernels need no check of their own.
+// save() keeps a float copy of both matrices once a full pass found every row
+// healthy, restore() writes that copy back into a pair of matrices.
+class Guard
+{
+private:
+    std::shared_ptr<Args> args_;
+    std::shared_ptr<Matrix> input_;
+    std::shared_ptr<Matrix> output_;
+    Random rng_;
+    
+    std::vector<float> inputCopy_;
+    std::vector<float> outputCopy_;
+    bool saved_;
+    std::chrono::steady_clock::time_point savedAt_;
+    
+    bool healthy(const Matrix &, int64_t) const;
+    bool healthy(const Matrix &) const;
+    void copy(const Matrix &, std::vector<float> &) const;
+    void paste(const std::vector<float> &, Matrix &) const;
+
+public:
+    Guard(std::shared_ptr<Args>, std::shared_ptr<Matrix>, std::shared_ptr<Matrix>);
+    
+    bool check();
+    bool save();
+    void restore(Matrix &, Matrix &) const;
+    
+    inline bool saved() const
+    {
+        return saved_;
+    }
+    
+    // seconds since the copy was taken
+    double age() const;
+};
+
+} // namespace track2vec
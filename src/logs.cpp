@@ -23,12 +23,12 @@ using json = nlohmann::json;
 using namespace std::placeholders;
 
 Logs::Logs(const std::string &logDir, const std::string &s3Dir,
-           size_t buffer_size)
-: logs_(buffer_size), logDir_(logDir), s3Dir_(s3Dir),
+           size_t buffer_size, const std::string &name)
+: logs_(buffer_size), logDir_(logDir), s3Dir_(s3Dir), name_(name),
 buffer_size_(buffer_size), idx_(0), file_idx_(0) {}
 
 void Logs::callback(const std::string &yyyymmddhh, double progress, double loss,
-                    double tst, double lr, int64_t eta)
+                    double tst, double lr, int64_t eta, const Track2Vec::Metrics &metrics)
 {
     
     int64_t _tst = int64_t(tst);
@@ -46,11 +46,17 @@ void Logs::callback(const std::string &yyyymmddhh, double progress, double loss,
     std::string _eta = ss.str();
     
     std::cout << std::fixed;
+    if (!name_.empty())
+        std::cout << "[" << name_ << "] ";
     std::cout << "Progress: " << _progress << " %";
     std::cout << " tokens/sec/thread: " << _tst;
     std::cout << " lr: " << _lr;
     std::cout << " loss: " << _loss;
     std::cout << " eta: " << _eta;
+    for (const auto &metric : metrics)
+    {
+        std::cout << " " << metric.first << ": " << metric.second;
+    }
     std::cout << std::endl;
     
     std::string timepoint = getCurrentTime();
@@ -58,6 +64,8 @@ void Logs::callback(const std::string &yyyymmddhh, double progress, double loss,
     json j;
     
     j["start"] = yyyymmddhh;
+    if (!name_.empty())
+        j["config"] = name_;
     j["yyyymmddhhmmss"] = timepoint;
     j["throughput"] = _tst;
     j["progress"] = _progress;
@@ -65,6 +73,11 @@ void Logs::callback(const std::string &yyyymmddhh, double progress, double loss,
     j["lr"] = _lr;
     j["estimated time of arrival"] = _eta;
     
+    for (const auto &metric : metrics)
+    {
+        j[metric.first] = metric.second;
+    }
+    
     logs_[idx_++] = j.dump();
     
     if (idx_ >= buffer_size_)
@@ -92,7 +105,8 @@ void Logs::upload(const std::string &yyyymmddhh)
     
     std::string idx = std::to_string(file_idx_++);
     std::string file_idx = std::string(10 - idx.length(), '0') + idx;
-    std::string filename = "train_" + yyyymmddhh + "_" + file_idx + ".json";
+    std::string prefix = name_.empty() ? "train_" : "train_" + name_ + "_";
+    std::string filename = prefix + yyyymmddhh + "_" + file_idx + ".json";
     
     std::string local_path = logDir_ + "/" + filename;
     
@@ -122,7 +136,7 @@ void Logs::upload(const std::string &yyyymmddhh)
 Track2Vec::LogCallback Logs::getCallback(const std::string &yyyymmddhh)
 {
     return std::bind(&Logs::callback, shared_from_this(), yyyymmddhh, _1, _2, _3,
-                     _4, _5);
+                     _4, _5, _6);
 }
 
 } // namespace track2vec
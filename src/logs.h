@@ -18,17 +18,19 @@ class Logs : public std::enable_shared_from_this<Logs>
     std::vector<std::string> logs_;
     std::string logDir_;
     std::string s3Dir_;
+    std::string name_;
     size_t buffer_size_;
     int64_t idx_;
     int64_t file_idx_;
     
 public:
-    Logs(const std::string&, const std::string&, size_t);
+    // a named log tags its lines and files, e.g. with a sweep configuration
+    Logs(const std::string&, const std::string&, size_t, const std::string &name = "");
     Track2Vec::LogCallback getCallback(const std::string&);
     
 private:
     const std::string getCurrentTime(const std::string &fmt = "%Y%m%d%H%M%S") const;
-    void callback(const std::string&, double, double, double, double, int64_t);
+    void callback(const std::string&, double, double, double, double, int64_t, const Track2Vec::Metrics&);
     void upload(const std::string&);
 };
 
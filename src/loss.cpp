@@ -5,6 +5,11 @@
 
 #include "loss.h"
 #include "matrix.h"
+#include "pool.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
 
 namespace track2vec
 {
@@ -13,7 +18,7 @@ constexpr int64_t SIGMOID_TABLE_SIZE = 512;
 constexpr int64_t MAX_SIGMOID = 8;
 constexpr int64_t LOG_TABLE_SIZE = 512;
 
-Loss::Loss(std::shared_ptr<Matrix> &output, int64_t neg): output_(output), neg_(neg), uniform_()
+Loss::Loss(std::shared_ptr<Matrix> &output) : output_(output)
 {
     t_sigmoid_.reserve(SIGMOID_TABLE_SIZE + 1);
     for (int i = 0; i < SIGMOID_TABLE_SIZE + 1; i++)
@@ -30,24 +35,52 @@ Loss::Loss(std::shared_ptr<Matrix> &output, int64_t neg): output_(output), neg_(
     }
 }
 
-void Loss::initNegative(std::vector<int64_t> &trackCounts)
+NegativeSamplingLoss::NegativeSamplingLoss(std::shared_ptr<Matrix> &output, int64_t neg, bool prefetch)
+: Loss(output), neg_(neg), prefetch_(prefetch) {}
+
+// Each track gets ceil(sqrt(count) * NEGATIVE_TABLE_SIZE / z) slots. The
+// powers and the fill run on the thread pool, z is summed in index order so
+// the table does not depend on the number of threads.
+void NegativeSamplingLoss::initNegative(std::vector<int64_t> &trackCounts)
 {
+    const int64_t n = trackCounts.size();
+    ThreadPool &pool = ThreadPool::global();
+    
+    std::vector<double> powers(n);
+    pool.parallelFor(n, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            powers[i] = pow(trackCounts[i], 0.5);
+        }
+    }, 4096);
+    
     double z = 0.0;
-    for (size_t i = 0; i < trackCounts.size(); i++)
+    for (int64_t i = 0; i < n; i++)
     {
-        z += pow(trackCounts[i], 0.5);
+        z += powers[i];
     }
     
-    for (size_t i = 0; i < trackCounts.size(); i++)
+    std::vector<int64_t> offsets(n + 1, 0);
+    for (int64_t i = 0; i < n; i++)
     {
-        double c = pow(trackCounts[i], 0.5);
-        for (size_t j = 0; j < c * NEGATIVE_TABLE_SIZE / z; j++)
-        {
-            negatives_.push_back(i);
-        }
+        offsets[i + 1] = offsets[i] + int64_t(std::ceil(powers[i] * NEGATIVE_TABLE_SIZE / z));
     }
     
-    uniform_ = std::uniform_int_distribution<size_t>(0, negatives_.size() - 1);
+    const int64_t base = negatives_.size();
+    negatives_.resize(base + offsets[n]);
+    pool.parallelFor(n, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            std::fill(negatives_.begin() + base + offsets[i], negatives_.begin() + base + offsets[i + 1], i);
+        }
+    }, 4096);
+}
+
+// rebuilds the table from scratch
+void NegativeSamplingLoss::updateCounts(std::vector<int64_t> &trackCounts)
+{
+    negatives_.clear();
+    initNegative(trackCounts);
 }
 
 double Loss::log(double x) const
@@ -60,20 +93,43 @@ double Loss::log(double x) const
     return t_log_[i];
 }
 
+void Loss::setAdagrad(std::shared_ptr<Adagrad> adagrad)
+{
+    adagrad_ = adagrad;
+}
+
 double Loss::binaryLogistic(int64_t outputIdx, model::State &state, bool labelIsPositive, double lr)
 {
     double score = sigmoid(output_->dotRow(state.hidden, outputIdx));
     double alpha = lr * (double(labelIsPositive) - score);
     
-    state.grad.addRow(*output_, outputIdx, alpha);
-    output_->addVectorToRow(state.hidden, outputIdx, alpha);
+    if (adagrad_)
+    {
+        const double g = double(labelIsPositive) - score;
+        state.grad.addRow(*output_, outputIdx, g);
+        alpha *= adagrad_->scale(outputIdx, g * g * state.hiddenSquares);
+    }
+    else
+    {
+        state.grad.addRow(*output_, outputIdx, alpha);
+    }
+    
+    if (state.outputDelta)
+    {
+        state.outputDelta->add(outputIdx, state.hidden, alpha);
+    }
+    else
+    {
+        output_->addVectorToRow(state.hidden, outputIdx, alpha);
+    }
     
     return labelIsPositive ? -log(score) : -log(1.0 - score);
 }
 
+// NaN takes the first branch, a diverged model is left to Guard
 double Loss::sigmoid(double x) const
 {
-    if (x < -MAX_SIGMOID)
+    if (!(x >= -MAX_SIGMOID))
     {
         return 0.0;
     }
@@ -88,31 +144,143 @@ double Loss::sigmoid(double x) const
     }
 }
 
-double Loss::forward(int64_t output_idx, const std::set<int64_t>& outputs, model::State &state, double lr)
+double NegativeSamplingLoss::forward(int64_t output_idx, const std::set<int64_t>& outputs, model::State &state, double lr)
 {
     assert(output_idx >= 0);
     
+    if (state.negatives.size() < state.negativePos + neg_)
+    {
+        drawNegatives(1, outputs, state);
+    }
+    
     double loss = binaryLogistic(output_idx, state, true, lr);
     
     for (int32_t n = 0; n < neg_; n++)
     {
-        int64_t negative_idx = getNegative(output_idx, outputs, state.rng);
+        int64_t negative_idx = state.negatives[state.negativePos++];
         loss += binaryLogistic(negative_idx, state, false, lr);
     }
     
     return loss;
 }
 
-int64_t Loss::getNegative(int64_t outputIdx, const std::set<int64_t>& outputs, std::minstd_rand &rng)
+// Draw the negatives of the next npairs forward() calls at once and start
+// pulling their output rows in, so the dot products that follow overlap with
+// the memory latency instead of waiting on it one row at a time.
+void NegativeSamplingLoss::drawNegatives(int64_t npairs, const std::set<int64_t> &outputs, model::State &state)
+{
+    assert(!outputs.empty());
+    
+    state.negatives.resize(npairs * neg_);
+    state.negativePos = 0;
+    
+    const int64_t first = *outputs.begin();
+    for (int64_t n = 0; n < npairs * neg_; n++)
+    {
+        int64_t negative_idx = getNegative(first, outputs, state.rng);
+        state.negatives[n] = negative_idx;
+        if (prefetch_)
+        {
+            output_->prefetchRow(negative_idx);
+        }
+    }
+}
+
+int64_t NegativeSamplingLoss::getNegative(int64_t outputIdx, const std::set<int64_t>& outputs, Random &rng)
 {
     int32_t negative = outputIdx;
     
     while (0 < outputs.count(negative))
     {
-        negative = negatives_[uniform_(rng)];
+        negative = negatives_[rng.uniformInt(negatives_.size())];
     }
     
     return negative;
 }
 
+// Huffman coding as in word2vec: with the leaves sorted by descending count
+// the two smallest remaining nodes are always at the end of the leaves or at
+// the front of the inner nodes built so far, so no heap is needed.
+std::shared_ptr<const HierarchicalSoftmaxLoss::Tree> HierarchicalSoftmaxLoss::buildTree(const std::vector<int64_t> &counts)
+{
+    const int64_t n = counts.size();
+    const int64_t nnodes = std::max<int64_t>(1, 2 * n - 1);
+    std::vector<int64_t> count(nnodes, INT64_MAX);
+    std::vector<int64_t> parent(nnodes, -1);
+    std::vector<uint8_t> binary(nnodes, 0);
+    
+    std::copy(counts.begin(), counts.end(), count.begin());
+    
+    std::shared_ptr<Tree> tree = std::make_shared<Tree>();
+    tree->left.resize(std::max<int64_t>(0, n - 1));
+    tree->right.resize(std::max<int64_t>(0, n - 1));
+    auto child = [n](int64_t j) { return j < n ? -1 - j : j - n; };
+    
+    int64_t leaf = n - 1;
+    int64_t node = n;
+    for (int64_t i = n; i < 2 * n - 1; i++)
+    {
+        int64_t mini[2];
+        for (int64_t j = 0; j < 2; j++)
+        {
+            if (leaf >= 0 && count[leaf] < count[node])
+                mini[j] = leaf--;
+            else
+                mini[j] = node++;
+        }
+        count[i] = count[mini[0]] + count[mini[1]];
+        parent[mini[0]] = i;
+        parent[mini[1]] = i;
+        binary[mini[1]] = 1;
+        tree->left[i - n] = child(mini[0]);
+        tree->right[i - n] = child(mini[1]);
+    }
+    
+    // inner node i is output row i - n, the root is the last one
+    tree->offsets.resize(n + 1, 0);
+    ThreadPool::global().parallelFor(n, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            for (int64_t j = i; parent[j] != -1; j = parent[j])
+                tree->offsets[i + 1]++;
+        }
+    }, 4096);
+    for (int64_t i = 0; i < n; i++)
+    {
+        tree->offsets[i + 1] += tree->offsets[i];
+    }
+    
+    tree->nodes.resize(tree->offsets[n]);
+    tree->codes.resize(tree->offsets[n]);
+    ThreadPool::global().parallelFor(n, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            int64_t k = tree->offsets[i];
+            for (int64_t j = i; parent[j] != -1; j = parent[j], k++)
+            {
+                tree->nodes[k] = int32_t(parent[j] - n);
+                tree->codes[k] = binary[j];
+            }
+        }
+    }, 4096);
+    
+    return tree;
+}
+
+HierarchicalSoftmaxLoss::HierarchicalSoftmaxLoss(std::shared_ptr<Matrix> &output, std::shared_ptr<const Tree> tree)
+: Loss(output), tree_(tree) {}
+
+double HierarchicalSoftmaxLoss::forward(int64_t output_idx, const std::set<int64_t>&, model::State &state, double lr)
+{
+    assert(output_idx >= 0);
+    
+    double loss = 0.0;
+    for (int64_t k = tree_->offsets[output_idx]; k < tree_->offsets[output_idx + 1]; k++)
+    {
+        loss += binaryLogistic(tree_->nodes[k], state, tree_->codes[k], lr);
+    }
+    
+    return loss;
+}
+
 } // namespace track2vec
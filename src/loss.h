@@ -5,38 +5,103 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <vector>
-#include <random>
 #include <unordered_map>
 #include <set>
 
+#include "adagrad.h"
 #include "matrix.h"
 #include "model.h"
 
 namespace track2vec
 {
 
+// Binary logistic losses over rows of the output matrix, see the subclasses
 class Loss
 {
 public:
-    Loss(std::shared_ptr<Matrix> &, int64_t);
-    void initNegative(std::vector<int64_t> &);
-    double forward(int64_t, const std::set<int64_t>&, model::State &, double);
+    explicit Loss(std::shared_ptr<Matrix> &);
+    virtual ~Loss() {}
     
-private:
-    static const int64_t NEGATIVE_TABLE_SIZE = 10000000;
+    virtual double forward(int64_t, const std::set<int64_t>&, model::State &, double) = 0;
+    
+    // prepare the next npairs forward() calls of a window, e.g. draw negatives
+    virtual void drawNegatives(int64_t, const std::set<int64_t>&, model::State &) {}
     
+    // the track counts changed, no forward() may run meanwhile
+    virtual void updateCounts(std::vector<int64_t> &) {}
+    
+    // scale the output row updates per row, the gradient left in State::grad
+    // is then the raw one and the model applies lr to it
+    void setAdagrad(std::shared_ptr<Adagrad>);
+
+protected:
     std::shared_ptr<Matrix> output_;
-    int64_t neg_;
+    std::shared_ptr<Adagrad> adagrad_;
     std::vector<double> t_sigmoid_;
     std::vector<double> t_log_;
-    std::vector<int64_t> negatives_;
-    std::uniform_int_distribution<size_t> uniform_;
     
-    int64_t getNegative(int64_t, const std::set<int64_t>&, std::minstd_rand&);
     double binaryLogistic(int64_t, model::State &, bool, double);
     double sigmoid(double) const;
     double log(double) const;
 };
 
+// The target plus neg tracks drawn from the unigram^0.5 table, 1 + neg dot
+// products per pair
+class NegativeSamplingLoss : public Loss
+{
+public:
+    NegativeSamplingLoss(std::shared_ptr<Matrix> &, int64_t, bool prefetch = true);
+    void initNegative(std::vector<int64_t> &);
+    void drawNegatives(int64_t, const std::set<int64_t>&, model::State &) override;
+    void updateCounts(std::vector<int64_t> &) override;
+    double forward(int64_t, const std::set<int64_t>&, model::State &, double) override;
+
+private:
+    static const int64_t NEGATIVE_TABLE_SIZE = 10000000;
+    
+    int64_t neg_;
+    bool prefetch_;
+    std::vector<int64_t> negatives_;
+    
+    int64_t getNegative(int64_t, const std::set<int64_t>&, Random&);
+};
+
+// Hierarchical softmax over a Huffman tree of the track counts. Row i of the
+// output matrix is the vector of inner node i instead of a track, a pair costs
+// one dot product per node on the path of the target, O(log V).
+class HierarchicalSoftmaxLoss : public Loss
+{
+public:
+    // inner nodes and the left/right decisions from every leaf to the root,
+    // and the children of every inner node (leaf i as -1 - i). Shared by the
+    // losses of all replicas and by the evaluator.
+    struct Tree
+    {
+        std::vector<int64_t> offsets;
+        std::vector<int32_t> nodes;
+        std::vector<uint8_t> codes;
+        std::vector<int64_t> left;
+        std::vector<int64_t> right;
+        
+        inline int64_t depth(int64_t leaf) const
+        {
+            return offsets[leaf + 1] - offsets[leaf];
+        }
+    };
+    
+    // counts in descending order, as the dictionary indexes tracks
+    static std::shared_ptr<const Tree> buildTree(const std::vector<int64_t> &);
+    
+    // the tree keeps the counts it was built from, updateCounts() would
+    // change what the output rows stand for
+    HierarchicalSoftmaxLoss(std::shared_ptr<Matrix> &, std::shared_ptr<const Tree>);
+    double forward(int64_t, const std::set<int64_t>&, model::State &, double) override;
+
+private:
+    std::shared_ptr<const Tree> tree_;
+};
+
 } // namespace track2vec
@@ -9,6 +9,10 @@
 #include <functional>
 
 #include "args.h"
+#include "bench.h"
+#include "distributed.h"
+#include "pool.h"
+#include "sweep.h"
 #include "track2vec.h"
 #include "logs.h"
 
@@ -19,8 +23,12 @@ void printUsage()
     std::cerr
     << "usage: track2vec <command> <args> \n"
     << "The commands supported by track2vec are \n"
-    << " train          train a skipgram model \n"
+    << " train          train a skipgram or cbow model \n"
     << " nn          query for nearest neighbors \n"
+    << " serve-train    keep training on sessions streamed to -input \n"
+    << " sweep          train a grid of configurations on one loaded corpus \n"
+    << " bench          run micro benchmarks on synthetic data \n"
+    << " coordinator    coordinate distributed training ranks \n"
     << std::endl;
 }
 
@@ -29,14 +37,76 @@ void train(const std::vector<std::string> arguements)
     std::shared_ptr<Args> args = std::make_shared<Args>();
     args->parseArgs(arguements);
     
+    // one pool for every phase, a worker per trainer and the -evalThreads
+    // workers, which also take the parallel work done while training
+    ThreadPool::configure(args->thread + args->evalThreads);
+    
     std::shared_ptr<Logs> logs = std::make_shared<Logs>(args->localLog, args->s3Log, args->logBufferSize);
     
     std::shared_ptr<Track2Vec> track2vec = std::make_shared<Track2Vec>(args);
     track2vec->train(logs->getCallback(args->yyyymmddhh));
+    
+    // the checkpoint holds the run, half trained vectors are not saved
+    if (track2vec->interrupted())
+    {
+        exit(EXIT_FAILURE);
+    }
+    
+    // every rank ends with the same averaged model, rank 0 writes it
+    if (args->rank == 0)
+    {
+        track2vec->saveVectors(args->outputDir);
+        track2vec->saveModel(args->outputDir);
+    }
+}
+
+void serveTrain(const std::vector<std::string> arguements)
+{
+    std::shared_ptr<Args> args = std::make_shared<Args>();
+    args->parseArgs(arguements);
+    
+    // the snapshots are exported on the -evalThreads workers
+    ThreadPool::configure(args->thread + args->evalThreads);
+    
+    std::shared_ptr<Logs> logs = std::make_shared<Logs>(args->localLog, args->s3Log, args->logBufferSize);
+    
+    std::shared_ptr<Track2Vec> track2vec = std::make_shared<Track2Vec>(args);
+    track2vec->serve(logs->getCallback(args->yyyymmddhh));
+    
+    // a restart with -loadPretrained 1 goes on from here
     track2vec->saveVectors(args->outputDir);
     track2vec->saveModel(args->outputDir);
 }
 
+void sweep(const std::vector<std::string> arguements)
+{
+    std::shared_ptr<Args> args = std::make_shared<Args>();
+    args->parseArgs(arguements);
+    
+    Sweep sweep(args);
+    sweep.run();
+}
+
+void coordinator(const std::vector<std::string> arguements)
+{
+    std::shared_ptr<Args> args = std::make_shared<Args>();
+    args->parseArgs(arguements);
+    
+    Coordinator coordinator(args);
+    coordinator.run();
+}
+
+void bench(const std::vector<std::string> arguements)
+{
+    std::shared_ptr<Args> args = std::make_shared<Args>();
+    args->parseArgs(arguements);
+    
+    ThreadPool::configure(args->thread);
+    
+    Bench bench(args);
+    bench.run();
+}
+
 int main(int argc, char **argv)
 {
     
@@ -62,6 +132,22 @@ int main(int argc, char **argv)
     {
         train(args);
     }
+    else if (command == "serve-train")
+    {
+        serveTrain(args);
+    }
+    else if (command == "sweep")
+    {
+        sweep(args);
+    }
+    else if (command == "bench")
+    {
+        bench(args);
+    }
+    else if (command == "coordinator")
+    {
+        coordinator(args);
+    }
     else
     {
         printUsage();
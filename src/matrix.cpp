@@ -5,15 +5,25 @@
 
 #include "matrix.h"
 
-#include <thread>
-#include <random>
+#include <algorithm>
+#include <cmath>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "random.h"
 #include "vector.h"
 
 namespace track2vec
 {
 
-Matrix::Matrix(int64_t m, int64_t n)
-: m_(m), n_(n), data_(m * n) {}
+// Elements are left uninitialized so that zero() or randomInit() can first
+// touch the pages from the threads that will use them.
+Matrix::Matrix(int64_t m, int64_t n, std::shared_ptr<Allocator> allocator)
+: m_(m), n_(n), stride_(allocator->rowStride(n, sizeof(double))), data_(allocator, m * stride_) {}
+
+// Row tracking is not copied, a copy starts untracked.
+Matrix::Matrix(const Matrix &other)
+: m_(other.m_), n_(other.n_), stride_(other.stride_), data_(other.data_) {}
 
 int64_t Matrix::size(int64_t dim) const
 {
@@ -21,24 +31,47 @@ int64_t Matrix::size(int64_t dim) const
     return dim == 0 ? m_ : n_;
 }
 
-void Matrix::zero()
+// Row ranges run on the thread pool unless nthreads is 1. Blocks are large
+// enough that each one covers whole pages.
+void Matrix::forRows(int64_t nthreads, const std::function<void(int64_t, int64_t)> &fn)
+{
+    if (nthreads <= 1)
+    {
+        fn(0, m_);
+        return;
+    }
+    ThreadPool::global().parallelFor(m_, fn, 1024);
+}
+
+void Matrix::zero(int64_t nthreads)
 {
-    std::fill(data_.begin(), data_.end(), 0.0);
+    forRows(nthreads, [this](int64_t begin, int64_t end) {
+        std::fill(data_.data() + begin * stride_, data_.data() + end * stride_, 0.0);
+    });
 }
 
 double &Matrix::at(int64_t i, int64_t j)
 {
-    return data_[i * n_ + j];
+    return data_[i * stride_ + j];
 }
 
-void Matrix::randomInit(int64_t seed)
+// Uniform(-1, 1) from a counter-based generator keyed by (seed, row), so the
+// result is bitwise identical for any number of threads.
+void Matrix::randomInit(int64_t seed, int64_t nthreads)
 {
-    std::minstd_rand rng(seed);
-    std::uniform_real_distribution<> uniform(-1, 1);
-    for (int64_t i = 0; i < (m_ * n_); i++)
-    {
-        data_[i] = uniform(rng);
-    }
+    forRows(nthreads, [this, seed](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+        {
+            const uint64_t key = Random::hash(seed, i);
+            double *row = data_.data() + i * stride_;
+            
+            for (int64_t j = 0; j < n_; j++)
+            {
+                row[j] = double(Random::hash(key, j) >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+            }
+            std::fill(row + n_, row + stride_, 0.0);
+        }
+    });
 }
 
 void Matrix::addVectorToRow(const Vector &vec, int64_t i)
@@ -46,9 +79,10 @@ void Matrix::addVectorToRow(const Vector &vec, int64_t i)
     assert(i >= 0);
     assert(i < m_);
     assert(vec.size() == n_);
+    touch(i);
     for (int64_t j = 0; j < n_; j++)
     {
-        data_[i * n_ + j] += vec[j];
+        data_[i * stride_ + j] += vec[j];
     }
 }
 
@@ -57,12 +91,76 @@ void Matrix::addVectorToRow(const Vector &vec, int64_t i, double a)
     assert(i >= 0);
     assert(i < m_);
     assert(vec.size() == n_);
+    touch(i);
+    for (int64_t j = 0; j < n_; j++)
+    {
+        data_[i * stride_ + j] += a * vec[j];
+    }
+}
+
+void Matrix::addArrayToRow(const double *vec, int64_t i)
+{
+    assert(i >= 0);
+    assert(i < m_);
+    touch(i);
     for (int64_t j = 0; j < n_; j++)
     {
-        data_[i * n_ + j] += a * vec[j];
+        data_[i * stride_ + j] += vec[j];
     }
 }
 
+void Matrix::getRow(int64_t i, double *row) const
+{
+    assert(i >= 0);
+    assert(i < m_);
+    std::copy(data_.data() + i * stride_, data_.data() + i * stride_ + n_, row);
+}
+
+void Matrix::setRow(int64_t i, const double *row)
+{
+    assert(i >= 0);
+    assert(i < m_);
+    std::copy(row, row + n_, data_.data() + i * stride_);
+}
+
+bool Matrix::lockRows(int64_t begin, int64_t end)
+{
+    assert(begin >= 0 && begin <= end && end <= m_);
+    if (begin == end)
+        return true;
+    
+    const double *ptr = data_.data() + begin * stride_;
+    return 0 == mlock(ptr, (end - begin) * stride_ * sizeof(double));
+}
+
+void Matrix::trackRows()
+{
+    touched_.reset(new std::atomic<uint8_t>[m_]);
+    for (int64_t i = 0; i < m_; i++)
+    {
+        touched_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+// Rows written since the previous call. A row written again while the caller
+// reads it is reported again next time.
+std::vector<int64_t> Matrix::takeTouched()
+{
+    std::vector<int64_t> rows;
+    if (!touched_)
+    {
+        return rows;
+    }
+    for (int64_t i = 0; i < m_; i++)
+    {
+        if (touched_[i].load(std::memory_order_relaxed) && touched_[i].exchange(0, std::memory_order_relaxed))
+        {
+            rows.push_back(i);
+        }
+    }
+    return rows;
+}
+
 void Matrix::addRowToVector(Vector &x, int64_t i) const
 {
     assert(i >= 0);
@@ -85,6 +183,28 @@ void Matrix::addRowToVector(Vector &x, int64_t i, double a) const
     }
 }
 
+// Replace every element of the replicas with their mean
+void Matrix::average(const std::vector<std::shared_ptr<Matrix>> &replicas)
+{
+    const size_t n = replicas.size();
+    const size_t size = replicas[0]->data_.size();
+    const double scale = 1.0 / n;
+    
+    for (size_t i = 0; i < size; i++)
+    {
+        double sum = 0.0;
+        for (size_t r = 0; r < n; r++)
+        {
+            sum += replicas[r]->data_[i];
+        }
+        sum *= scale;
+        for (size_t r = 0; r < n; r++)
+        {
+            replicas[r]->data_[i] = sum;
+        }
+    }
+}
+
 double Matrix::dotRow(const Vector &vec, int64_t i) const
 {
     double d = 0.0;
@@ -93,11 +213,6 @@ double Matrix::dotRow(const Vector &vec, int64_t i) const
     {
         d += at(i, j) * vec[j];
     }
-    if (std::isnan(d))
-    {
-        std::cerr << "EncounteredNaNError: " << vec << std::endl;
-        throw EncounteredNaNError();
-    }
     return d;
 }
 
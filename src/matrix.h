@@ -5,12 +5,17 @@
 
 #pragma once
 
+#include <atomic>
 #include <stdexcept>
 #include <iostream>
 #include <cassert>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <vector>
 
+#include "memory.h"
+
 namespace track2vec
 {
 
@@ -21,30 +26,75 @@ class Matrix
 private:
     int64_t m_;
     int64_t n_;
-    std::vector<double> data_;
+    int64_t stride_;
+    Buffer<double> data_;
+    std::unique_ptr<std::atomic<uint8_t>[]> touched_;
+    
+    void forRows(int64_t, const std::function<void(int64_t, int64_t)> &);
     
 public:
-    explicit Matrix(int64_t, int64_t);
+    explicit Matrix(int64_t, int64_t, std::shared_ptr<Allocator> = Allocator::standard());
+    Matrix(const Matrix &);
     int64_t size(int64_t dim) const;
-    void zero();
+    void zero(int64_t nthreads = 1);
     double &at(int64_t i, int64_t j);
     
     void addVectorToRow(const Vector &, int64_t, double);
     void addVectorToRow(const Vector &, int64_t);
+    void addArrayToRow(const double *, int64_t);
+    
+    void getRow(int64_t, double *) const;
+    void setRow(int64_t, const double *);
+    
+    // remember which rows the add* methods write to, see takeTouched
+    void trackRows();
+    
+    // keep rows [begin, end) resident, false when RLIMIT_MEMLOCK does not allow it
+    bool lockRows(int64_t, int64_t);
+    std::vector<int64_t> takeTouched();
     
     void addRowToVector(Vector&, int64_t) const;
     void addRowToVector(Vector&, int64_t, double) const;
     
-    void randomInit(int64_t);
+    void randomInit(int64_t, int64_t nthreads = 1);
     
     double dotRow(const Vector&, int64_t) const;
     
+    static void average(const std::vector<std::shared_ptr<Matrix>> &);
+    
     inline const double &at(int64_t i, int64_t j) const
     {
-        assert(i * n_ + j < data_.size());
-        return data_[i * n_ + j];
+        assert(i * stride_ + j < data_.size());
+        return data_[i * stride_ + j];
     };
     
+    inline void touch(int64_t i)
+    {
+        if (touched_ && !touched_[i].load(std::memory_order_relaxed))
+        {
+            touched_[i].store(1, std::memory_order_relaxed);
+        }
+    }
+    
+    // written since the last takeTouched
+    inline bool touched(int64_t i) const
+    {
+        return touched_ && touched_[i].load(std::memory_order_relaxed);
+    }
+    
+    // pull a row into cache ahead of use; rw = 1 when the row will be written
+    inline void prefetchRow(int64_t i, int rw = 1) const
+    {
+        const double *row = data_.data() + i * stride_;
+        for (int64_t j = 0; j < n_; j += 8)
+        {
+            if (rw)
+                __builtin_prefetch(row + j, 1, 3);
+            else
+                __builtin_prefetch(row + j, 0, 3);
+        }
+    }
+    
     inline int64_t rows() const
     {
         return m_;
@@ -53,6 +103,10 @@ public:
     {
         return n_;
     }
+    inline std::string allocator() const
+    {
+        return data_.allocator()->name();
+    }
     
     class EncounteredNaNError : public std::runtime_error
     {
@@ -0,0 +1,266 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "memory.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#endif
+
+namespace track2vec
+{
+
+std::shared_ptr<Allocator> Allocator::create(const std::string &name, bool pad, const std::string &dir)
+{
+    if (name == "standard")
+    {
+        return standard();
+    }
+    else if (name == "aligned")
+    {
+        return std::make_shared<AlignedAllocator>(pad);
+    }
+    else if (name == "huge")
+    {
+        return std::make_shared<HugePageAllocator>(pad);
+    }
+    else if (name == "mmap")
+    {
+        return std::make_shared<MappedFileAllocator>(pad, dir);
+    }
+    
+    throw std::invalid_argument("Unknown allocator: " + name);
+}
+
+std::shared_ptr<Allocator> Allocator::standard()
+{
+    static std::shared_ptr<Allocator> allocator = std::make_shared<StandardAllocator>();
+    return allocator;
+}
+
+void *StandardAllocator::allocate(size_t bytes)
+{
+    return ::operator new(bytes);
+}
+
+void StandardAllocator::deallocate(void *ptr, size_t)
+{
+    ::operator delete(ptr);
+}
+
+std::string StandardAllocator::name() const
+{
+    return "standard";
+}
+
+AlignedAllocator::AlignedAllocator(bool pad) : pad_(pad) {}
+
+void *AlignedAllocator::allocate(size_t bytes)
+{
+    void *ptr = nullptr;
+    if (0 != posix_memalign(&ptr, CACHE_LINE, bytes ? bytes : CACHE_LINE))
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void AlignedAllocator::deallocate(void *ptr, size_t)
+{
+    free(ptr);
+}
+
+std::string AlignedAllocator::name() const
+{
+    return "aligned";
+}
+
+int64_t AlignedAllocator::rowStride(int64_t cols, size_t elemSize) const
+{
+    if (!pad_)
+        return cols;
+    
+    const int64_t per_line = CACHE_LINE / elemSize;
+    return (cols + per_line - 1) / per_line * per_line;
+}
+
+HugePageAllocator::HugePageAllocator(bool pad) : AlignedAllocator(pad) {}
+
+namespace
+{
+
+size_t roundToHugePage(size_t bytes)
+{
+    const size_t page = HugePageAllocator::HUGE_PAGE;
+    return (bytes + page - 1) / page * page;
+}
+
+} // namespace
+
+void *HugePageAllocator::allocate(size_t bytes)
+{
+    const size_t size = roundToHugePage(bytes ? bytes : 1);
+    void *ptr = MAP_FAILED;
+    
+#ifdef MAP_HUGETLB
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    
+    if (ptr == MAP_FAILED)
+    {
+        // no reserved huge pages: regular mapping advised for THP
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            throw std::bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    }
+    
+    return ptr;
+}
+
+void HugePageAllocator::deallocate(void *ptr, size_t bytes)
+{
+    munmap(ptr, roundToHugePage(bytes ? bytes : 1));
+}
+
+std::string HugePageAllocator::name() const
+{
+    return "huge";
+}
+
+MappedFileAllocator::MappedFileAllocator(bool pad, const std::string &dir) : AlignedAllocator(pad), dir_(dir)
+{
+#ifdef __linux__
+    // tmpfs pages live in RAM and swap, the matrices would not be out of core
+    struct statfs fs;
+    if (statfs(dir_.c_str(), &fs) == 0 && fs.f_type == TMPFS_MAGIC)
+    {
+        std::cerr << ">> " << dir_ << " is tmpfs, -alloc mmap keeps the matrices in memory" << std::endl;
+    }
+#endif
+}
+
+namespace
+{
+
+size_t pageSize()
+{
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+} // namespace
+
+void *MappedFileAllocator::allocate(size_t bytes)
+{
+    const size_t size = bytes ? bytes : 1;
+    std::string path = dir_ + "/track2vec-XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    
+    int fd = mkstemp(name.data());
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot create a matrix file in " + dir_);
+    }
+    // the file lives only as long as the mapping
+    unlink(name.data());
+    
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("cannot grow a matrix file in " + dir_);
+    }
+    
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        close(fd);
+        throw std::bad_alloc();
+    }
+    madvise(ptr, size, MADV_RANDOM);
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    files_[static_cast<const char *>(ptr)] = std::make_pair(size, fd);
+    return ptr;
+}
+
+void MappedFileAllocator::deallocate(void *ptr, size_t)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = files_.find(static_cast<const char *>(ptr));
+    if (it == files_.end())
+        return;
+    
+    munmap(ptr, it->second.first);
+    close(it->second.second);
+    files_.erase(it);
+}
+
+std::string MappedFileAllocator::name() const
+{
+    return "mmap";
+}
+
+void MappedFileAllocator::evict(const void *ptr, size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const char *p = static_cast<const char *>(ptr);
+    auto it = files_.upper_bound(p);
+    if (it == files_.begin())
+        return;
+    --it;
+    
+    const char *base = it->first;
+    const size_t page = pageSize();
+    const size_t begin = (p - base + page - 1) / page * page;
+    const size_t end = std::min(size_t(p - base) + bytes, it->second.first) / page * page;
+    if (begin >= end)
+        return;
+    
+    void *addr = const_cast<char *>(base + begin);
+    msync(addr, end - begin, MS_SYNC);
+    madvise(addr, end - begin, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(it->second.second, begin, end - begin, POSIX_FADV_DONTNEED);
+#endif
+}
+
+double MappedFileAllocator::resident(const void *ptr, size_t bytes)
+{
+    const size_t page = pageSize();
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(ptr) / page * page;
+    const uintptr_t end = reinterpret_cast<uintptr_t>(ptr) + bytes;
+    const size_t npages = (end - begin + page - 1) / page;
+    if (npages == 0)
+        return 1.0;
+    
+    std::vector<unsigned char> vec(npages);
+    if (mincore(reinterpret_cast<void *>(begin), end - begin, vec.data()) != 0)
+        return -1.0;
+    
+    size_t n = 0;
+    for (unsigned char v : vec)
+    {
+        n += v & 1;
+    }
+    return double(n) / npages;
+}
+
+} // namespace track2vec
@@ -0,0 +1,198 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+
+namespace track2vec
+{
+
+// Backing storage for matrices and the in-memory corpus
+class Allocator
+{
+public:
+    static const size_t CACHE_LINE = 64;
+    
+    virtual ~Allocator() {}
+    virtual void *allocate(size_t) = 0;
+    virtual void deallocate(void *, size_t) = 0;
+    virtual std::string name() const = 0;
+    
+    // distance between matrix rows in elements of the given size
+    virtual int64_t rowStride(int64_t cols, size_t) const
+    {
+        return cols;
+    }
+    
+    // "standard", "aligned", "huge" or "mmap", the latter backed by files in dir
+    static std::shared_ptr<Allocator> create(const std::string &, bool pad = true,
+                                             const std::string &dir = "/tmp");
+    static std::shared_ptr<Allocator> standard();
+};
+
+// plain operator new
+class StandardAllocator : public Allocator
+{
+public:
+    void *allocate(size_t) override;
+    void deallocate(void *, size_t) override;
+    std::string name() const override;
+};
+
+// cache line aligned blocks, rows optionally padded to a cache line multiple
+class AlignedAllocator : public Allocator
+{
+protected:
+    bool pad_;
+    
+public:
+    explicit AlignedAllocator(bool);
+    void *allocate(size_t) override;
+    void deallocate(void *, size_t) override;
+    std::string name() const override;
+    int64_t rowStride(int64_t, size_t) const override;
+};
+
+// Anonymous mappings backed by explicit huge pages (MAP_HUGETLB) when the
+// system has them reserved, otherwise advised for transparent huge pages.
+class HugePageAllocator : public AlignedAllocator
+{
+public:
+    static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+    
+    explicit HugePageAllocator(bool);
+    void *allocate(size_t) override;
+    void deallocate(void *, size_t) override;
+    std::string name() const override;
+};
+
+// Shared mappings of unlinked files in a directory, so a matrix can be larger
+// than RAM and the kernel pages cold rows out to disk. Mappings are advised
+// for random access; callers lock the rows that have to stay resident.
+class MappedFileAllocator : public AlignedAllocator
+{
+private:
+    std::string dir_;
+    std::mutex mutex_;
+    std::map<const char *, std::pair<size_t, int>> files_;
+    
+public:
+    MappedFileAllocator(bool, const std::string &);
+    void *allocate(size_t) override;
+    void deallocate(void *, size_t) override;
+    std::string name() const override;
+    
+    // write back and drop the pages of a range from memory
+    void evict(const void *, size_t);
+    
+    // fraction of the pages of a range that are in memory
+    static double resident(const void *, size_t);
+};
+
+// Growable array of trivially copyable elements on top of an Allocator.
+// New elements are left uninitialized.
+template <typename T>
+class Buffer
+{
+private:
+    std::shared_ptr<Allocator> allocator_;
+    T *data_;
+    size_t size_;
+    size_t capacity_;
+    
+public:
+    explicit Buffer(std::shared_ptr<Allocator> allocator = Allocator::standard(), size_t n = 0)
+    : allocator_(allocator), data_(nullptr), size_(0), capacity_(0)
+    {
+        resize(n);
+    }
+    
+    Buffer(const Buffer &other)
+    : allocator_(other.allocator_), data_(nullptr), size_(0), capacity_(0)
+    {
+        resize(other.size_);
+        if (size_ > 0)
+            std::memcpy(data_, other.data_, size_ * sizeof(T));
+    }
+    
+    Buffer(Buffer &&other) noexcept
+    : allocator_(other.allocator_), data_(other.data_), size_(other.size_), capacity_(other.capacity_)
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.capacity_ = 0;
+    }
+    
+    Buffer &operator=(const Buffer &) = delete;
+    
+    ~Buffer()
+    {
+        if (data_)
+            allocator_->deallocate(data_, capacity_ * sizeof(T));
+    }
+    
+    void reserve(size_t n)
+    {
+        if (n <= capacity_)
+            return;
+        
+        T *data = static_cast<T *>(allocator_->allocate(n * sizeof(T)));
+        if (data_)
+        {
+            std::memcpy(data, data_, size_ * sizeof(T));
+            allocator_->deallocate(data_, capacity_ * sizeof(T));
+        }
+        data_ = data;
+        capacity_ = n;
+    }
+    
+    void resize(size_t n)
+    {
+        reserve(n);
+        size_ = n;
+    }
+    
+    void push_back(const T &value)
+    {
+        if (size_ == capacity_)
+            reserve(capacity_ ? 2 * capacity_ : 1024);
+        data_[size_++] = value;
+    }
+    
+    inline T *data()
+    {
+        return data_;
+    }
+    inline const T *data() const
+    {
+        return data_;
+    }
+    inline size_t size() const
+    {
+        return size_;
+    }
+    inline T &operator[](size_t i)
+    {
+        return data_[i];
+    }
+    inline const T &operator[](size_t i) const
+    {
+        return data_[i];
+    }
+    inline const std::shared_ptr<Allocator> &allocator() const
+    {
+        return allocator_;
+    }
+};
+
+} // namespace track2vec
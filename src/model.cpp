@@ -4,15 +4,29 @@
  **/
 
 #include "model.h"
+#include "adagrad.h"
 #include "loss.h"
 
 namespace track2vec
 {
+
+namespace
+{
+
+inline double meanSquare(const Vector &v)
+{
+    const double norm = v.norm();
+    return norm * norm / v.size();
+}
+
+} // namespace
+
 namespace model
 {
 
 State::State(int64_t hiddenSize, int64_t outputSize, int64_t seed)
-: lossValue_(0.0), nexamples_(0), hidden(hiddenSize), output(outputSize), grad(hiddenSize), rng(seed) {}
+: lossValue_(0.0), nexamples_(0), hidden(hiddenSize), output(outputSize), grad(hiddenSize), rng(seed), negativePos(0), hotUpdates(0),
+hiddenSquares(0), inputDelta(nullptr), outputDelta(nullptr) {}
 
 double State::getLoss()
 {
@@ -32,7 +46,108 @@ void State::incrementNExamples(double loss)
 
 } // namespace model
 Model::Model(std::shared_ptr<Matrix> input, std::shared_ptr<Matrix> output, std::shared_ptr<Loss> loss)
-: input_(input), output_(output), loss_(loss) {}
+: input_(input), output_(output), loss_(loss), hotFlush_(0) {}
+
+// Rows listed here are shared by so many tracks that every thread writes
+// them constantly. Their updates are accumulated per thread and folded into
+// the input matrix every flushInterval backprops instead.
+void Model::setHotRows(const std::vector<int64_t> &indices, int64_t flushInterval)
+{
+    hotIndices_ = indices;
+    hotFlush_ = flushInterval;
+    hotSlots_.assign(input_->size(0), -1);
+    
+    for (size_t slot = 0; slot < indices.size(); slot++)
+    {
+        hotSlots_[indices[slot]] = slot;
+    }
+}
+
+void Model::setAdagrad(std::shared_ptr<Adagrad> input, std::shared_ptr<Adagrad> output)
+{
+    adagrad_ = input;
+    outputAdagrad_ = output;
+    loss_->setAdagrad(output);
+}
+
+void Model::repair()
+{
+    if (adagrad_)
+    {
+        adagrad_->repair();
+        outputAdagrad_->repair();
+    }
+}
+
+void Model::updateCounts(std::vector<int64_t> &trackCounts)
+{
+    loss_->updateCounts(trackCounts);
+}
+
+void Model::flush(model::State &state)
+{
+    for (int64_t slot : state.hotPending)
+    {
+        input_->addVectorToRow(state.hotDelta[slot], hotIndices_[slot]);
+        state.hotDelta[slot].zero();
+        state.hotDirty[slot] = false;
+    }
+    state.hotPending.clear();
+    state.hotUpdates = 0;
+}
+
+// this thread's own update of a hot row that is not flushed yet
+void Model::addPending(Vector &hidden, int64_t idx, const model::State &state) const
+{
+    int64_t slot = hotSlots_.empty() ? -1 : hotSlots_[idx];
+    if (slot >= 0 && !state.hotDirty.empty() && state.hotDirty[slot])
+    {
+        hidden.add(state.hotDelta[slot]);
+    }
+}
+
+void Model::addToInput(const Vector &grad, int64_t idx, double step, model::State &state)
+{
+    int64_t slot = hotSlots_.empty() ? -1 : hotSlots_[idx];
+    if (slot < 0)
+    {
+        input_->addVectorToRow(grad, idx, step);
+        return;
+    }
+    
+    if (state.hotDelta.empty())
+    {
+        state.hotDelta.assign(hotIndices_.size(), Vector(grad.size()));
+        state.hotDirty.assign(hotIndices_.size(), false);
+    }
+    
+    if (!state.hotDirty[slot])
+    {
+        state.hotDirty[slot] = true;
+        state.hotPending.push_back(slot);
+    }
+    state.hotDelta[slot].add(grad, step);
+}
+
+void Model::drawNegatives(int64_t npairs, const std::set<int64_t> &outputs, model::State &state)
+{
+    loss_->drawNegatives(npairs, outputs, state);
+}
+
+void Model::prefetchInput(int64_t input_idx,
+                          const std::vector<int64_t> &artist_indices,
+                          const std::vector<int64_t> &genre_indices) const
+{
+    input_->prefetchRow(input_idx);
+    for (const auto &artist_idx : artist_indices)
+    {
+        input_->prefetchRow(artist_idx);
+    }
+    for (const auto &genre_idx : genre_indices)
+    {
+        input_->prefetchRow(genre_idx);
+    }
+}
 
 void Model::computeHidden(int64_t input_idx,
                           const std::vector<int64_t> &artist_indices,
@@ -50,12 +165,14 @@ void Model::computeHidden(int64_t input_idx,
     for (const auto &artist_idx : artist_indices)
     {
         hidden.addRow(*input_, artist_idx);
+        addPending(hidden, artist_idx, state);
     }
     
     // reco genre embedding
     for (const auto &genre_idx : genre_indices)
     {
         hidden.addRow(*input_, genre_idx);
+        addPending(hidden, genre_idx, state);
     }
     
     int64_t total = 1 + artist_indices.size() + genre_indices.size();
@@ -71,32 +188,106 @@ void Model::update(int64_t input_idx,
                    model::State &state)
 {
     computeHidden(input_idx, artist_indices, genre_indices, state);
+    if (adagrad_)
+    {
+        state.hiddenSquares = meanSquare(state.hidden);
+    }
+    
+    Vector &grad = state.grad;
+    grad.zero();
+    
+    double lossValue = loss_->forward(output_idx, outputs, state, lr);
+    state.incrementNExamples(lossValue);
+    
+    backprop(input_idx, artist_indices, genre_indices, grad, lr, state);
+}
+
+void Model::updateContexts(const std::vector<const trackEntry *> &contexts,
+                           int64_t output_idx,
+                           const std::set<int64_t>& outputs,
+                           double lr,
+                           model::State &state)
+{
+    // grad collects the context vectors before it holds the gradient
     Vector &grad = state.grad;
     grad.zero();
+    for (const trackEntry *context : contexts)
+    {
+        computeHidden(context->idx, context->artist_matrix_indices, context->genre_matrix_indices, state);
+        grad.add(state.hidden);
+    }
+    
+    state.hidden = grad;
+    state.hidden.mul(1.0 / contexts.size());
+    grad.zero();
+    if (adagrad_)
+    {
+        state.hiddenSquares = meanSquare(state.hidden);
+    }
     
     double lossValue = loss_->forward(output_idx, outputs, state, lr);
     state.incrementNExamples(lossValue);
     
-    backprop(input_idx, artist_indices, genre_indices, grad);
+    for (const trackEntry *context : contexts)
+    {
+        backprop(context->idx, context->artist_matrix_indices, context->genre_matrix_indices, grad, lr, state);
+    }
 }
 
 void Model::backprop(int64_t track_idx,
                      const std::vector<int64_t> &artist_indices,
                      const std::vector<int64_t> &genre_indices,
-                     const Vector &grad)
+                     const Vector &grad,
+                     double lr,
+                     model::State &state)
 {
+    if (state.inputDelta)
+    {
+        state.inputDelta->add(track_idx, grad, 1.0);
+        for (auto artist_idx : artist_indices)
+        {
+            state.inputDelta->add(artist_idx, grad, 1.0);
+        }
+        for (auto genre_idx : genre_indices)
+        {
+            state.inputDelta->add(genre_idx, grad, 1.0);
+        }
+        return;
+    }
     
-    input_->addVectorToRow(grad, track_idx);
-    
-    // update artist embedding
-    for (auto artist_idx : artist_indices)
+    if (adagrad_)
     {
-        input_->addVectorToRow(grad, artist_idx);
+        // every row takes its own step along the same raw gradient
+        const double g2 = meanSquare(grad);
+        input_->addVectorToRow(grad, track_idx, lr * adagrad_->scale(track_idx, g2));
+        for (auto artist_idx : artist_indices)
+        {
+            addToInput(grad, artist_idx, lr * adagrad_->scale(artist_idx, g2), state);
+        }
+        for (auto genre_idx : genre_indices)
+        {
+            addToInput(grad, genre_idx, lr * adagrad_->scale(genre_idx, g2), state);
+        }
     }
-    // update genre embedding
-    for (auto genre_idx : genre_indices)
+    else
+    {
+        input_->addVectorToRow(grad, track_idx);
+        
+        // update artist embedding
+        for (auto artist_idx : artist_indices)
+        {
+            addToInput(grad, artist_idx, 1.0, state);
+        }
+        // update genre embedding
+        for (auto genre_idx : genre_indices)
+        {
+            addToInput(grad, genre_idx, 1.0, state);
+        }
+    }
+    
+    if (hotFlush_ > 0 && ++state.hotUpdates >= hotFlush_)
     {
-        input_->addVectorToRow(grad, genre_idx);
+        flush(state);
     }
 }
 
@@ -6,9 +6,12 @@
 #pragma once
 
 #include <memory>
-#include <random>
 #include <set>
+#include <vector>
 
+#include "delta.h"
+#include "entry.h"
+#include "random.h"
 #include "vector.h"
 
 namespace track2vec
@@ -21,22 +24,44 @@ class State
 private:
     double lossValue_;
     int64_t nexamples_;
-    
+
 public:
     Vector hidden;
     Vector output;
     Vector grad;
-    std::minstd_rand rng;
+    Random rng;
+    std::vector<double> uniforms;
+    std::vector<int64_t> negatives;
+    size_t negativePos;
+    
+    // pending updates of hot input rows, indexed by hot slot
+    std::vector<Vector> hotDelta;
+    std::vector<bool> hotDirty;
+    std::vector<int64_t> hotPending;
+    int64_t hotUpdates;
+    
+    // mean square of hidden, set for Adagrad before the loss runs
+    double hiddenSquares;
+    
+    // when set, updates are collected here instead of written to the matrices
+    Delta *inputDelta;
+    Delta *outputDelta;
     
     State(int64_t hiddenSize, int64_t outputSize, int64_t seed);
     double getLoss();
     void incrementNExamples(double loss);
+    
+    inline int64_t nexamples() const
+    {
+        return nexamples_;
+    }
 };
 
 } // namespace model
 
 class Matrix;
 class Loss;
+class Adagrad;
 
 class Model
 {
@@ -44,9 +69,44 @@ private:
     std::shared_ptr<Matrix> input_;
     std::shared_ptr<Matrix> output_;
     std::shared_ptr<Loss> loss_;
+    std::shared_ptr<Adagrad> adagrad_;
+    std::shared_ptr<Adagrad> outputAdagrad_;
     
+    std::vector<int64_t> hotSlots_;
+    std::vector<int64_t> hotIndices_;
+    int64_t hotFlush_;
+    
+    void addToInput(const Vector &, int64_t, double, model::State &);
+    void addPending(Vector &, int64_t, const model::State &) const;
+
 public:
     Model(std::shared_ptr<Matrix>, std::shared_ptr<Matrix>, std::shared_ptr<Loss>);
+    void setHotRows(const std::vector<int64_t> &, int64_t);
+    
+    // Adagrad over the input rows and, through the loss, the output rows
+    void setAdagrad(std::shared_ptr<Adagrad>, std::shared_ptr<Adagrad>);
+    
+    // clear optimizer state a diverged model left behind
+    void repair();
+    
+    // new track counts for the loss, e.g. its negative sampling table
+    void updateCounts(std::vector<int64_t> &);
+    
+    // input and output Adagrad, null with -optimizer sgd
+    inline std::shared_ptr<Adagrad> adagrad() const
+    {
+        return adagrad_;
+    }
+    inline std::shared_ptr<Adagrad> outputAdagrad() const
+    {
+        return outputAdagrad_;
+    }
+    
+    void flush(model::State &);
+    void drawNegatives(int64_t, const std::set<int64_t>&, model::State&);
+    void prefetchInput(int64_t,
+                       const std::vector<int64_t>&,
+                       const std::vector<int64_t>&) const;
     void update(int64_t,
                 const std::vector<int64_t> &,
                 const std::vector<int64_t> &,
@@ -55,15 +115,26 @@ public:
                 double,
                 model::State&);
     
+    // CBOW: the mean of the contexts' computeHidden vectors predicts the
+    // center, every input row of every context receives the gradient
+    void updateContexts(const std::vector<const trackEntry *> &,
+                        int64_t,
+                        const std::set<int64_t>&,
+                        double,
+                        model::State&);
+    
     void computeHidden(int64_t,
                        const std::vector<int64_t>&,
                        const std::vector<int64_t>&,
                        model::State&) const;
     
+    // with Adagrad the gradient is the raw one and lr is applied per row
     void backprop(int64_t,
                   const std::vector<int64_t>&,
                   const std::vector<int64_t> &,
-                  const Vector&);
+                  const Vector&,
+                  double,
+                  model::State&);
 };
 
 } // namespace track2vec
@@ -0,0 +1,298 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "pool.h"
+
+#include <algorithm>
+#include <exception>
+#include <time.h>
+
+namespace track2vec
+{
+
+namespace
+{
+
+thread_local int64_t currentWorker = -1;
+thread_local const ThreadPool *currentPool = nullptr;
+
+// cpu time of the calling thread, so busy time is not inflated when the
+// workers outnumber the cores
+int64_t threadCpuNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+std::mutex globalMutex;
+std::unique_ptr<ThreadPool> globalPool;
+
+// Blocks of one parallelFor. Shared with the helper tasks, which may start
+// after the call returned and then only find that no block is left.
+struct Blocks
+{
+    std::function<void(int64_t, int64_t)> fn;
+    int64_t n;
+    int64_t grain;
+    int64_t nblocks;
+    std::atomic<int64_t> next{};
+    std::atomic<int64_t> done{};
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cv;
+    
+    // runs blocks until none is left
+    void drain()
+    {
+        for (int64_t b = next++; b < nblocks; b = next++)
+        {
+            try
+            {
+                fn(b * grain, std::min(n, (b + 1) * grain));
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+            
+            if (++done == nblocks)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                cv.notify_all();
+            }
+        }
+    }
+};
+
+} // namespace
+
+ThreadPool::ThreadPool(int64_t nthreads) : running_(true), stealable_(0), busyNs_(0), next_(0)
+{
+    nthreads = std::max<int64_t>(1, nthreads);
+    for (int64_t w = 0; w < nthreads; w++)
+    {
+        queues_.emplace_back(new Queue());
+    }
+    for (int64_t w = 0; w < nthreads; w++)
+    {
+        workers_.push_back(std::thread([this, w]() { loop(w); }));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    cv_.notify_all();
+    
+    for (auto &worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+ThreadPool &ThreadPool::global()
+{
+    std::lock_guard<std::mutex> lock(globalMutex);
+    if (!globalPool)
+    {
+        globalPool.reset(new ThreadPool(std::max(1u, std::thread::hardware_concurrency())));
+    }
+    return *globalPool;
+}
+
+// Only call while the pool is idle, pending tasks finish on the old workers.
+void ThreadPool::configure(int64_t nthreads)
+{
+    std::lock_guard<std::mutex> lock(globalMutex);
+    if (globalPool && globalPool->size() == std::max<int64_t>(1, nthreads))
+    {
+        return;
+    }
+    globalPool.reset();
+    globalPool.reset(new ThreadPool(nthreads));
+}
+
+std::future<void> ThreadPool::submit(Task task)
+{
+    auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+    std::future<void> future = packaged->get_future();
+    
+    // tasks submitted from a worker stay local until someone steals them
+    int64_t w = currentPool == this ? currentWorker : int64_t(next_++ % size());
+    push(w, [packaged]() { (*packaged)(); }, true);
+    return future;
+}
+
+std::future<void> ThreadPool::runOn(int64_t w, Task task)
+{
+    auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+    std::future<void> future = packaged->get_future();
+    push(w % size(), [packaged]() { (*packaged)(); }, false);
+    return future;
+}
+
+void ThreadPool::parallelFor(int64_t n, const std::function<void(int64_t, int64_t)> &fn, int64_t grain)
+{
+    if (n <= 0)
+        return;
+    
+    // a few blocks per worker keeps them busy when blocks take uneven time
+    grain = std::max(grain, (n + 4 * size() - 1) / (4 * size()));
+    const int64_t nblocks = (n + grain - 1) / grain;
+    if (nblocks == 1)
+    {
+        fn(0, n);
+        return;
+    }
+    
+    auto blocks = std::make_shared<Blocks>();
+    blocks->fn = fn;
+    blocks->n = n;
+    blocks->grain = grain;
+    blocks->nblocks = nblocks;
+    
+    const int64_t helpers = std::min(nblocks - 1, size());
+    for (int64_t h = 0; h < helpers; h++)
+    {
+        push(int64_t(next_++ % size()), [blocks]() { blocks->drain(); }, true);
+    }
+    
+    // the caller's share counts as busy time too
+    run([&blocks]() { blocks->drain(); });
+    
+    std::unique_lock<std::mutex> lock(blocks->mutex);
+    blocks->cv.wait(lock, [&blocks]() { return blocks->done == blocks->nblocks; });
+    
+    if (blocks->error)
+    {
+        std::rethrow_exception(blocks->error);
+    }
+}
+
+void ThreadPool::push(int64_t w, Task task, bool stealable)
+{
+    Queue &queue = *queues_[w];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.entries.push_back(Entry{std::move(task), stealable});
+        queue.size++;
+    }
+    if (stealable)
+        stealable_++;
+    
+    // take the pool mutex so a worker about to sleep sees the new task
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+    }
+    cv_.notify_all();
+}
+
+bool ThreadPool::pop(int64_t w, Task &task)
+{
+    Queue &queue = *queues_[w];
+    if (queue.size == 0)
+        return false;
+    
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.entries.empty())
+        return false;
+    
+    Entry &entry = queue.entries.front();
+    if (entry.stealable)
+        stealable_--;
+    task = std::move(entry.task);
+    queue.entries.pop_front();
+    queue.size--;
+    return true;
+}
+
+bool ThreadPool::steal(int64_t w, Task &task)
+{
+    if (stealable_ == 0)
+        return false;
+    
+    for (int64_t k = 1; k < size(); k++)
+    {
+        if (take(*queues_[(w + k) % size()], task))
+            return true;
+    }
+    return false;
+}
+
+// the last stealable entry of a queue
+bool ThreadPool::take(Queue &queue, Task &task)
+{
+    if (queue.size == 0)
+        return false;
+    
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    for (auto it = queue.entries.rbegin(); it != queue.entries.rend(); ++it)
+    {
+        if (it->stealable)
+        {
+            task = std::move(it->task);
+            queue.entries.erase(std::next(it).base());
+            queue.size--;
+            stealable_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::help()
+{
+    if (stealable_ == 0)
+        return false;
+    
+    // the caller's own queue too, it is not popping it meanwhile
+    Task task;
+    for (auto &queue : queues_)
+    {
+        if (take(*queue, task))
+        {
+            run(task);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(const Task &task)
+{
+    const int64_t start = threadCpuNs();
+    task();
+    busyNs_ += threadCpuNs() - start;
+}
+
+void ThreadPool::loop(int64_t w)
+{
+    currentWorker = w;
+    currentPool = this;
+    Queue &queue = *queues_[w];
+    
+    while (true)
+    {
+        Task task;
+        if (pop(w, task) || steal(w, task))
+        {
+            run(task);
+            continue;
+        }
+        
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]() { return !running_ || queue.size > 0 || stealable_ > 0; });
+        if (!running_ && queue.size == 0)
+            return;
+    }
+}
+
+} // namespace track2vec
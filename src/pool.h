@@ -0,0 +1,96 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace track2vec
+{
+
+// Process-wide pool of worker threads with one task deque per worker. A
+// worker runs its own deque from the front and steals from the back of the
+// others when it runs dry. The pool is sized once at startup by configure()
+// and every phase (loading, initialization, training, export) submits to it.
+// Trainers keep their workers for the whole run, so while they train only
+// the workers past them (-evalThreads) pick up tasks; trainers waiting for
+// the monitor or a barrier call help() to lend theirs.
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+    
+    explicit ThreadPool(int64_t);
+    ~ThreadPool();
+    
+    static ThreadPool &global();
+    static void configure(int64_t);
+    
+    inline int64_t size() const
+    {
+        return workers_.size();
+    }
+    
+    std::future<void> submit(Task);
+    
+    // runs on the given worker and is never stolen
+    std::future<void> runOn(int64_t, Task);
+    
+    // fn(begin, end) over blocks of [0, n) with at least grain elements each.
+    // The calling thread takes blocks too, so this may be called from a task.
+    void parallelFor(int64_t, const std::function<void(int64_t, int64_t)> &, int64_t grain = 1);
+    
+    // runs one queued stealable task on the calling thread, false if there
+    // is none; for threads that wait on something else meanwhile
+    bool help();
+    
+    // cpu seconds spent in tasks and parallelFor blocks since the pool started
+    inline double busy() const
+    {
+        return busyNs_ * 1e-9;
+    }
+    
+private:
+    struct Entry
+    {
+        Task task;
+        bool stealable;
+    };
+    
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Entry> entries;
+        std::atomic<int64_t> size{};
+    };
+    
+    std::vector<std::thread> workers_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+    
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool running_;
+    std::atomic<int64_t> stealable_;
+    std::atomic<int64_t> busyNs_;
+    std::atomic<uint64_t> next_;
+    
+    void push(int64_t, Task, bool);
+    bool pop(int64_t, Task &);
+    bool steal(int64_t, Task &);
+    bool take(Queue &, Task &);
+    void run(const Task &);
+    void loop(int64_t);
+};
+
+} // namespace track2vec
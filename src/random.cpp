@@ -0,0 +1,87 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "random.h"
+
+#include <algorithm>
+
+namespace track2vec
+{
+
+namespace
+{
+
+uint64_t splitmix64(uint64_t &x)
+{
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+} // namespace
+
+Random::Random(uint64_t seed) : pos_(BATCH)
+{
+    uint64_t x = seed;
+    for (int64_t l = 0; l < LANES; l++)
+    {
+        s0_[l] = splitmix64(x);
+        s1_[l] = splitmix64(x);
+        s2_[l] = splitmix64(x);
+        s3_[l] = splitmix64(x);
+    }
+}
+
+void Random::refill()
+{
+    for (int64_t i = 0; i < BATCH; i += LANES)
+    {
+        for (int64_t l = 0; l < LANES; l++)
+        {
+            buffer_[i + l] = s0_[l] + s3_[l];
+            
+            const uint64_t t = s1_[l] << 17;
+            s2_[l] ^= s0_[l];
+            s3_[l] ^= s1_[l];
+            s1_[l] ^= s2_[l];
+            s0_[l] ^= s3_[l];
+            s2_[l] ^= t;
+            s3_[l] = (s3_[l] << 45) | (s3_[l] >> 19);
+        }
+    }
+    pos_ = 0;
+}
+
+uint64_t Random::hash(uint64_t key, uint64_t counter)
+{
+    uint64_t x = key * 0xd1342543de82ef95ULL + counter * 0x9e3779b97f4a7c15ULL;
+    splitmix64(x);
+    return splitmix64(x);
+}
+
+void Random::uniform(std::vector<double> &values, int64_t n)
+{
+    values.resize(n);
+    int64_t i = 0;
+    while (i < n)
+    {
+        if (pos_ == BATCH)
+        {
+            refill();
+        }
+        const int64_t m = std::min(n - i, BATCH - pos_);
+        const uint64_t *src = buffer_ + pos_;
+        double *dst = values.data() + i;
+        for (int64_t k = 0; k < m; k++)
+        {
+            dst[k] = double(src[k] >> 11) * (1.0 / 9007199254740992.0);
+        }
+        pos_ += m;
+        i += m;
+    }
+}
+
+} // namespace track2vec
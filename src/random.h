@@ -0,0 +1,65 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace track2vec
+{
+
+// xoshiro256+ generator running LANES independent streams side by side.
+// The streams are stepped together in a plain loop over structure-of-arrays
+// state so the compiler can vectorize the refill; callers consume the
+// generated words from a small buffer.
+class Random
+{
+public:
+    static const int64_t LANES = 8;
+    static const int64_t BATCH = 512;
+    
+    explicit Random(uint64_t seed);
+    
+    // raw 64-bit word
+    inline uint64_t next()
+    {
+        if (pos_ == BATCH)
+        {
+            refill();
+        }
+        return buffer_[pos_++];
+    }
+    
+    // uniform double in [0, 1)
+    inline double uniform()
+    {
+        return double(next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+    
+    // uniform integer in [0, n) without division (multiply-shift)
+    inline uint64_t uniformInt(uint64_t n)
+    {
+        return uint64_t((unsigned __int128)next() * n >> 64);
+    }
+    
+    void uniform(std::vector<double> &, int64_t);
+    
+    // stateless counter-based draw: the same (key, counter) always gives the
+    // same word, whichever thread asks for it
+    static uint64_t hash(uint64_t, uint64_t);
+    
+private:
+    uint64_t s0_[LANES];
+    uint64_t s1_[LANES];
+    uint64_t s2_[LANES];
+    uint64_t s3_[LANES];
+    uint64_t buffer_[BATCH];
+    int64_t pos_;
+    
+    void refill();
+};
+
+} // namespace track2vec
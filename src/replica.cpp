@@ -0,0 +1,141 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "replica.h"
+
+#include <chrono>
+#include <iostream>
+
+#include "topology.h"
+#include "utils.h"
+
+namespace track2vec
+{
+
+Replicas::Replicas(std::shared_ptr<Args> args,
+                   std::shared_ptr<Matrix> input,
+                   std::shared_ptr<Matrix> output,
+                   const ModelFactory &factory)
+: args_(args), partitions_(topology::partitions(args->numa)), running_(false)
+{
+    const int64_t n = partitions_.size();
+    inputs_.resize(n);
+    outputs_.resize(n);
+    models_.resize(n);
+    
+    // replica 0 keeps the original matrices, the others are copied from a
+    // thread pinned to their partition so first touch places them there
+    inputs_[0] = input;
+    outputs_[0] = output;
+    
+    std::vector<std::thread> threads;
+    for (int64_t r = 0; r < n; r++)
+    {
+        threads.push_back(std::thread([&, r]() {
+            pin(r);
+            if (r > 0)
+            {
+                inputs_[r] = std::make_shared<Matrix>(*input);
+                outputs_[r] = std::make_shared<Matrix>(*output);
+            }
+            models_[r] = factory(inputs_[r], outputs_[r]);
+        }));
+    }
+    
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    
+    if (args_->verbose > 0)
+    {
+        for (int64_t r = 0; r < n; r++)
+        {
+            std::cerr << "Replica [" << r << "] cpus: " << topology::toString(partitions_[r]) << std::endl;
+        }
+    }
+}
+
+Replicas::~Replicas()
+{
+    stop();
+}
+
+void Replicas::pin(int64_t replica) const
+{
+    if (!topology::pinThread(partitions_[replica]) && args_->verbose > 1)
+    {
+        std::cerr << ">> Failed to pin thread to replica [" << replica << "]" << std::endl;
+    }
+}
+
+void Replicas::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_ || size() < 2)
+        return;
+    
+    running_ = true;
+    sync_ = std::thread([this]() { syncLoop(); });
+}
+
+void Replicas::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    cv_.notify_all();
+    
+    if (sync_.joinable())
+    {
+        sync_.join();
+        average();
+    }
+}
+
+void Replicas::average()
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    {
+        std::lock_guard<std::mutex> lock(averageMutex_);
+        Matrix::average(inputs_);
+        Matrix::average(outputs_);
+    }
+    
+    if (args_->verbose > 1)
+    {
+        std::cerr << ">> Averaged " << size() << " replicas in ";
+        std::cerr << utils::getDuration(start, std::chrono::steady_clock::now()) << " sec" << std::endl;
+    }
+}
+
+void Replicas::forEach(const std::function<void(Matrix &, Matrix &)> &fn)
+{
+    std::lock_guard<std::mutex> lock(averageMutex_);
+    for (int64_t r = 0; r < size(); r++)
+    {
+        fn(*inputs_[r], *outputs_[r]);
+    }
+}
+
+void Replicas::syncLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    
+    while (running_)
+    {
+        cv_.wait_for(lock, std::chrono::seconds(args_->numaSync));
+        if (!running_)
+            break;
+        
+        lock.unlock();
+        average();
+        lock.lock();
+    }
+}
+
+} // namespace track2vec
@@ -0,0 +1,86 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "args.h"
+#include "matrix.h"
+#include "model.h"
+
+namespace track2vec
+{
+
+// One copy of the parameter matrices per NUMA node (or simulated partition).
+// Trainers of a partition are pinned to its cpus and only touch the local
+// copy; a background thread averages the copies every -numaSync seconds.
+class Replicas
+{
+public:
+    using ModelFactory = std::function<std::shared_ptr<Model>(std::shared_ptr<Matrix>,
+                                                              std::shared_ptr<Matrix>)>;
+    
+    Replicas(std::shared_ptr<Args>,
+             std::shared_ptr<Matrix>,
+             std::shared_ptr<Matrix>,
+             const ModelFactory &);
+    ~Replicas();
+    
+    inline int64_t size() const
+    {
+        return models_.size();
+    }
+    inline int64_t replicaOf(int64_t threadId) const
+    {
+        return threadId % size();
+    }
+    inline const std::vector<int64_t> &cpus(int64_t replica) const
+    {
+        return partitions_[replica];
+    }
+    inline std::shared_ptr<Model> model(int64_t replica) const
+    {
+        return models_[replica];
+    }
+    inline const std::vector<std::shared_ptr<Matrix>> &inputs() const
+    {
+        return inputs_;
+    }
+    inline const std::vector<std::shared_ptr<Matrix>> &outputs() const
+    {
+        return outputs_;
+    }
+    
+    void pin(int64_t) const;
+    void start();
+    void stop();
+    void average();
+    
+    // fn(input, output) on every copy, never during an average
+    void forEach(const std::function<void(Matrix &, Matrix &)> &);
+
+private:
+    std::shared_ptr<Args> args_;
+    std::vector<std::vector<int64_t>> partitions_;
+    std::vector<std::shared_ptr<Matrix>> inputs_;
+    std::vector<std::shared_ptr<Matrix>> outputs_;
+    std::vector<std::shared_ptr<Model>> models_;
+    
+    std::thread sync_;
+    std::mutex mutex_;
+    std::mutex averageMutex_;
+    std::condition_variable cv_;
+    bool running_;
+    
+    void syncLoop();
+};
+
+} // namespace track2vec
@@ -0,0 +1,74 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "schedule.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace track2vec
+{
+
+LrSchedule::LrSchedule(std::shared_ptr<Args> args)
+: kind_(args->lrSchedule),
+pretrainedKind_(args->pretrainedSchedule.empty() ? args->lrSchedule : args->pretrainedSchedule),
+lr_(args->lr),
+pretrainedLr_(args->lr * args->pretrained_lr),
+warmup_(args->lrWarmup),
+min_(args->lrMin),
+factor_(1.0)
+{
+    update(0.0);
+}
+
+double LrSchedule::decay(const std::string &kind, double lr, double progress) const
+{
+    if (kind == "cosine")
+    {
+        return min_ + 0.5 * (lr - min_) * (1.0 + std::cos(M_PI * progress));
+    }
+    if (kind == "constant")
+    {
+        return lr;
+    }
+    return lr * (1.0 - progress);
+}
+
+double LrSchedule::rate(double progress, bool pretrained) const
+{
+    const double lr = (pretrained ? pretrainedLr_ : lr_) * factor_;
+    progress = std::min(1.0, std::max(0.0, progress));
+    
+    if (progress < warmup_)
+    {
+        return min_ + (lr - min_) * progress / warmup_;
+    }
+    
+    // the decay spans the training left after the warmup
+    const double decayed = decay(pretrained ? pretrainedKind_ : kind_, lr, (progress - warmup_) / (1.0 - warmup_));
+    return std::max(min_, decayed);
+}
+
+void LrSchedule::update(double progress)
+{
+    current_.store(rate(progress), std::memory_order_relaxed);
+    pretrainedCurrent_.store(rate(progress, true), std::memory_order_relaxed);
+}
+
+bool LrSchedule::reduce(double factor)
+{
+    if (lr_ * factor_ * factor < min_)
+        return false;
+    
+    factor_ *= factor;
+    return true;
+}
+
+void LrSchedule::setFactor(double factor)
+{
+    factor_ = factor;
+}
+
+} // namespace track2vec
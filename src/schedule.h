@@ -0,0 +1,67 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "args.h"
+
+namespace track2vec
+{
+
+// Learning rates as a function of the global training progress in [0, 1].
+// -lrSchedule picks the decay of -lr (linear, cosine or constant) down to
+// -lrMin, -lrWarmup ramps it up from -lrMin over the first part of training.
+// Pretrained tracks follow -pretrainedSchedule from -lr * -pretrained_lr.
+// Trainers publish the rates with update() as the processed token count
+// grows and every trainer reads them without locks.
+class LrSchedule
+{
+private:
+    std::string kind_;
+    std::string pretrainedKind_;
+    double lr_;
+    double pretrainedLr_;
+    double warmup_;
+    double min_;
+    double factor_;
+    
+    std::atomic<double> current_;
+    std::atomic<double> pretrainedCurrent_;
+    
+    double decay(const std::string &, double, double) const;
+
+public:
+    explicit LrSchedule(std::shared_ptr<Args>);
+    
+    double rate(double, bool pretrained = false) const;
+    void update(double);
+    
+    // scale both schedules down after a divergence, false once -lr cannot
+    // go lower than -lrMin. Trainers must not be calling rate() meanwhile.
+    bool reduce(double);
+    
+    // product of the reductions so far, restored from a checkpoint
+    inline double factor() const
+    {
+        return factor_;
+    }
+    void setFactor(double);
+    
+    inline double lr() const
+    {
+        return current_.load(std::memory_order_relaxed);
+    }
+    
+    inline double pretrainedLr() const
+    {
+        return pretrainedCurrent_.load(std::memory_order_relaxed);
+    }
+};
+
+} // namespace track2vec
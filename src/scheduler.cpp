@@ -0,0 +1,194 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+#include "pool.h"
+
+namespace track2vec
+{
+
+Scheduler::Scheduler(int64_t nsequences, int64_t chunkSize, int64_t nepochs, int64_t nthreads)
+: nsequences_(nsequences),
+chunkSize_(std::max<int64_t>(1, chunkSize)),
+nchunks_((nsequences + chunkSize_ - 1) / chunkSize_),
+nepochs_(nepochs),
+queues_(nthreads),
+queueMutex_(nthreads),
+epoch_(0),
+issued_(0)
+{
+    if (nepochs_ > 0)
+    {
+        deal(0);
+    }
+}
+
+void Scheduler::deal(int64_t epoch)
+{
+    std::vector<int64_t> ids(nchunks_);
+    for (int64_t id = 0; id < nchunks_; id++)
+    {
+        ids[id] = id;
+    }
+    deal(epoch, ids);
+}
+
+// chunk id goes to the deque of thread id % nthreads
+void Scheduler::deal(int64_t epoch, const std::vector<int64_t> &ids)
+{
+    const int64_t nthreads = queues_.size();
+    
+    for (int64_t id : ids)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_[id % nthreads]);
+        Chunk chunk;
+        chunk.epoch = epoch;
+        chunk.id = id;
+        chunk.begin = id * chunkSize_;
+        chunk.end = std::min(nsequences_, chunk.begin + chunkSize_);
+        queues_[id % nthreads].push_back(chunk);
+    }
+}
+
+std::vector<int64_t> Scheduler::pending()
+{
+    std::vector<int64_t> ids;
+    for (int64_t t = 0; t < int64_t(queues_.size()); t++)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_[t]);
+        for (const Chunk &chunk : queues_[t])
+        {
+            ids.push_back(chunk.id);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+void Scheduler::restore(int64_t epoch, const std::vector<int64_t> &ids)
+{
+    std::lock_guard<std::mutex> lock(epochMutex_);
+    for (int64_t t = 0; t < int64_t(queues_.size()); t++)
+    {
+        std::lock_guard<std::mutex> queueLock(queueMutex_[t]);
+        queues_[t].clear();
+    }
+    
+    epoch_ = epoch;
+    issued_ = nchunks_ - int64_t(ids.size());
+    deal(epoch, ids);
+}
+
+bool Scheduler::pop(int64_t threadId, Chunk &chunk)
+{
+    std::lock_guard<std::mutex> lock(queueMutex_[threadId]);
+    std::deque<Chunk> &queue = queues_[threadId];
+    
+    if (queue.empty())
+        return false;
+    
+    chunk = queue.front();
+    queue.pop_front();
+    issued_++;
+    return true;
+}
+
+bool Scheduler::steal(int64_t threadId, Chunk &chunk)
+{
+    const int64_t nthreads = queues_.size();
+    
+    for (int64_t k = 1; k < nthreads; k++)
+    {
+        const int64_t victim = (threadId + k) % nthreads;
+        std::lock_guard<std::mutex> lock(queueMutex_[victim]);
+        std::deque<Chunk> &queue = queues_[victim];
+        
+        if (queue.empty())
+            continue;
+        
+        chunk = queue.back();
+        queue.pop_back();
+        issued_++;
+        return true;
+    }
+    
+    return false;
+}
+
+bool Scheduler::next(int64_t threadId, Chunk &chunk)
+{
+    while (true)
+    {
+        if (pop(threadId, chunk) || steal(threadId, chunk))
+            return true;
+        
+        std::lock_guard<std::mutex> lock(epochMutex_);
+        
+        // chunks of this epoch are still queued, or another thread just dealt
+        if (issued_ < nchunks_)
+            continue;
+        
+        if (epoch_ + 1 >= nepochs_)
+            return false;
+        
+        issued_ = 0;
+        deal(++epoch_);
+    }
+}
+
+Barrier::Barrier(int64_t nthreads) : nthreads_(nthreads), waiting_(0), generation_(0), aborted_(false) {}
+
+void Barrier::wait(const std::function<void()> &completion)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    const int64_t generation = generation_;
+    if (aborted_)
+    {
+        throw std::runtime_error("Barrier aborted");
+    }
+    
+    if (++waiting_ == nthreads_)
+    {
+        // unlocked, so the others can help with the pool tasks it submits
+        if (completion)
+        {
+            lock.unlock();
+            completion();
+            lock.lock();
+        }
+        waiting_ = 0;
+        generation_++;
+        cv_.notify_all();
+        return;
+    }
+    
+    auto released = [this, generation]() { return generation != generation_ || aborted_; };
+    while (!released())
+    {
+        lock.unlock();
+        const bool helped = ThreadPool::global().help();
+        lock.lock();
+        if (!helped)
+            cv_.wait_for(lock, std::chrono::milliseconds(1), released);
+    }
+    if (generation == generation_)
+    {
+        throw std::runtime_error("Barrier aborted");
+    }
+}
+
+void Barrier::abort()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    aborted_ = true;
+    cv_.notify_all();
+}
+
+} // namespace track2vec
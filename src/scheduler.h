@@ -0,0 +1,91 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace track2vec
+{
+
+struct Chunk
+{
+    int64_t epoch;
+    int64_t id;
+    int64_t begin;
+    int64_t end;
+};
+
+// Hands out fixed-size chunks of the in-memory corpus. Every epoch the chunks
+// are dealt round robin into one deque per thread; a thread pops from the
+// front of its own deque and steals from the back of the others when it runs
+// dry. The next epoch is only dealt once every chunk of the current one has
+// been handed out, so each sequence is visited exactly once per epoch.
+class Scheduler
+{
+public:
+    Scheduler(int64_t, int64_t, int64_t, int64_t);
+    
+    bool next(int64_t, Chunk &);
+    
+    // ids of the chunks of the current epoch nobody took yet, and a restart
+    // from such a list. Only while no thread is in next().
+    std::vector<int64_t> pending();
+    void restore(int64_t, const std::vector<int64_t> &);
+    
+    inline int64_t epoch() const
+    {
+        return epoch_;
+    }
+    inline int64_t nchunks() const
+    {
+        return nchunks_;
+    }
+    
+private:
+    int64_t nsequences_;
+    int64_t chunkSize_;
+    int64_t nchunks_;
+    int64_t nepochs_;
+    
+    std::vector<std::deque<Chunk>> queues_;
+    std::vector<std::mutex> queueMutex_;
+    std::mutex epochMutex_;
+    std::atomic<int64_t> epoch_;
+    std::atomic<int64_t> issued_;
+    
+    void deal(int64_t);
+    void deal(int64_t, const std::vector<int64_t> &);
+    bool pop(int64_t, Chunk &);
+    bool steal(int64_t, Chunk &);
+};
+
+// Reusable thread barrier. The last thread to arrive runs the completion
+// function before anyone is released, the others run pool tasks meanwhile.
+// After abort() every wait() throws, so the others do not wait for a thread
+// that failed.
+class Barrier
+{
+public:
+    explicit Barrier(int64_t);
+    void wait(const std::function<void()> &completion = {});
+    void abort();
+    
+private:
+    int64_t nthreads_;
+    int64_t waiting_;
+    int64_t generation_;
+    bool aborted_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+} // namespace track2vec
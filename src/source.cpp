@@ -0,0 +1,296 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "source.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_set>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace track2vec
+{
+
+namespace
+{
+
+const std::string UNIX_PREFIX = "unix:";
+const std::string DONE_SUFFIX = ".done";
+
+int listenUnix(const std::string &path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        throw std::invalid_argument(path + " is too long for a Unix socket");
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    
+    // a socket file left by a previous run
+    unlink(path.c_str());
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        throw std::invalid_argument("cannot listen on " + path + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+bool endsWith(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+SessionSource::SessionSource(const std::string &path, int64_t capacity)
+: path_(path), fifo_(-1), listen_(-1), capacity_(capacity), closed_(false), received_(0)
+{
+    struct stat st;
+    if (path_.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0)
+    {
+        path_ = path_.substr(UNIX_PREFIX.size());
+        listen_ = listenUnix(path_);
+        reader_ = std::thread(&SessionSource::readStreams, this);
+    }
+    else if (stat(path_.c_str(), &st) == 0 && S_ISFIFO(st.st_mode))
+    {
+        // also open for writing, so reads never see EOF between writers
+        fifo_ = open(path_.c_str(), O_RDWR | O_NONBLOCK);
+        if (fifo_ < 0)
+        {
+            throw std::invalid_argument(path_ + " cannot be opened: " + std::strerror(errno));
+        }
+        reader_ = std::thread(&SessionSource::readStreams, this);
+    }
+    else if (stat(path_.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        reader_ = std::thread(&SessionSource::readDirectory, this);
+    }
+    else
+    {
+        throw std::invalid_argument(path_ + " is not a FIFO, a directory or unix:<socket path>");
+    }
+}
+
+SessionSource::~SessionSource()
+{
+    close();
+}
+
+void SessionSource::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    readable_.notify_all();
+    writable_.notify_all();
+    
+    if (reader_.joinable())
+    {
+        reader_.join();
+    }
+    if (fifo_ >= 0)
+    {
+        ::close(fifo_);
+        fifo_ = -1;
+    }
+    if (listen_ >= 0)
+    {
+        ::close(listen_);
+        listen_ = -1;
+        unlink(path_.c_str());
+    }
+}
+
+bool SessionSource::closing()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_;
+}
+
+bool SessionSource::done()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ && lines_.empty();
+}
+
+bool SessionSource::next(std::string &line, std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!readable_.wait_for(lock, timeout, [this]() { return closed_ || !lines_.empty(); }) || lines_.empty())
+        return false;
+    
+    line.swap(lines_.front());
+    lines_.pop_front();
+    writable_.notify_one();
+    return true;
+}
+
+// blocks while the queue is full, false once closed
+bool SessionSource::push(std::string &&line)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    writable_.wait(lock, [this]() { return closed_ || lines_.size() < capacity_; });
+    if (closed_)
+        return false;
+    
+    lines_.push_back(std::move(line));
+    received_++;
+    readable_.notify_one();
+    return true;
+}
+
+// The FIFO, or the listening socket and its clients. Every stream keeps the
+// part of a line that has not ended yet.
+void SessionSource::readStreams()
+{
+    struct Stream
+    {
+        int fd;
+        std::string partial;
+    };
+    std::vector<Stream> streams;
+    if (fifo_ >= 0)
+    {
+        streams.push_back(Stream{fifo_, ""});
+    }
+    
+    std::vector<pollfd> fds;
+    char buffer[65536];
+    
+    while (!closing())
+    {
+        fds.clear();
+        if (listen_ >= 0)
+        {
+            fds.push_back(pollfd{listen_, POLLIN, 0});
+        }
+        for (const Stream &stream : streams)
+        {
+            fds.push_back(pollfd{stream.fd, POLLIN, 0});
+        }
+        
+        if (poll(fds.data(), fds.size(), POLL_MS) <= 0)
+            continue;
+        
+        const size_t first = listen_ >= 0 ? 1 : 0;
+        if (listen_ >= 0 && (fds[0].revents & POLLIN))
+        {
+            int fd = accept(listen_, nullptr, nullptr);
+            if (fd >= 0)
+                streams.push_back(Stream{fd, ""});
+        }
+        
+        for (size_t k = first; k < fds.size(); k++)
+        {
+            if (fds[k].revents == 0)
+                continue;
+            
+            Stream &stream = streams[k - first];
+            ssize_t n = read(stream.fd, buffer, sizeof(buffer));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            
+            // a client hung up, the FIFO never does
+            if (n <= 0)
+            {
+                if (stream.fd != fifo_)
+                    ::close(stream.fd);
+                stream.fd = -1;
+                continue;
+            }
+            
+            stream.partial.append(buffer, n);
+            size_t begin = 0;
+            for (size_t end = stream.partial.find('\n'); end != std::string::npos;
+                 end = stream.partial.find('\n', begin))
+            {
+                if (end > begin && !push(stream.partial.substr(begin, end - begin)))
+                    break;
+                begin = end + 1;
+            }
+            stream.partial.erase(0, begin);
+        }
+        
+        streams.erase(std::remove_if(streams.begin(), streams.end(), [](const Stream &s) { return s.fd < 0; }),
+                      streams.end());
+    }
+    
+    for (const Stream &stream : streams)
+    {
+        if (stream.fd != fifo_)
+            ::close(stream.fd);
+    }
+}
+
+// Files that are new since the last scan, in name order. A file is renamed
+// once read, so a restart does not train on it again.
+void SessionSource::readDirectory()
+{
+    std::unordered_set<std::string> seen;
+    
+    while (!closing())
+    {
+        std::vector<std::string> names;
+        if (DIR *dir = opendir(path_.c_str()))
+        {
+            while (dirent *entry = readdir(dir))
+            {
+                const std::string name = entry->d_name;
+                if (name.empty() || name[0] == '.' || endsWith(name, DONE_SUFFIX) || seen.count(name) > 0)
+                    continue;
+                names.push_back(name);
+            }
+            closedir(dir);
+        }
+        std::sort(names.begin(), names.end());
+        
+        for (const std::string &name : names)
+        {
+            const std::string filename = path_ + "/" + name;
+            struct stat st;
+            if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+            
+            std::ifstream ifs(filename);
+            for (std::string line; std::getline(ifs, line);)
+            {
+                if (!line.empty() && !push(std::move(line)))
+                    return;
+            }
+            seen.insert(name);
+            
+            if (std::rename(filename.c_str(), (filename + DONE_SUFFIX).c_str()) != 0)
+            {
+                std::cerr << ">> " << filename << " cannot be marked as read: " << std::strerror(errno) << std::endl;
+            }
+        }
+        
+        std::unique_lock<std::mutex> lock(mutex_);
+        writable_.wait_for(lock, std::chrono::seconds(1), [this]() { return closed_; });
+    }
+}
+
+} // namespace track2vec
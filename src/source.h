@@ -0,0 +1,69 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace track2vec
+{
+
+// Session records for serve-train, one json line each as in the training
+// data. The path names where they come from:
+//  - a FIFO, read for as long as the process runs while writers come and go
+//  - unix:<path>, a Unix socket this process listens on, any number of
+//    clients may connect and send lines
+//  - a directory, every file is read once in name order as it appears and
+//    renamed to <name>.done. Writers create files under a name starting with
+//    '.' and rename them once complete.
+// A reader thread fills a bounded queue, so writers are held back when the
+// trainers fall behind.
+class SessionSource
+{
+public:
+    SessionSource(const std::string &, int64_t);
+    ~SessionSource();
+    
+    // false when nothing arrived in time or the source is closed and drained
+    bool next(std::string &, std::chrono::milliseconds);
+    
+    // stops reading, next() still returns the lines already queued
+    void close();
+    bool done();
+    
+    inline int64_t received() const
+    {
+        return received_;
+    }
+
+private:
+    static const int POLL_MS = 200;
+    
+    std::string path_;
+    int fifo_;
+    int listen_;
+    size_t capacity_;
+    std::deque<std::string> lines_;
+    std::mutex mutex_;
+    std::condition_variable readable_;
+    std::condition_variable writable_;
+    bool closed_;
+    std::atomic<int64_t> received_;
+    std::thread reader_;
+    
+    bool push(std::string &&);
+    bool closing();
+    void readStreams();
+    void readDirectory();
+};
+
+} // namespace track2vec
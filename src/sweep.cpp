@@ -0,0 +1,284 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "sweep.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <nlohmann/json.hpp>
+
+#include "logs.h"
+#include "pool.h"
+#include "track2vec.h"
+#include "utils.h"
+
+namespace track2vec
+{
+
+using json = nlohmann::json;
+
+namespace
+{
+
+const std::string sweep_summary = "sweep.json";
+
+// the parameters a sweep can vary, none of them changes the dictionary
+void setParam(Args &args, const std::string &key, const std::string &value)
+{
+    if (key == "ws")
+    {
+        args.ws = std::stoi(value);
+    }
+    else if (key == "neg")
+    {
+        args.neg = std::stoi(value);
+    }
+    else if (key == "dim")
+    {
+        args.dim = std::stoi(value);
+    }
+    else if (key == "discard_t")
+    {
+        args.discard_t = std::stof(value);
+    }
+    else if (key == "loss")
+    {
+        args.loss = value;
+    }
+    else if (key == "model")
+    {
+        if (value != "skipgram" && value != "cbow")
+        {
+            throw std::invalid_argument("-sweep model must be skipgram or cbow, got " + value);
+        }
+        args.model = value;
+    }
+    else if (key == "optimizer")
+    {
+        if (value != "sgd" && value != "adagrad")
+        {
+            throw std::invalid_argument("-sweep optimizer must be sgd or adagrad, got " + value);
+        }
+        args.optimizer = value;
+    }
+    else
+    {
+        throw std::invalid_argument("-sweep cannot vary " + key + " (ws, neg, dim, discard_t, loss, model or optimizer)");
+    }
+}
+
+// configurations whose training losses measure the same thing
+std::string lossGroup(const Args &args)
+{
+    std::string group = "loss=" + args.loss + " model=" + args.model;
+    if (args.loss == "ns")
+        group += " neg=" + std::to_string(args.neg);
+    return group;
+}
+
+double mrr(const Evaluator::Metrics &metrics)
+{
+    auto it = metrics.find("mrr");
+    return it == metrics.end() ? -1 : it->second;
+}
+
+} // namespace
+
+Sweep::Sweep(std::shared_ptr<Args> args) : args_(args)
+{
+    configs_.push_back(Config{"", std::make_shared<Args>(*args_), -1, 0, "", {}});
+    
+    std::istringstream grid(args_->sweep);
+    for (std::string axis; grid >> axis;)
+    {
+        const size_t eq = axis.find('=');
+        if (eq == std::string::npos || eq == 0 || eq + 1 == axis.size())
+        {
+            throw std::invalid_argument("-sweep expects key=value[,value...], got " + axis);
+        }
+        
+        const std::string key = axis.substr(0, eq);
+        std::istringstream values(axis.substr(eq + 1));
+        
+        std::vector<Config> expanded;
+        for (std::string value; std::getline(values, value, ',');)
+        {
+            for (const Config &config : configs_)
+            {
+                Config next{config.name + (config.name.empty() ? "" : "_") + key + value,
+                            std::make_shared<Args>(*config.args), -1, 0, "", {}};
+                setParam(*next.args, key, value);
+                expanded.push_back(next);
+            }
+        }
+        configs_.swap(expanded);
+    }
+}
+
+void Sweep::run()
+{
+    const int64_t nconfigs = configs_.size();
+    const int64_t parallel = std::min(nconfigs, args_->sweepParallel > 0 ? args_->sweepParallel : nconfigs);
+    const int64_t threads = std::max<int64_t>(1, args_->thread / parallel);
+    
+    // every configuration trains on its own range of workers, evaluations
+    // and the other work done while training share the workers past them
+    ThreadPool::configure(std::max(args_->thread, parallel * threads) + args_->evalThreads);
+    
+    std::cerr << ">> Sweep " << nconfigs << " configurations, " << parallel << " at a time on ";
+    std::cerr << threads << " threads each" << std::endl;
+    
+    Track2Vec loader(args_);
+    loader.load();
+    
+    // installed once for all configurations, each one checkpoints on SIGTERM
+    const bool checkpointing = args_->checkpointInterval > 0 || args_->checkpointTokens > 0;
+    if (checkpointing)
+    {
+        Track2Vec::handleTerminate(true);
+    }
+    
+    std::atomic<int64_t> next(0);
+    std::vector<std::thread> slots;
+    
+    for (int64_t slot = 0; slot < parallel; slot++)
+    {
+        slots.push_back(std::thread([&, slot]() {
+            for (int64_t c = next++; c < nconfigs; c = next++)
+            {
+                Config &config = configs_[c];
+                Args &args = *config.args;
+                args.thread = threads;
+                args.outputDir = args_->outputDir + "/" + config.name;
+                
+                // pretrained vectors would update the shared dictionary
+                args.loadPretrained = 0;
+                
+                auto start = std::chrono::steady_clock::now();
+                try
+                {
+                    if (mkdir(args.outputDir.c_str(), 0755) != 0 && errno != EEXIST)
+                    {
+                        throw std::invalid_argument(args.outputDir + " cannot be created for saving vectors!");
+                    }
+                    
+                    auto logs = std::make_shared<Logs>(args.localLog, args.s3Log, args.logBufferSize, config.name);
+                    Track2Vec track2vec(config.args, slot * threads);
+                    track2vec.train(loader.dictionary(), loader.corpus(), logs->getCallback(args.yyyymmddhh));
+                    if (track2vec.interrupted())
+                    {
+                        throw std::runtime_error("interrupted, continue with -resume 1");
+                    }
+                    track2vec.saveVectors(args.outputDir);
+                    track2vec.saveModel(args.outputDir);
+                    config.loss = track2vec.loss();
+                    config.metrics = track2vec.metrics();
+                }
+                catch (const std::exception &e)
+                {
+                    config.error = e.what();
+                }
+                config.seconds = utils::getDuration(start, std::chrono::steady_clock::now());
+                
+                std::cerr << ">> Sweep " << config.name << ": ";
+                std::cerr << (config.error.empty() ? "done" : "failed, " + config.error) << std::endl;
+            }
+        }));
+    }
+    
+    for (std::thread &slot : slots)
+    {
+        slot.join();
+    }
+    
+    if (checkpointing)
+    {
+        Track2Vec::handleTerminate(false);
+    }
+    
+    report();
+}
+
+// One json line per configuration in -output/sweep.json, best first. With
+// -evalInput every configuration is ranked by MRR on the held-out sessions.
+// Training losses only compare under the same loss, model and -neg, so
+// otherwise configurations are ranked by loss within those groups.
+void Sweep::report() const
+{
+    const bool evaluated = !args_->evalInput.empty();
+    std::vector<const Config *> order;
+    for (const Config &config : configs_)
+    {
+        order.push_back(&config);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](const Config *a, const Config *b) {
+        if (a->error.empty() != b->error.empty())
+            return a->error.empty();
+        if (evaluated)
+            return mrr(a->metrics) > mrr(b->metrics);
+        
+        const std::string groupA = lossGroup(*a->args);
+        const std::string groupB = lossGroup(*b->args);
+        if (groupA != groupB)
+            return groupA < groupB;
+        return a->loss < b->loss;
+    });
+    
+    const std::string filename = args_->outputDir + "/" + sweep_summary;
+    std::ofstream ofs(filename);
+    if (!ofs.is_open())
+    {
+        throw std::invalid_argument(filename + " cannot be opened for saving.");
+    }
+    
+    std::string group;
+    int64_t rank = 0;
+    for (const Config *config : order)
+    {
+        const std::string configGroup = evaluated ? "" : lossGroup(*config->args);
+        rank = configGroup == group ? rank + 1 : 1;
+        group = configGroup;
+        
+        json j;
+        j["config"] = config->name;
+        j["ws"] = config->args->ws;
+        j["model"] = config->args->model;
+        j["optimizer"] = config->args->optimizer;
+        j["neg"] = config->args->neg;
+        j["dim"] = config->args->dim;
+        j["discard_t"] = config->args->discard_t;
+        j["loss"] = config->loss;
+        j["seconds"] = config->seconds;
+        for (const auto &metric : config->metrics)
+        {
+            j[metric.first] = metric.second;
+        }
+        if (!evaluated)
+            j["group"] = group;
+        if (config->error.empty())
+            j["rank"] = rank;
+        else
+            j["error"] = config->error;
+        ofs << j.dump() << std::endl;
+        
+        std::cerr << ">> " << (config->error.empty() ? "#" + std::to_string(rank) + " " : "");
+        std::cerr << (evaluated ? "" : "[" + group + "] ") << config->name;
+        std::cerr << " loss: " << config->loss << " time: " << config->seconds << " sec";
+        std::cerr << (config->error.empty() ? "" : " (" + config->error + ")") << std::endl;
+    }
+    
+    ofs.close();
+}
+
+} // namespace track2vec
@@ -0,0 +1,46 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "args.h"
+#include "evaluator.h"
+
+namespace track2vec
+{
+
+// Trains a grid of configurations on one dictionary and in-memory corpus.
+// -sweep lists the values of every varied parameter, e.g. "ws=3,5 neg=5,20",
+// and every combination is trained with its own matrices and loss. Up to
+// -sweepParallel configurations train at once on an equal share of the
+// threads, each writes to its own directory under -output and tags its logs.
+class Sweep
+{
+private:
+    struct Config
+    {
+        std::string name;
+        std::shared_ptr<Args> args;
+        double loss;
+        double seconds;
+        std::string error;
+        Evaluator::Metrics metrics;
+    };
+    
+    std::shared_ptr<Args> args_;
+    std::vector<Config> configs_;
+    
+    void report() const;
+    
+public:
+    explicit Sweep(std::shared_ptr<Args>);
+    void run();
+};
+
+} // namespace track2vec
@@ -0,0 +1,250 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#include "topology.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace track2vec
+{
+namespace topology
+{
+
+namespace
+{
+
+const std::string SYSFS_NODE = "/sys/devices/system/node/node";
+const std::string SYSFS_CPU_ONLINE = "/sys/devices/system/cpu/online";
+const std::string SYSFS_CPU = "/sys/devices/system/cpu/cpu";
+
+bool readLine(const std::string &filename, std::string &line)
+{
+    std::ifstream ifs(filename);
+    if (!ifs.is_open())
+    {
+        return false;
+    }
+    return bool(std::getline(ifs, line));
+}
+
+} // namespace
+
+std::vector<int64_t> parseCpuList(const std::string &list)
+{
+    std::vector<int64_t> cpus;
+    std::stringstream ss(list);
+    
+    for (std::string range; std::getline(ss, range, ',');)
+    {
+        if (range.empty() || range == "\n")
+            continue;
+        
+        size_t dash = range.find('-');
+        int64_t first = std::stoll(range.substr(0, dash));
+        int64_t last = dash == std::string::npos ? first : std::stoll(range.substr(dash + 1));
+        
+        for (int64_t cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    
+    return cpus;
+}
+
+std::vector<int64_t> onlineCpus()
+{
+    std::string line;
+    if (readLine(SYSFS_CPU_ONLINE, line))
+    {
+        return parseCpuList(line);
+    }
+    
+    std::vector<int64_t> cpus;
+    for (int64_t cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++)
+    {
+        cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+std::vector<std::vector<int64_t>> numaNodes()
+{
+    std::vector<std::vector<int64_t>> nodes;
+    std::string line;
+    
+    for (int64_t node = 0; readLine(SYSFS_NODE + std::to_string(node) + "/cpulist", line); node++)
+    {
+        std::vector<int64_t> cpus = parseCpuList(line);
+        if (!cpus.empty())
+        {
+            nodes.push_back(cpus);
+        }
+    }
+    
+    if (nodes.empty())
+    {
+        nodes.push_back(onlineCpus());
+    }
+    
+    return nodes;
+}
+
+std::vector<std::vector<int64_t>> partitions(int64_t n)
+{
+    std::vector<std::vector<int64_t>> nodes = numaNodes();
+    std::vector<std::vector<int64_t>> parts(n);
+    
+    if (int64_t(nodes.size()) >= n)
+    {
+        for (size_t node = 0; node < nodes.size(); node++)
+        {
+            std::vector<int64_t> &part = parts[node % n];
+            part.insert(part.end(), nodes[node].begin(), nodes[node].end());
+        }
+        return parts;
+    }
+    
+    std::vector<int64_t> cpus;
+    for (const auto &node : nodes)
+    {
+        cpus.insert(cpus.end(), node.begin(), node.end());
+    }
+    
+    // fewer cpus than partitions: partitions share cpus round robin
+    int64_t per_part = std::max<int64_t>(1, cpus.size() / n);
+    for (int64_t p = 0; p < n; p++)
+    {
+        for (int64_t k = 0; k < per_part; k++)
+        {
+            parts[p].push_back(cpus[(p * per_part + k) % cpus.size()]);
+        }
+    }
+    
+    return parts;
+}
+
+Cpu describe(int64_t id)
+{
+    Cpu cpu;
+    cpu.id = id;
+    cpu.core = id;
+    cpu.package = 0;
+    
+    std::string line;
+    const std::string dir = SYSFS_CPU + std::to_string(id) + "/topology/";
+    if (readLine(dir + "core_id", line))
+    {
+        cpu.core = std::stoll(line);
+    }
+    if (readLine(dir + "physical_package_id", line))
+    {
+        cpu.package = std::stoll(line);
+    }
+    
+    return cpu;
+}
+
+std::vector<int64_t> physicalFirst(const std::vector<int64_t> &ids, bool smt)
+{
+    std::vector<Cpu> cpus;
+    for (int64_t id : ids)
+    {
+        cpus.push_back(describe(id));
+    }
+    
+    std::sort(cpus.begin(), cpus.end(), [](const Cpu &a, const Cpu &b) {
+        if (a.package != b.package)
+            return a.package < b.package;
+        if (a.core != b.core)
+            return a.core < b.core;
+        return a.id < b.id;
+    });
+    
+    // rank of every cpu among the hardware threads of its core
+    std::vector<std::pair<int64_t, int64_t>> ranked;
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        int64_t sibling = 0;
+        for (size_t k = i; k > 0 && cpus[k - 1].package == cpus[i].package && cpus[k - 1].core == cpus[i].core; k--)
+        {
+            sibling++;
+        }
+        if (smt || sibling == 0)
+        {
+            ranked.push_back(std::make_pair(sibling, int64_t(i)));
+        }
+    }
+    
+    std::stable_sort(ranked.begin(), ranked.end(), [](const std::pair<int64_t, int64_t> &a,
+                                                      const std::pair<int64_t, int64_t> &b) {
+        return a.first < b.first;
+    });
+    
+    std::vector<int64_t> order;
+    for (const auto &rank : ranked)
+    {
+        order.push_back(cpus[rank.second].id);
+    }
+    return order;
+}
+
+std::vector<int64_t> firstCores(const std::vector<int64_t> &ids, int64_t n)
+{
+    std::vector<int64_t> cores = physicalFirst(ids, false);
+    cores.resize(std::min<int64_t>(n, cores.size()));
+    
+    std::vector<int64_t> cpus;
+    for (int64_t id : ids)
+    {
+        const Cpu cpu = describe(id);
+        for (int64_t core : cores)
+        {
+            const Cpu first = describe(core);
+            if (cpu.package == first.package && cpu.core == first.core)
+            {
+                cpus.push_back(id);
+                break;
+            }
+        }
+    }
+    return cpus;
+}
+
+bool pinThread(const std::vector<int64_t> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int64_t cpu : cpus)
+    {
+        CPU_SET(cpu, &set);
+    }
+    return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    return false;
+#endif
+}
+
+std::string toString(const std::vector<int64_t> &cpus)
+{
+    std::ostringstream ss;
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        ss << (i ? "," : "") << cpus[i];
+    }
+    return ss.str();
+}
+
+} // namespace topology
+} // namespace track2vec
@@ -0,0 +1,53 @@
+/**
+ # Copyright (c) 2020-present, Dreamus, Inc.
+ # All rights reserved.
+ **/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace track2vec
+{
+namespace topology
+{
+
+struct Cpu
+{
+    int64_t id;
+    int64_t core;
+    int64_t package;
+};
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+std::vector<int64_t> parseCpuList(const std::string &);
+
+std::vector<int64_t> onlineCpus();
+
+// cpus of every NUMA node, one node with all online cpus when sysfs has none
+std::vector<std::vector<int64_t>> numaNodes();
+
+// n groups of cpus: whole NUMA nodes when the machine has at least n of them,
+// otherwise the online cpus split evenly into n simulated partitions
+std::vector<std::vector<int64_t>> partitions(int64_t);
+
+// core and package of a cpu, the cpu id itself when sysfs has no topology
+Cpu describe(int64_t);
+
+// The cpus reordered so that one hardware thread of every physical core comes
+// first, then the second SMT siblings, and so on. With smt = false only the
+// first hardware thread of each core is kept.
+std::vector<int64_t> physicalFirst(const std::vector<int64_t> &, bool smt = true);
+
+// all hardware threads of the first n physical cores among the cpus
+std::vector<int64_t> firstCores(const std::vector<int64_t> &, int64_t);
+
+// restrict the calling thread to the given cpus
+bool pinThread(const std::vector<int64_t> &);
+
+std::string toString(const std::vector<int64_t> &);
+
+} // namespace topology
+} // namespace track2vec
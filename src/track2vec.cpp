@@ -5,6 +5,13 @@
 
 #include "track2vec.h"
 
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
 #include <iomanip>
 #include <fstream>
 #include <thread>
@@ -13,15 +20,115 @@
 #include <nlohmann/json.hpp>
 
 #include "model.h"
+#include "pool.h"
 #include "utils.h"
 #include "loss.h"
+#include "distributed.h"
+#include "replica.h"
+#include "source.h"
+#include "topology.h"
 
 namespace track2vec
 {
 
 using json = nlohmann::json;
 
+namespace
+{
+
+const size_t LINE_BLOCK = 65536;
+
+// sessions serve-train queues ahead of the trainers
+const int64_t SOURCE_CAPACITY = 65536;
+
+// set by SIGTERM, the monitor checkpoints and stops training, serve-train
+// also stops on SIGINT
+std::atomic<bool> terminateRequested(false);
+
+// runs of this process that want SIGTERM, see Track2Vec::handleTerminate
+std::mutex terminateMutex;
+int64_t terminateUsers = 0;
+
+void onTerminate(int)
+{
+    terminateRequested = true;
+}
+
+// Formats n json lines on the thread pool a block at a time and writes them
+// in index order. vec is zeroed for every line since the get*Vector helpers
+// add to it.
+void writeJsonLines(std::ofstream &ofs, int64_t n, int64_t dim,
+                    const std::function<void(int64_t, json &, Vector &)> &fill)
+{
+    std::vector<std::string> lines;
+    for (int64_t begin = 0; begin < n; begin += LINE_BLOCK)
+    {
+        const int64_t end = std::min<int64_t>(n, begin + LINE_BLOCK);
+        lines.resize(end - begin);
+        
+        ThreadPool::global().parallelFor(end - begin, [&](int64_t b, int64_t e) {
+            json j;
+            Vector vec(dim);
+            for (int64_t i = b; i < e; i++)
+            {
+                j.clear();
+                vec.zero();
+                fill(begin + i, j, vec);
+                lines[i] = j.dump();
+            }
+        }, 256);
+        
+        for (const std::string &line : lines)
+        {
+            ofs << line << '\n';
+        }
+    }
+}
+
+// Parses json lines on the thread pool and hands every one to fn from the
+// pool, fn must be safe to run concurrently
+void forEachJsonLine(std::istream &ifs, const std::function<void(const json &)> &fn)
+{
+    std::vector<std::string> lines;
+    while (utils::readLines(ifs, lines, LINE_BLOCK))
+    {
+        ThreadPool::global().parallelFor(lines.size(), [&](int64_t begin, int64_t end) {
+            for (int64_t i = begin; i < end; i++)
+            {
+                fn(json::parse(lines[i]));
+            }
+        }, 256);
+    }
+}
+
+// the entries of a dictionary map, for indexed access from the pool
+template <typename Entry>
+std::vector<const Entry *> entriesOf(const std::unordered_map<std::string, Entry> &entries)
+{
+    std::vector<const Entry *> result;
+    result.reserve(entries.size());
+    for (const auto &pair : entries)
+    {
+        result.push_back(&pair.second);
+    }
+    return result;
+}
+
+// track_id of every track index
+std::vector<std::string> trackIds(const Dictionary &dict)
+{
+    std::vector<std::string> ids(dict.ntracks());
+    for (const auto &pair : dict.getTrackEntries())
+    {
+        ids[pair.second.idx] = pair.second.track_id;
+    }
+    return ids;
+}
+
+} // namespace
+
 const std::string Track2Vec::model_output_track = "model_output_track.json";
+const std::string Track2Vec::model_output_node = "model_output_node.json";
 const std::string Track2Vec::model_input_track = "model_input_track.json";
 const std::string Track2Vec::model_input_artist = "model_input_artist.json";
 const std::string Track2Vec::model_input_genre = "model_input_genre.json";
@@ -30,36 +137,282 @@ const std::string Track2Vec::track_vec = "track_vec.json";
 const std::string Track2Vec::artist_vec = "artist_vec.json";
 const std::string Track2Vec::genre_vec = "genre_vec.json";
 
-Track2Vec::Track2Vec(std::shared_ptr<Args> args) :
+Track2Vec::Track2Vec(std::shared_ptr<Args> args, int64_t firstWorker) :
 args_(args),
+roundStop_(false),
+firstWorker_(firstWorker),
+idle_(0),
+lastCheckpointTokens_(0),
+interrupted_(false),
+lastExportEpoch_(0),
 processedTotalTokenCount_(0),
 log_loss_(-1),
+lossSum_(0),
+lossCount_(0),
+bestLoss_(-1),
+staleReports_(0),
+evalRunning_(false),
 trainException_(nullptr) {}
 
 void Track2Vec::train(const LogCallback &callback)
+{
+    load();
+    initModel();
+    
+    if (args_->resume > 0)
+    {
+        phase("Resume", [&]() { resume(); });
+    }
+    phase("Train", [&]() { startThreads(callback); });
+}
+
+void Track2Vec::train(std::shared_ptr<Dictionary> dict, std::shared_ptr<Corpus> data, const LogCallback &callback)
+{
+    dict_ = dict;
+    data_ = data;
+    allocator_ = Allocator::create(args_->alloc, args_->pad > 0, args_->mmapDir);
+    
+    initModel();
+    
+    if (args_->resume > 0)
+    {
+        phase("Resume", [&]() { resume(); });
+    }
+    phase("Train", [&]() { startThreads(callback); });
+}
+
+// Keeps the model resident and trains on the sessions -input delivers until
+// SIGTERM or SIGINT, at the fixed -serveLr. Counts of the streamed tracks are
+// folded into the dictionary and the negative sampler every -refreshInterval
+// seconds and the vectors exported every -exportInterval seconds.
+void Track2Vec::serve(const LogCallback &callback)
+{
+    load();
+    initModel();
+    
+    phase("Serve", [&]() {
+        start_ = std::chrono::steady_clock::now();
+        std::vector<std::future<void>> threads;
+        
+        if (ThreadPool::global().size() < firstWorker_ + args_->thread)
+        {
+            ThreadPool::configure(firstWorker_ + args_->thread);
+        }
+        
+        planAffinity();
+        
+        if (!reservedCpus_.empty())
+        {
+            topology::pinThread(reservedCpus_);
+        }
+        
+        streamCounts_.reset(new std::atomic<int64_t>[dict_->ntracks()]());
+        source_ = std::make_shared<SessionSource>(args_->input, SOURCE_CAPACITY);
+        
+        activeThreads_ = args_->thread;
+        idle_ = 0;
+        lastRefresh_ = std::chrono::steady_clock::now();
+        lastExport_ = std::chrono::steady_clock::now();
+        
+        handleTerminate(true);
+        std::signal(SIGINT, onTerminate);
+        
+        for (int64_t i = 0; i < args_->thread; i++)
+        {
+            threads.push_back(ThreadPool::global().runOn(firstWorker_ + i, [=]() {
+                runTrainer(i, &Track2Vec::trainThreadServe);
+            }));
+        }
+        
+        if (args_->verbose > 0)
+        {
+            std::cerr << ">> Serving " << args_->input << " on " << args_->thread << " threads" << std::endl;
+        }
+        
+        while (!terminateRequested && !failed_)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(args_->printInterval));
+            
+            const auto now = std::chrono::steady_clock::now();
+            if (updateLoss() && callback)
+            {
+                const double t = utils::getDuration(start_, now);
+                Metrics metrics = this->metrics();
+                metrics["tokens"] = processedTotalTokenCount_;
+                callback(0, log_loss_, processedTotalTokenCount_ / t / args_->thread, args_->serveLr, 0, metrics);
+            }
+            
+            if (args_->refreshInterval > 0 && utils::getDuration(lastRefresh_, now) >= args_->refreshInterval)
+            {
+                lastRefresh_ = now;
+                hold([&]() { refreshCounts(); });
+            }
+            
+            if (!exporting_ && processedTotalTokenCount_ > 0 &&
+                utils::getDuration(lastExport_, now) >= args_->exportInterval)
+            {
+                startExport();
+            }
+        }
+        
+        // the trainers drain what was already queued
+        stop_ = true;
+        source_->close();
+        
+        for (int64_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].wait();
+        }
+        
+        if (exportThread_.joinable())
+        {
+            exportThread_.join();
+        }
+        
+        handleTerminate(false);
+        std::signal(SIGINT, SIG_DFL);
+        
+        if (!reservedCpus_.empty())
+        {
+            topology::pinThread(topology::onlineCpus());
+        }
+        
+        if (args_->verbose > 0)
+        {
+            double t = utils::getDuration(start_, std::chrono::steady_clock::now());
+            std::cerr << ">> Served " << source_->received() << " sessions, trained " << processedTotalTokenCount_;
+            std::cerr << " tokens in " << t << " sec" << std::endl;
+        }
+        
+        if (failed_)
+        {
+            std::exception_ptr exception = trainException_;
+            trainException_ = nullptr;
+            failed_ = false;
+            std::rethrow_exception(exception);
+        }
+    });
+}
+
+// The SIGTERM handler stays installed while any run of the process asks for
+// it, so one sweep configuration finishing does not remove it for the others.
+void Track2Vec::handleTerminate(bool install)
+{
+    std::lock_guard<std::mutex> lock(terminateMutex);
+    if (install && terminateUsers++ == 0)
+    {
+        std::signal(SIGTERM, onTerminate);
+    }
+    else if (!install && --terminateUsers == 0)
+    {
+        std::signal(SIGTERM, SIG_DFL);
+    }
+}
+
+// reads the meta file and, with -memory, the training data
+void Track2Vec::load()
 {
     dict_ = std::make_shared<Dictionary>(args_);
-    dict_->loadMeta(args_->metaFileName, args_->input);
+    phase("Read meta", [&]() { dict_->loadMeta(args_->metaFileName, args_->input); });
+    
+    allocator_ = Allocator::create(args_->alloc, args_->pad > 0, args_->mmapDir);
+    
+    if (args_->memory > 0)
+    {
+        phase("Load data", [&]() { loadData(); });
+    }
+}
+
+void Track2Vec::initModel()
+{
+    pdiscard_ = dict_->discardTable(args_->discard_t);
+    schedule_ = std::make_shared<LrSchedule>(args_);
+    
+    if (!args_->evalInput.empty())
+    {
+        evaluator_ = std::make_shared<Evaluator>(args_, dict_);
+    }
+    
+    // the output matrix and the pretrained output rows follow the tree
+    if (args_->loss == "hs")
+    {
+        tree_ = HierarchicalSoftmaxLoss::buildTree(dict_->getTrackCount());
+    }
     
-    input_ = createRandomMatrix();
-    output_ = createTrainOutputMatrix();
+    phase("Init matrices", [&]() {
+        input_ = createRandomMatrix();
+        output_ = createTrainOutputMatrix();
+    });
     
     if (args_->loadPretrained > 0) {
-        setInputMatrixFromFile(args_->outputDir);
-        setOutputMatrixFromFile(args_->outputDir);
+        phase("Load pretrained", [&]() {
+            setInputMatrixFromFile(args_->outputDir);
+            setOutputMatrixFromFile(args_->outputDir);
+        });
     }
     
-    auto loss = std::make_shared<Loss>(output_, args_->neg);
-    auto track_cnt = dict_->getTrackCount();
-    loss->initNegative(track_cnt);
-    model_ = std::make_shared<Model>(input_, output_, loss);
+    if (allocator_->name() == "mmap")
+    {
+        lockHotRows();
+    }
     
-    if (args_->memory > 0)
+    phase("Create model", [&]() {
+        if (tree_ && evaluator_)
+        {
+            evaluator_->setTree(tree_);
+        }
+        
+        if (args_->numa > 0 && args_->deterministic == 0)
+        {
+            replicas_ = std::make_shared<Replicas>(args_, input_, output_,
+                                                   std::bind(&Track2Vec::createModel, this,
+                                                             std::placeholders::_1,
+                                                             std::placeholders::_2));
+            model_ = replicas_->model(0);
+        }
+        else
+        {
+            model_ = createModel(input_, output_);
+        }
+    });
+    
+    if (args_->world > 1)
+    {
+        peer_ = std::make_shared<Peer>(args_, input_, output_);
+    }
+    
+    if (args_->checkInterval > 0)
+    {
+        guard_ = std::make_shared<Guard>(args_, input_, output_);
+    }
+    
+    if (args_->hotCount > 0 && args_->verbose > 0)
     {
-        loadData();
+        std::cerr << "Number of thread-local hot rows: " << dict_->getHotIndices(args_->hotCount).size() << std::endl;
     }
+}
+
+// Runs one stage and logs its wall time next to the cpu time the thread pool
+// spent on it, their ratio is the speedup over running it on one thread.
+void Track2Vec::phase(const std::string &name, const std::function<void()> &fn) const
+{
+    const double busy = ThreadPool::global().busy();
+    auto start = std::chrono::steady_clock::now();
+    
+    fn();
     
-    startThreads(callback);
+    if (args_->verbose > 0)
+    {
+        const double t = utils::getDuration(start, std::chrono::steady_clock::now());
+        const double work = ThreadPool::global().busy() - busy;
+        std::cerr << ">> " << name << ": " << t << " sec";
+        if (work > 0 && t > 0)
+        {
+            std::cerr << " (" << work << " sec on " << ThreadPool::global().size() << " threads, ";
+            std::cerr << std::setprecision(3) << work / t << std::setprecision(6) << "x)";
+        }
+        std::cerr << std::endl;
+    }
 }
 
 void Track2Vec::saveModel(const std::string &outputDir)
@@ -69,17 +422,31 @@ void Track2Vec::saveModel(const std::string &outputDir)
         throw std::runtime_error("Model never trained");
     }
     
-    std::string output_filename = outputDir + "/" + model_output_track;
-    saveOutputMatrix(output_filename);
-    
-    std::string track_filename = outputDir + "/" + model_input_track;
-    saveTrackInputVectors(track_filename);
-    
-    std::string artist_filename = outputDir + "/" + model_input_artist;
-    saveArtistInputVectors(artist_filename);
-    
-    std::string genre_filename = outputDir + "/" + model_input_genre;
-    saveGenreInputVectors(genre_filename);
+    phase("Save model", [&]() {
+        // one output file per loss, a stale one of the other would be
+        // loaded into rows that mean something else
+        std::string output_filename = outputDir + "/" + model_output_track;
+        std::string node_filename = outputDir + "/" + model_output_node;
+        if (tree_)
+        {
+            saveOutputNodes(node_filename);
+            std::remove(output_filename.c_str());
+        }
+        else
+        {
+            saveOutputMatrix(output_filename);
+            std::remove(node_filename.c_str());
+        }
+        
+        std::string track_filename = outputDir + "/" + model_input_track;
+        saveTrackInputVectors(track_filename);
+        
+        std::string artist_filename = outputDir + "/" + model_input_artist;
+        saveArtistInputVectors(artist_filename, {input_});
+        
+        std::string genre_filename = outputDir + "/" + model_input_genre;
+        saveGenreInputVectors(genre_filename, {input_});
+    });
 }
 
 void Track2Vec::saveOutputMatrix(const std::string &filename)
@@ -95,21 +462,42 @@ void Track2Vec::saveOutputMatrix(const std::string &filename)
         throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
     }
     
-    const std::unordered_map<std::string, trackEntry> &tracks = dict_->getTrackEntries();
+    const std::vector<const trackEntry *> tracks = entriesOf(dict_->getTrackEntries());
     
-    json j;
-    Vector vec(args_->dim);
-    for (const auto &pair : tracks)
-    {
-        const trackEntry &entry = pair.second;
+    writeJsonLines(ofs, tracks.size(), args_->dim, [&](int64_t i, json &j, Vector &vec) {
+        const trackEntry &entry = *tracks[i];
         getOutputVector(vec, entry.idx);
         
-        j.clear();
         j["track_id"] = entry.track_id;
         j["vector"] = vec.data();
-        ofs << j << std::endl;
+    });
+    
+    ofs.close();
+}
+
+// -loss hs: a line per inner node of the tree, naming its children by node
+// number or, for a leaf, by track_id. That tells a later run whether its tree
+// is the same one, see loadOutputNodes.
+void Track2Vec::saveOutputNodes(const std::string &filename)
+{
+    std::ofstream ofs(filename, std::ofstream::binary);
+    if (!ofs.is_open())
+    {
+        throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
     }
     
+    const std::vector<std::string> ids = trackIds(*dict_);
+    auto child = [&](int64_t c) { return c < 0 ? json(ids[-1 - c]) : json(c); };
+    
+    writeJsonLines(ofs, tree_->left.size(), args_->dim, [&](int64_t i, json &j, Vector &vec) {
+        getOutputVector(vec, i);
+        
+        j["node"] = i;
+        j["left"] = child(tree_->left[i]);
+        j["right"] = child(tree_->right[i]);
+        j["vector"] = vec.data();
+    });
+    
     ofs.close();
 }
 
@@ -126,397 +514,1659 @@ void Track2Vec::saveTrackInputVectors(const std::string &filename)
         throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
     }
     
-    const std::unordered_map<std::string, trackEntry> &tracks = dict_->getTrackEntries();
+    const std::vector<const trackEntry *> tracks = entriesOf(dict_->getTrackEntries());
     
-    json j;
-    Vector vec(args_->dim);
-    for (const auto &pair : tracks)
-    {
-        const trackEntry &entry = pair.second;
+    writeJsonLines(ofs, tracks.size(), args_->dim, [&](int64_t i, json &j, Vector &vec) {
+        const trackEntry &entry = *tracks[i];
         getInputVector(vec, entry.idx);
         
-        j.clear();
         j["track_id"] = entry.track_id;
         j["vector"] = vec.data();
-        ofs << j << std::endl;
-    }
+    });
     
     ofs.close();
 }
 
 void Track2Vec::saveVectors(const std::string &outputDir)
 {
-    saveTrackEmbeddingVectors(outputDir + "/" + track_vec);
-    saveArtistInputVectors(outputDir + "/" + artist_vec);
-    saveGenreInputVectors(outputDir + "/" + genre_vec);
+    if (!input_ || !output_)
+    {
+        throw std::runtime_error("Model never trained");
+    }
+    
+    phase("Save vectors", [&]() { writeVectors(outputDir, {input_}, {output_}); });
 }
 
-void Track2Vec::saveTrackEmbeddingVectors(const std::string &filename)
+// the vector files of a pair of matrices, the model's or a snapshot of it
+void Track2Vec::writeVectors(const std::string &outputDir, const Matrices &input, const Matrices &output)
 {
-    if (!input_ || !output_)
+    saveTrackEmbeddingVectors(outputDir + "/" + track_vec, input, output);
+    saveArtistInputVectors(outputDir + "/" + artist_vec, input);
+    saveGenreInputVectors(outputDir + "/" + genre_vec, input);
+}
+
+void Track2Vec::saveTrackEmbeddingVectors(const std::string &filename, const Matrices &input, const Matrices &output)
+{
+    std::ofstream ofs(filename, std::ofstream::binary);
+    if (!ofs.is_open())
     {
-        throw std::runtime_error("Model never trained");
+        throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
+    }
+    
+    const std::vector<const trackEntry *> tracks = entriesOf(dict_->getTrackEntries());
+    
+    writeJsonLines(ofs, tracks.size(), args_->dim, [&](int64_t i, json &j, Vector &vec) {
+        const trackEntry &entry = *tracks[i];
+        getTrackEmbeddingVector(vec, input, output, entry.idx, entry.artist_matrix_indices, entry.genre_matrix_indices);
+        
+        j["track_id"] = entry.track_id;
+        j["vector"] = vec.data();
+    });
+    
+    ofs.close();
+}
+void Track2Vec::getTrackEmbeddingVector(Vector &vec,
+                                        const Matrices &input,
+                                        const Matrices &output,
+                                        int64_t trackIdx,
+                                        const std::vector<int64_t> &artistInices,
+                                        const std::vector<int64_t> &genreInices) const
+{
+    Vector in(args_->dim);
+    addRow(in, input, trackIdx);
+    
+    for (int64_t artistIdx : artistInices)
+    {
+        addRow(in, input, artistIdx);
+    }
+    
+    for (int64_t genreIdx : genreInices)
+    {
+        addRow(in, input, genreIdx);
+    }
+    
+    size_t z = 1 + artistInices.size() + genreInices.size();
+    in.mul(1.0 / z);
+    
+    // output rows are tree nodes with -loss hs, not tracks
+    if (tree_)
+    {
+        vec = in;
+        return;
+    }
+    
+    Vector out(args_->dim);
+    addRow(out, output, trackIdx);
+    
+    vec = in.avg(out);
+}
+
+// adds row i of the average of the copies
+void Track2Vec::addRow(Vector &vec, const Matrices &copies, int64_t i)
+{
+    if (copies.size() == 1)
+    {
+        vec.addRow(*copies[0], i);
+        return;
+    }
+    
+    for (const std::shared_ptr<Matrix> &matrix : copies)
+    {
+        vec.addRow(*matrix, i, 1.0 / copies.size());
+    }
+}
+
+void Track2Vec::saveArtistInputVectors(const std::string &filename, const Matrices &input)
+{
+    std::ofstream ofs(filename, std::ofstream::binary);
+    if (!ofs.is_open())
+    {
+        throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
     }
     
+    const std::vector<const artistEntry *> artists = entriesOf(dict_->getArtistEntries());
+    
+    writeJsonLines(ofs, artists.size(), args_->dim, [&](int64_t i, json &j, Vector &vec) {
+        const artistEntry &entry = *artists[i];
+        addRow(vec, input, entry.idx);
+        
+        j["artist_id"] = entry.artist_id;
+        j["vector"] = vec.data();
+    });
+    
+    ofs.close();
+}
+
+void Track2Vec::saveGenreInputVectors(const std::string &filename, const Matrices &input)
+{
     std::ofstream ofs(filename, std::ofstream::binary);
     if (!ofs.is_open())
     {
         throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
     }
     
-    Vector vec(args_->dim);
+    const std::vector<const genreEntry *> genres = entriesOf(dict_->getGenreEntries());
+    
+    writeJsonLines(ofs, genres.size(), args_->dim, [&](int64_t i, json &j, Vector &vec) {
+        const genreEntry &entry = *genres[i];
+        addRow(vec, input, entry.idx);
+        
+        j["genre_id"] = entry.genre_id;
+        j["vector"] = vec.data();
+    });
     
-    const std::unordered_map<std::string, trackEntry> &tracks = dict_->getTrackEntries();
+    ofs.close();
+}
+
+void Track2Vec::startThreads(const LogCallback &callback)
+{
+    start_ = std::chrono::steady_clock::now();
+    std::vector<std::future<void>> threads;
+    const int64_t ntokens = trainTokens();
+    int64_t epoch = 0;
+    
+    // trainer i runs on worker firstWorker_ + i for the whole run, the
+    // deterministic barrier needs every trainer running at once
+    if (ThreadPool::global().size() < firstWorker_ + args_->thread)
+    {
+        ThreadPool::configure(firstWorker_ + args_->thread);
+    }
+    
+    planAffinity();
+    
+    // the replica sync thread inherits the reserved cpus from this thread
+    if (!reservedCpus_.empty())
+    {
+        topology::pinThread(reservedCpus_);
+    }
+    
+    if (replicas_)
+    {
+        replicas_->start();
+    }
+    
+    if (peer_)
+    {
+        peer_->start();
+    }
+    
+    if (args_->deterministic > 0)
+    {
+        barrier_ = std::make_shared<Barrier>(args_->thread);
+        inputDeltas_.assign(args_->detRound, Delta(args_->dim));
+        outputDeltas_.assign(args_->detRound, Delta(args_->dim));
+        roundNext_ = 0;
+    }
+    else if (args_->memory > 0)
+    {
+        scheduler_ = std::make_shared<Scheduler>(data_->size(), args_->chunkSize, args_->epoch, args_->thread);
+        if (resume_)
+        {
+            scheduler_->restore(resume_->epoch, resume_->chunks);
+        }
+        
+        if (args_->verbose > 0)
+            std::cerr << "Number of chunks per epoch: " << scheduler_->nchunks() << std::endl;
+    }
+    
+    // -thread auto starts with a step of trainers, the rest wait in park()
+    activeThreads_ = args_->threadAuto > 0 ? std::max<int64_t>(1, args_->thread / 8) : args_->thread;
+    idle_ = 0;
+    
+    // the first rollback point is the initial model
+    if (guard_ && args_->snapshotInterval > 0)
+    {
+        guard_->save();
+    }
+    lastCheck_ = std::chrono::steady_clock::now();
+    
+    trainerStates_.assign(args_->thread, Checkpoint::Trainer{Random(args_->seed), -1});
+    lastCheckpoint_ = std::chrono::steady_clock::now();
+    lastCheckpointTokens_ = processedTotalTokenCount_;
+    interrupted_ = false;
+    checkpointDue_ = false;
+    
+    lastExportEpoch_ = processedTotalTokenCount_ / ntokens;
+    lastExport_ = std::chrono::steady_clock::now();
+    
+    const bool checkpointing = args_->checkpointInterval > 0 || args_->checkpointTokens > 0;
+    if (checkpointing)
+    {
+        handleTerminate(true);
+    }
+    
+    void (Track2Vec::*trainer)(int64_t) = &Track2Vec::trainThread;
+    if (args_->deterministic > 0)
+    {
+        trainer = &Track2Vec::trainThreadDeterministic;
+    }
+    else if (args_->memory > 0)
+    {
+        trainer = &Track2Vec::trainThreadInMemory;
+    }
+    
+    for (int64_t i = 0; i < args_->thread; i++)
+    {
+        threads.push_back(ThreadPool::global().runOn(firstWorker_ + i, [=]() { runTrainer(i, trainer); }));
+    }
+    
+    if (args_->verbose > 0) {
+        std::cerr << "Number of thread: " << args_->thread << std::endl;
+    }
+    
+    if (evaluator_)
+    {
+        evalRunning_ = true;
+        evalThread_ = std::thread(&Track2Vec::evalLoop, this);
+    }
+    
+    if (args_->threadAuto > 0)
+    {
+        tuneThreads(ntokens, callback);
+    }
+    
+    while (keepTraining(ntokens))
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(args_->printInterval));
+        
+        if (scheduler_ && scheduler_->epoch() != epoch && args_->verbose > 0)
+        {
+            epoch = scheduler_->epoch();
+            std::cerr << ">> Epoch " << epoch + 1 << "/" << args_->epoch << " started" << std::endl;
+        }
+        
+        // patience only counts reports with new losses
+        const bool reported = updateLoss();
+        printProgress(ntokens, callback);
+        watch(ntokens);
+        checkpoint();
+        exportSnapshot(ntokens);
+        
+        // which round a report falls in depends on timing, deterministic
+        // runs always train every epoch
+        if (reported && args_->deterministic == 0 && converged())
+        {
+            stop_ = true;
+        }
+    }
+    
+    // parked trainers see that training is over and return
+    {
+        std::lock_guard<std::mutex> lock(parkMutex_);
+        parkCv_.notify_all();
+    }
+    
+    for (int64_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].wait();
+    }
+    
+    if (checkpointThread_.joinable())
+    {
+        checkpointThread_.join();
+    }
+    
+    if (exportThread_.joinable())
+    {
+        exportThread_.join();
+    }
+    
+    if (checkpointing)
+    {
+        handleTerminate(false);
+    }
+    
+    // SIGTERM after the last token, or before a deterministic run reached
+    // the round boundary that would checkpoint it
+    if (processedTotalTokenCount_ >= args_->epoch * ntokens)
+    {
+        interrupted_ = false;
+    }
+    
+    if (evaluator_)
+    {
+        {
+            std::lock_guard<std::mutex> lock(evalMutex_);
+            evalRunning_ = false;
+        }
+        evalCv_.notify_all();
+        evalThread_.join();
+    }
+    
+    if (replicas_)
+    {
+        replicas_->stop();
+    }
+    
+    if (peer_)
+    {
+        peer_->stop();
+    }
+    
+    if (!reservedCpus_.empty())
+    {
+        topology::pinThread(topology::onlineCpus());
+    }
+    
+    if (args_->verbose > 0)
+    {
+        double t = utils::getDuration(start_, std::chrono::steady_clock::now());
+        std::cerr << ">> Trained " << processedTotalTokenCount_ << " tokens in " << t << " sec (";
+        std::cerr << int64_t(processedTotalTokenCount_ / t / activeThreads_) << " tokens/sec/thread)" << std::endl;
+    }
+    if (failed_)
+    {
+        std::exception_ptr exception = trainException_;
+        trainException_ = nullptr;
+        failed_ = false;
+        std::rethrow_exception(exception);
+    }
+    
+    // the final model, so the last log line carries its quality
+    if (evaluator_)
+    {
+        evaluate();
+    }
+    
+    updateLoss();
+    double progress = 1.0;
+    
+    if (interrupted_)
+    {
+        progress = double(processedTotalTokenCount_) / (args_->epoch * ntokens);
+        std::cerr << ">> Interrupted at " << 100 * progress << " %, continue with -resume 1" << std::endl;
+    }
+    else if (stop_ && processedTotalTokenCount_ < args_->epoch * ntokens)
+    {
+        // the rest of the run at the throughput reached so far
+        const double t = utils::getDuration(start_, std::chrono::steady_clock::now());
+        const int64_t saved = std::max<int64_t>(0, args_->epoch * ntokens - processedTotalTokenCount_);
+        progress = double(processedTotalTokenCount_) / (args_->epoch * ntokens);
+        
+        if (args_->verbose > 0)
+        {
+            std::cerr << ">> Early stopped at " << 100 * progress << " %, saved " << saved << " tokens (about ";
+            std::cerr << int64_t(saved * t / std::max<int64_t>(1, processedTotalTokenCount_)) << " sec)" << std::endl;
+        }
+    }
+    
+    printInfo(progress, log_loss_, callback);
+}
+
+// pretrained tracks are updated at their own rate, see LrSchedule
+void Track2Vec::learn(Model &model, model::State &state, double lr, double pretrainedLr,
+                      const std::vector<int64_t> &sequence)
+{
+    if (args_->model == "cbow")
+        cbow(model, state, lr, pretrainedLr, sequence);
+    else
+        skipgram(model, state, lr, pretrainedLr, sequence);
+}
+
+void Track2Vec::skipgram(Model &model, model::State &state, double lr, double pretrainedLr,
+                         const std::vector<int64_t> &sequence)
+{
+    for (int64_t idx = 0; idx < sequence.size(); idx++)
+    {
+        const int64_t input_idx = sequence[idx];
+        
+        if (args_->prefetch > 0 && idx + 1 < sequence.size())
+        {
+            const trackEntry &next = dict_->getTrackEntry(sequence[idx + 1]);
+            model.prefetchInput(next.idx, next.artist_matrix_indices, next.genre_matrix_indices);
+        }
+        
+        const trackEntry &entry = dict_->getTrackEntry(input_idx);
+        double lr_alpha = entry.pretrained ? pretrainedLr : lr;
+        
+        const std::vector<int64_t> &artist_indices = entry.artist_matrix_indices;
+        const std::vector<int64_t> &genre_indices = entry.genre_matrix_indices;
+        
+        int64_t boundary = 1 + state.rng.uniformInt(args_->ws);
+        std::set<int64_t> output_set;
+        
+        for (int64_t c = -boundary; c <= boundary; c++)
+        {
+            if (c != 0 && idx + c >= 0 && idx + c < sequence.size())
+            {
+                output_set.insert(sequence[idx + c]);
+            }
+        }
+        
+        if (args_->prefetch > 0 && !output_set.empty())
+        {
+            model.drawNegatives(output_set.size(), output_set, state);
+        }
+        
+        for (int64_t output_idx: output_set) {
+            model.update(input_idx, artist_indices, genre_indices, output_idx, output_set, lr_alpha, state);
+        }
+        
+    }
+}
+
+// one update per position: the window around it predicts the center track
+void Track2Vec::cbow(Model &model, model::State &state, double lr, double pretrainedLr,
+                     const std::vector<int64_t> &sequence)
+{
+    std::vector<const trackEntry *> contexts;
+    std::set<int64_t> output_set;
+    
+    for (int64_t idx = 0; idx < sequence.size(); idx++)
+    {
+        const int64_t output_idx = sequence[idx];
+        int64_t boundary = 1 + state.rng.uniformInt(args_->ws);
+        
+        contexts.clear();
+        for (int64_t c = -boundary; c <= boundary; c++)
+        {
+            if (c != 0 && idx + c >= 0 && idx + c < sequence.size())
+            {
+                contexts.push_back(&dict_->getTrackEntry(sequence[idx + c]));
+            }
+        }
+        
+        if (contexts.empty())
+            continue;
+        
+        output_set.clear();
+        output_set.insert(output_idx);
+        
+        if (args_->prefetch > 0)
+        {
+            model.drawNegatives(1, output_set, state);
+        }
+        
+        double lr_alpha = dict_->getTrackEntry(output_idx).pretrained ? pretrainedLr : lr;
+        model.updateContexts(contexts, output_idx, output_set, lr_alpha, state);
+    }
+}
+
+void Track2Vec::trainThread(int64_t threadId) 
+{
+    std::ifstream ifs(args_->input);
+    if (!ifs.is_open())
+    {
+        throw std::invalid_argument(args_->input + " cannot be opened for loading data!");
+    }
+    
+    model::State state(args_->dim, output_->size(0), threadId + args_->seed);
+    Model &model = *threadModel(threadId);
+    
+    // a checkpoint without the position of this trainer starts it afresh
+    if (resume_ && resume_->trainers[threadId].position >= 0)
+    {
+        ifs.seekg(resume_->trainers[threadId].position);
+        state.rng = resume_->trainers[threadId].rng;
+    }
+    else
+    {
+        utils::gotoLine(ifs, threadId * args_->threadInterval);
+    }
+    
+    // checkpoints taken before this trainer first pauses start it here
+    trainerStates_[threadId] = Checkpoint::Trainer{state.rng, int64_t(ifs.tellg())};
+    
+    if (args_->verbose > 2)
+    {
+        std::cerr << ">> trainThread [" << threadId << "] started from poistion [";
+        std::cerr << ifs.tellg() << "]" << std::endl;
+    }
+    
+    const int64_t ntokens = dict_->ntokens();
+    
+    int64_t localTokenCount = 0;
+    std::vector<int64_t> sequence;
+    
+    while (keepTraining(ntokens))
+    {
+        if (threadId >= activeThreads_ || pauseRequested_)
+        {
+            processedTotalTokenCount_ += localTokenCount;
+            localTokenCount = 0;
+            model.flush(state);
+            reportLoss(state);
+            trainerStates_[threadId] = Checkpoint::Trainer{state.rng, int64_t(ifs.tellg())};
+            if (threadId >= activeThreads_)
+                park(threadId, ntokens);
+            else
+                pausePoint(1);
+            continue;
+        }
+        
+        localTokenCount += dict_->getSequence(ifs, sequence, state.rng, state.uniforms);
+        learn(model, state, schedule_->lr(), schedule_->pretrainedLr(), sequence);
+        
+        if (localTokenCount > args_->lrUpdateRate)
+        {
+            processedTotalTokenCount_ += localTokenCount;
+            localTokenCount = 0;
+            reportLoss(state);
+            schedule_->update(double(processedTotalTokenCount_) / (args_->epoch * ntokens));
+        }
+    }
+    
+    model.flush(state);
+    reportLoss(state);
+    trainerStates_[threadId] = Checkpoint::Trainer{state.rng, int64_t(ifs.tellg())};
+    retire();
+    
+    ifs.close();
+}
+
+void Track2Vec::trainThreadInMemory(int64_t threadId)
+{
+    if (args_->verbose > 1)
+    {
+        std::cerr << ">> trainThreadInMemory [" << threadId << "] started" << std::endl;
+    }
+    
+    model::State state(args_->dim, output_->size(0), threadId + args_->seed);
+    Model &model = *threadModel(threadId);
+    const int64_t ntokens = trainTokens();
+    
+    if (resume_)
+    {
+        state.rng = resume_->trainers[threadId].rng;
+    }
+    int64_t localTokenCount = 0;
+    std::vector<int64_t> sequence;
+    Chunk chunk;
+    
+    while (!failed_ && !stop_)
+    {
+        // parked or paused before taking a chunk, the active trainers steal its queue
+        if (threadId >= activeThreads_ || pauseRequested_)
+        {
+            processedTotalTokenCount_ += localTokenCount;
+            localTokenCount = 0;
+            model.flush(state);
+            reportLoss(state);
+            trainerStates_[threadId] = Checkpoint::Trainer{state.rng, -1};
+            if (threadId >= activeThreads_)
+                park(threadId, ntokens);
+            else
+                pausePoint(1);
+            continue;
+        }
+        
+        if (!scheduler_->next(threadId, chunk))
+            break;
+        
+        for (int64_t idx = chunk.begin; idx < chunk.end; idx++)
+        {
+            const int32_t *tracks = data_->sequence(idx);
+            const int64_t length = data_->length(idx);
+            localTokenCount += length;
+            
+            sequence.clear();
+            state.rng.uniform(state.uniforms, length);
+            for (int64_t i = 0; i < length; i++)
+            {
+                if (false == discard(tracks[i], state.uniforms[i]))
+                    sequence.push_back(tracks[i]);
+            }
+            
+            learn(model, state, schedule_->lr(), schedule_->pretrainedLr(), sequence);
+            
+            if (localTokenCount > args_->lrUpdateRate)
+            {
+                processedTotalTokenCount_ += localTokenCount;
+                localTokenCount = 0;
+                reportLoss(state);
+                schedule_->update(double(processedTotalTokenCount_) / (args_->epoch * ntokens));
+            }
+        }
+    }
+    
+    processedTotalTokenCount_ += localTokenCount;
+    model.flush(state);
+    reportLoss(state);
+    retire();
+}
+
+// Reproducible training: chunks are processed in rounds of -detRound. Within
+// a round every chunk reads the model as it was at the start of the round,
+// draws from an RNG seeded by (seed, epoch, chunk) and collects its updates in
+// its own Delta. After a barrier each thread applies the deltas of the rows it
+// owns (row % thread) in chunk order, so every row receives the same sums in
+// the same order whatever the number of threads.
+void Track2Vec::trainThreadDeterministic(int64_t threadId)
+{
+    if (args_->verbose > 1)
+    {
+        std::cerr << ">> trainThreadDeterministic [" << threadId << "] started" << std::endl;
+    }
+    
+    model::State state(args_->dim, output_->size(0), args_->seed);
+    Model &model = *threadModel(threadId);
+    
+    const int64_t nthreads = args_->thread;
+    const int64_t nsequences = data_->size();
+    const int64_t chunkSize = std::max<int64_t>(1, args_->chunkSize);
+    const int64_t nchunks = (nsequences + chunkSize - 1) / chunkSize;
+    const int64_t ntokens = trainTokens();
+    int64_t processed = processedTotalTokenCount_;
+    std::vector<int64_t> sequence;
+    
+    // a resumed run starts at the round its checkpoint was taken before
+    const int64_t firstEpoch = resume_ ? resume_->epoch : 0;
+    
+    for (int64_t epoch = firstEpoch; epoch < args_->epoch; epoch++)
+    {
+        const int64_t firstChunk = resume_ && epoch == firstEpoch ? resume_->next : 0;
+        
+        for (int64_t first = firstChunk; first < nchunks; first += args_->detRound)
+        {
+            const int64_t last = std::min(nchunks, first + args_->detRound);
+            const int64_t roundTokens = data_->ntokens(first * chunkSize, std::min(nsequences, last * chunkSize));
+            
+            // the rates of a round depend on its position only, not on timing
+            const double progress = double(processed) / (args_->epoch * ntokens);
+            const double lr = schedule_->rate(progress);
+            const double pretrainedLr = schedule_->rate(progress, true);
+            
+            for (int64_t c = first + roundNext_++; c < last; c = first + roundNext_++)
+            {
+                state.inputDelta = &inputDeltas_[c - first];
+                state.outputDelta = &outputDeltas_[c - first];
+                state.inputDelta->clear();
+                state.outputDelta->clear();
+                state.rng = Random(Random::hash(args_->seed, epoch * nchunks + c));
+                state.negatives.clear();
+                state.negativePos = 0;
+                
+                for (int64_t idx = c * chunkSize; idx < std::min(nsequences, (c + 1) * chunkSize); idx++)
+                {
+                    const int32_t *tracks = data_->sequence(idx);
+                    const int64_t length = data_->length(idx);
+                    
+                    sequence.clear();
+                    state.rng.uniform(state.uniforms, length);
+                    for (int64_t i = 0; i < length; i++)
+                    {
+                        if (false == discard(tracks[i], state.uniforms[i]))
+                            sequence.push_back(tracks[i]);
+                    }
+                    
+                    learn(model, state, lr, pretrainedLr, sequence);
+                }
+                
+                reportLoss(state);
+            }
+            
+            barrier_->wait();
+            
+            for (int64_t k = 0; k < last - first; k++)
+            {
+                inputDeltas_[k].apply(*input_, threadId, nthreads);
+                outputDeltas_[k].apply(*output_, threadId, nthreads);
+            }
+            
+            barrier_->wait([&]() {
+                roundNext_ = 0;
+                processedTotalTokenCount_ += roundTokens;
+                const double done = double(processedTotalTokenCount_) / (args_->epoch * ntokens);
+                
+                // checked every round and saved at every epoch end, so a
+                // rollback happens at the same round whatever the timing
+                if (guard_)
+                {
+                    if (!guard_->check())
+                        rollback(done, true);
+                    else if (last == nchunks && args_->snapshotInterval > 0)
+                        guard_->save();
+                }
+                
+                roundStop_ = stop_ || failed_;
+                
+                // read after stop_, a SIGTERM sets the request before it
+                if (checkpointDue_ && !failed_)
+                {
+                    checkpointDue_ = false;
+                    std::shared_ptr<Checkpoint> checkpoint = capture();
+                    checkpoint->epoch = last == nchunks ? epoch + 1 : epoch;
+                    checkpoint->next = last == nchunks ? 0 : last;
+                    writeCheckpoint(checkpoint);
+                }
+                
+                schedule_->update(done);
+                
+                // every trainer waits in the barrier, the monitor may hold them here
+                pausePoint(nthreads);
+            });
+            processed += roundTokens;
+            
+            // set before the barrier, so every thread leaves at the same round
+            if (roundStop_)
+                break;
+        }
+        
+        if (roundStop_)
+            break;
+    }
+    
+    retire();
+}
+
+// Trains on one session at a time as the source delivers them. The counts
+// include discarded tracks, as a retrain would count them.
+void Track2Vec::trainThreadServe(int64_t threadId)
+{
+    model::State state(args_->dim, output_->size(0), threadId + args_->seed);
+    Model &model = *threadModel(threadId);
+    
+    int64_t localTokenCount = 0;
+    std::string line;
+    std::vector<int64_t> tracks;
+    std::vector<int64_t> sequence;
+    
+    while (!failed_)
+    {
+        if (pauseRequested_)
+        {
+            processedTotalTokenCount_ += localTokenCount;
+            localTokenCount = 0;
+            model.flush(state);
+            reportLoss(state);
+            pausePoint(1);
+            continue;
+        }
+        
+        if (!source_->next(line, std::chrono::milliseconds(100)))
+        {
+            processedTotalTokenCount_ += localTokenCount;
+            localTokenCount = 0;
+            if (source_->done())
+                break;
+            continue;
+        }
+        
+        tracks.clear();
+        dict_->parseRecord(line, tracks);
+        state.rng.uniform(state.uniforms, tracks.size());
+        
+        sequence.clear();
+        for (size_t i = 0; i < tracks.size(); i++)
+        {
+            streamCounts_[tracks[i]].fetch_add(1, std::memory_order_relaxed);
+            if (!discard(tracks[i], state.uniforms[i]))
+                sequence.push_back(tracks[i]);
+        }
+        
+        localTokenCount += tracks.size();
+        learn(model, state, args_->serveLr, args_->serveLr, sequence);
+        
+        if (localTokenCount > args_->lrUpdateRate)
+        {
+            processedTotalTokenCount_ += localTokenCount;
+            localTokenCount = 0;
+            reportLoss(state);
+        }
+    }
+    
+    processedTotalTokenCount_ += localTokenCount;
+    model.flush(state);
+    reportLoss(state);
+    retire();
+}
+
+void Track2Vec::evaluate()
+{
+    Metrics metrics = evaluator_->evaluate(*input_, *output_);
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << ">> Eval on " << evaluator_->size() << " cases:";
+        for (const auto &metric : metrics)
+        {
+            std::cerr << " " << metric.first << " " << metric.second;
+        }
+        std::cerr << std::endl;
+    }
+    
+    std::lock_guard<std::mutex> lock(evalMutex_);
+    metrics_ = metrics;
+}
+
+void Track2Vec::evalLoop()
+{
+    std::unique_lock<std::mutex> lock(evalMutex_);
+    while (!evalCv_.wait_for(lock, std::chrono::seconds(args_->evalInterval), [this]() { return !evalRunning_; }))
+    {
+        lock.unlock();
+        evaluate();
+        lock.lock();
+    }
+}
+
+Track2Vec::Metrics Track2Vec::metrics()
+{
+    std::lock_guard<std::mutex> lock(evalMutex_);
+    return metrics_;
+}
+
+void Track2Vec::park(int64_t threadId, int64_t ntokens)
+{
+    std::unique_lock<std::mutex> lock(parkMutex_);
+    idle_++;
+    parkCv_.notify_all();
+    parkCv_.wait(lock, [&]() { return threadId < activeThreads_ || !keepTraining(ntokens); });
+    idle_--;
+}
+
+void Track2Vec::setActiveThreads(int64_t n)
+{
+    std::lock_guard<std::mutex> lock(parkMutex_);
+    activeThreads_ = n;
+    parkCv_.notify_all();
+}
+
+// Runs a trainer on its pool worker and unpins the worker when it is done. A
+// trainer that throws ends the run: the first exception is kept for the
+// monitor to rethrow, the trainer counts as idle so hold() does not wait for
+// it, and deterministic trainers leave their barrier.
+void Track2Vec::runTrainer(int64_t threadId, void (Track2Vec::*body)(int64_t))
+{
+    try
+    {
+        (this->*body)(threadId);
+    }
+    catch (...)
+    {
+        fail(std::current_exception());
+        if (barrier_)
+        {
+            barrier_->abort();
+        }
+        retire();
+    }
+    
+    // threadModel() pinned the worker, the pool runs later phases on every cpu
+    if (!threadCpus_.empty() || replicas_)
+    {
+        topology::pinThread(topology::onlineCpus());
+    }
+}
+
+// Keeps the first failure for the monitor to rethrow and stops the run.
+void Track2Vec::fail(std::exception_ptr exception)
+{
+    std::lock_guard<std::mutex> lock(parkMutex_);
+    if (!trainException_)
+    {
+        trainException_ = exception;
+    }
+    failed_ = true;
+}
+
+// Trainers stop here while hold() runs, n is the number of trainers the
+// caller stands for. They have flushed their thread-local rows before.
+void Track2Vec::pausePoint(int64_t n)
+{
+    if (!pauseRequested_)
+        return;
+    
+    std::unique_lock<std::mutex> lock(parkMutex_);
+    idle_ += n;
+    parkCv_.notify_all();
+    
+    // the monitor's parallelFor runs on the waiting trainers' workers
+    while (pauseRequested_)
+    {
+        lock.unlock();
+        const bool helped = ThreadPool::global().help();
+        lock.lock();
+        if (!helped)
+            parkCv_.wait_for(lock, std::chrono::milliseconds(1), [&]() { return !pauseRequested_; });
+    }
+    idle_ -= n;
+}
+
+void Track2Vec::retire()
+{
+    std::lock_guard<std::mutex> lock(parkMutex_);
+    idle_++;
+    parkCv_.notify_all();
+}
+
+// Runs fn once no trainer touches the model: each one is paused, parked or done.
+void Track2Vec::hold(const std::function<void()> &fn)
+{
+    std::unique_lock<std::mutex> lock(parkMutex_);
+    pauseRequested_ = true;
+    parkCv_.wait(lock, [&]() { return idle_ >= args_->thread; });
+    
+    // unlocked, the paused trainers take the lock to look for pool tasks
+    lock.unlock();
+    fn();
+    lock.lock();
+    
+    pauseRequested_ = false;
+    parkCv_.notify_all();
+}
+
+// Called by the monitor. A failed check or a loss that is no longer finite
+// rolls back, a passed check refreshes the rollback point once it is older
+// than -snapshotInterval. Deterministic rounds check for themselves.
+void Track2Vec::watch(int64_t ntokens)
+{
+    if (!guard_ || args_->deterministic > 0)
+        return;
+    
+    if (utils::getDuration(lastCheck_, std::chrono::steady_clock::now()) < args_->checkInterval)
+        return;
+    
+    lastCheck_ = std::chrono::steady_clock::now();
+    
+    if (!guard_->check() || !std::isfinite(log_loss_.load()))
+    {
+        rollback(double(processedTotalTokenCount_) / (args_->epoch * ntokens), false);
+    }
+    else if (args_->snapshotInterval > 0 && (!guard_->saved() || guard_->age() >= args_->snapshotInterval))
+    {
+        guard_->save();
+    }
+}
+
+// Restores the last rollback point into every copy of the model and goes on
+// at -rollbackLr times the rates. Without a rollback point, or once the rate
+// would drop below -lrMin, training stops with EncounteredNaNError as before.
+// held tells that the trainers are already waiting, e.g. in a barrier.
+void Track2Vec::rollback(double progress, bool held)
+{
+    bool restored = false;
+    
+    // reduce() changes the rates the trainers read, so it runs held too
+    auto restore = [&]() {
+        if (!guard_->saved() || !schedule_->reduce(args_->rollbackLr))
+            return;
+        
+        restored = true;
+        if (replicas_)
+        {
+            replicas_->forEach([&](Matrix &input, Matrix &output) { guard_->restore(input, output); });
+            for (int64_t r = 0; r < replicas_->size(); r++)
+            {
+                replicas_->model(r)->repair();
+            }
+        }
+        else
+        {
+            guard_->restore(*input_, *output_);
+            model_->repair();
+        }
+        
+        schedule_->update(progress);
+        
+        std::lock_guard<std::mutex> lock(lossMutex_);
+        lossSum_ = 0;
+        lossCount_ = 0;
+        log_loss_ = -1;
+        bestLoss_ = -1;
+        staleReports_ = 0;
+    };
+    
+    if (held)
+        restore();
+    else
+        hold(restore);
+    
+    if (!restored)
+    {
+        std::cerr << ">> Diverged at " << 100 * progress << " %, no rollback left" << std::endl;
+        fail(std::make_exception_ptr(Matrix::EncounteredNaNError()));
+        return;
+    }
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << ">> Diverged at " << 100 * progress << " %, rolled back to the model of " << int64_t(guard_->age());
+        std::cerr << " sec ago, lr " << schedule_->lr() << std::endl;
+    }
+}
+
+// Called by the monitor. Checkpoints every -checkpointInterval seconds or
+// -checkpointTokens tokens, and once more on SIGTERM before training stops.
+// The trainers only wait while the positions are taken, the rows are written
+// afterwards from the live matrices; a deterministic run is captured by the
+// barrier of its next round instead.
+void Track2Vec::checkpoint()
+{
+    if (args_->checkpointInterval <= 0 && args_->checkpointTokens <= 0)
+        return;
+    
+    const bool terminate = terminateRequested;
+    const bool due = terminate ||
+                     (args_->checkpointInterval > 0 &&
+                      utils::getDuration(lastCheckpoint_, std::chrono::steady_clock::now()) >= args_->checkpointInterval) ||
+                     (args_->checkpointTokens > 0 &&
+                      processedTotalTokenCount_ - lastCheckpointTokens_ >= args_->checkpointTokens);
+    
+    // a slow disk skips checkpoints rather than queueing them
+    if (!due || (checkpointWriting_ && !terminate))
+        return;
+    
+    lastCheckpoint_ = std::chrono::steady_clock::now();
+    lastCheckpointTokens_ = processedTotalTokenCount_;
+    
+    if (args_->deterministic > 0)
+    {
+        checkpointDue_ = true;
+    }
+    else
+    {
+        std::shared_ptr<Checkpoint> checkpoint;
+        hold([&]() {
+            checkpoint = capture();
+            if (scheduler_)
+            {
+                checkpoint->epoch = scheduler_->epoch();
+                checkpoint->chunks = scheduler_->pending();
+            }
+            
+            // nothing trained after the checkpoint would be kept
+            if (terminate)
+                stop_ = true;
+        });
+        writeCheckpoint(checkpoint);
+    }
+    
+    if (terminate)
+    {
+        std::cerr << ">> SIGTERM, stopping after the checkpoint" << std::endl;
+        interrupted_ = true;
+        stop_ = true;
+    }
+}
+
+// What every mode shares, the caller adds the position in the corpus. No
+// trainer may move meanwhile. Only a deterministic run copies the matrices.
+std::shared_ptr<Checkpoint> Track2Vec::capture()
+{
+    auto checkpoint = std::make_shared<Checkpoint>();
+    checkpoint->mode = args_->deterministic > 0 ? Checkpoint::DETERMINISTIC
+                       : args_->memory > 0 ? Checkpoint::MEMORY : Checkpoint::STREAM;
+    checkpoint->processed = processedTotalTokenCount_;
+    checkpoint->trainers = trainerStates_;
+    checkpoint->lrFactor = schedule_->factor();
+    checkpoint->dim = args_->dim;
+    
+    {
+        std::lock_guard<std::mutex> lock(lossMutex_);
+        checkpoint->loss = log_loss_;
+        checkpoint->bestLoss = bestLoss_;
+        checkpoint->staleReports = staleReports_;
+    }
+    
+    // a deterministic resume must continue bit for bit, other runs read
+    // the rows while training goes on, like a snapshot export
+    if (args_->deterministic > 0)
+    {
+        auto copy = [](const Matrices &matrices) {
+            Matrices copies;
+            for (const std::shared_ptr<Matrix> &matrix : matrices)
+            {
+                copies.push_back(Checkpoint::copy(*matrix));
+            }
+            return copies;
+        };
+        checkpoint->input = copy(replicas_ ? replicas_->inputs() : Matrices{input_});
+        checkpoint->output = copy(replicas_ ? replicas_->outputs() : Matrices{output_});
+    }
+    else
+    {
+        checkpoint->input = replicas_ ? replicas_->inputs() : Matrices{input_};
+        checkpoint->output = replicas_ ? replicas_->outputs() : Matrices{output_};
+    }
+    if (model_->adagrad())
+    {
+        checkpoint->inputSums = model_->adagrad()->sums();
+        checkpoint->outputSums = model_->outputAdagrad()->sums();
+    }
+    return checkpoint;
+}
+
+// Writes on checkpointThread_ after the previous write finished.
+void Track2Vec::writeCheckpoint(std::shared_ptr<Checkpoint> checkpoint)
+{
+    if (checkpointThread_.joinable())
+    {
+        checkpointThread_.join();
+    }
+    
+    checkpointWriting_ = true;
+    checkpointThread_ = std::thread([this, checkpoint]() {
+        auto start = std::chrono::steady_clock::now();
+        try
+        {
+            checkpoint->version = dict_->version();
+            checkpoint->write(checkpointFile());
+            
+            if (args_->verbose > 0)
+            {
+                std::cerr << ">> Checkpoint at " << 100.0 * checkpoint->processed / (args_->epoch * trainTokens());
+                std::cerr << " % written in " << utils::getDuration(start, std::chrono::steady_clock::now());
+                std::cerr << " sec" << std::endl;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << ">> Checkpoint failed: " << e.what() << std::endl;
+        }
+        checkpointWriting_ = false;
+    });
+}
+
+// every rank of a distributed run keeps its own
+std::string Track2Vec::checkpointFile() const
+{
+    return args_->outputDir + "/checkpoint" + (args_->world > 1 ? "_" + std::to_string(args_->rank) : "") + ".bin";
+}
+
+// -resume: goes on from the checkpoint in -output, or starts from scratch
+// when there is none. The dictionary, -dim, -loss, -optimizer, the training
+// mode and, unless deterministic, -thread must match the run that wrote it.
+void Track2Vec::resume()
+{
+    const std::string filename = checkpointFile();
+    if (!std::ifstream(filename).is_open())
+    {
+        std::cerr << ">> No checkpoint at " << filename << ", training from the start" << std::endl;
+        return;
+    }
+    
+    std::shared_ptr<Checkpoint> checkpoint = Checkpoint::read(filename);
+    const int64_t mode = args_->deterministic > 0 ? Checkpoint::DETERMINISTIC
+                         : args_->memory > 0 ? Checkpoint::MEMORY : Checkpoint::STREAM;
+    
+    if (checkpoint->version != dict_->version())
+    {
+        throw std::invalid_argument(filename + " was trained on another dictionary!");
+    }
+    if (checkpoint->mode != mode)
+    {
+        throw std::invalid_argument(filename + " was written with other -memory or -deterministic!");
+    }
+    if (mode != Checkpoint::DETERMINISTIC && int64_t(checkpoint->trainers.size()) != args_->thread)
+    {
+        throw std::invalid_argument(filename + " was written with -thread " + std::to_string(checkpoint->trainers.size()));
+    }
+    if (checkpoint->dim != args_->dim ||
+        checkpoint->inputSize != input_->rows() * args_->dim ||
+        checkpoint->outputSize != output_->rows() * args_->dim)
+    {
+        throw std::invalid_argument(filename + " was written with other -dim or -loss!");
+    }
+    if (checkpoint->inputSums.empty() == bool(model_->adagrad()))
+    {
+        throw std::invalid_argument(filename + " was written with another -optimizer!");
+    }
+    
+    auto restore = [&](Model &model, Matrix &input, Matrix &output) {
+        checkpoint->paste(input, output);
+        if (model.adagrad())
+        {
+            model.adagrad()->setSums(checkpoint->inputSums);
+            model.outputAdagrad()->setSums(checkpoint->outputSums);
+        }
+    };
+    
+    if (replicas_)
+    {
+        int64_t replica = 0;
+        replicas_->forEach([&](Matrix &input, Matrix &output) { restore(*replicas_->model(replica++), input, output); });
+    }
+    else
+    {
+        restore(*model_, *input_, *output_);
+    }
+    
+    const double progress = double(checkpoint->processed) / (args_->epoch * trainTokens());
+    processedTotalTokenCount_ = checkpoint->processed;
+    schedule_->setFactor(checkpoint->lrFactor);
+    schedule_->update(progress);
+    log_loss_ = checkpoint->loss;
+    bestLoss_ = checkpoint->bestLoss;
+    staleReports_ = checkpoint->staleReports;
+    
+    // the trainers only need the position from here on
+    std::vector<float>().swap(checkpoint->inputSums);
+    std::vector<float>().swap(checkpoint->outputSums);
+    resume_ = checkpoint;
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << ">> Resuming at " << 100 * progress << " % from " << filename << std::endl;
+    }
+}
+
+// Called by the monitor, exports every -exportEpochs epochs or -exportInterval
+// seconds, see startExport.
+void Track2Vec::exportSnapshot(int64_t ntokens)
+{
+    const int64_t epoch = processedTotalTokenCount_ / ntokens;
+    const bool due = (args_->exportEpochs > 0 && epoch >= lastExportEpoch_ + args_->exportEpochs) ||
+                     (args_->exportInterval > 0 &&
+                      utils::getDuration(lastExport_, std::chrono::steady_clock::now()) >= args_->exportInterval);
+    
+    // an export still running delays the next one, the end of training
+    // saves the final vectors anyway
+    if (!due || exporting_ || !keepTraining(ntokens))
+        return;
+    
+    lastExportEpoch_ = epoch;
+    startExport();
+}
+
+// Writes the vectors to -output/snapshot_<tokens trained> without pausing the
+// trainers: exportThread_ formats the rows straight from the live matrices,
+// averaging the -numa replicas, so like any Hogwild read a snapshot mixes rows
+// a few updates apart. Nothing is copied, -alloc mmap stays out of core. The
+// monitor creates the thread, so it shares the cpus -reserveCores keeps off the
+// trainers. The directory appears complete under its final name.
+void Track2Vec::startExport()
+{
+    lastExport_ = std::chrono::steady_clock::now();
+    
+    if (exportThread_.joinable())
+    {
+        exportThread_.join();
+    }
+    
+    exporting_ = true;
+    exportThread_ = std::thread([this]() {
+        auto start = std::chrono::steady_clock::now();
+        const int64_t tokens = processedTotalTokenCount_;
+        const std::string dir = args_->outputDir + "/snapshot_" + std::to_string(tokens);
+        struct stat st;
+        try
+        {
+            // nothing trained since that snapshot, or an earlier run wrote it
+            if (stat(dir.c_str(), &st) == 0)
+            {
+                exporting_ = false;
+                return;
+            }
+            
+            const std::string tmp = dir + ".tmp";
+            if (mkdir(tmp.c_str(), 0755) != 0 && errno != EEXIST)
+            {
+                throw std::invalid_argument(tmp + " cannot be created for saving vectors!");
+            }
+            if (replicas_)
+            {
+                writeVectors(tmp, replicas_->inputs(), replicas_->outputs());
+            }
+            else
+            {
+                writeVectors(tmp, {input_}, {output_});
+            }
+            if (std::rename(tmp.c_str(), dir.c_str()) != 0)
+            {
+                throw std::runtime_error(tmp + " could not be renamed to " + dir);
+            }
+            
+            if (args_->verbose > 0)
+            {
+                std::cerr << ">> Snapshot of " << tokens << " tokens exported to " << dir << " in " << utils::getDuration(start, std::chrono::steady_clock::now());
+                std::cerr << " sec" << std::endl;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << ">> Snapshot failed: " << e.what() << std::endl;
+        }
+        exporting_ = false;
+    });
+}
+
+// Under hold(): adds the counts streamed since the last refresh to the
+// dictionary and rebuilds the discard and negative sampling tables from them.
+// Tracks keep their rows, only the tables follow the counts.
+void Track2Vec::refreshCounts()
+{
+    std::vector<int64_t> counts(dict_->ntracks());
+    for (size_t idx = 0; idx < counts.size(); idx++)
+    {
+        counts[idx] = streamCounts_[idx].exchange(0, std::memory_order_relaxed);
+    }
+    dict_->addCounts(counts);
+    
+    pdiscard_ = dict_->discardTable(args_->discard_t);
+    std::vector<int64_t> trackCounts = dict_->getTrackCount();
+    model_->updateCounts(trackCounts);
+    
+    if (args_->verbose > 1)
+    {
+        std::cerr << ">> Refreshed counts, " << dict_->ntokens() << " tokens" << std::endl;
+    }
+}
+
+// Warm-up of -thread auto. Measures the throughput of the active trainers over
+// -autoWindow seconds, then adds a step of trainers as long as each added
+// trainer brings at least -autoGain of the current per-thread throughput.
+// The count with the last worthwhile gain is kept and the rest stay parked.
+void Track2Vec::tuneThreads(int64_t ntokens, const LogCallback &callback)
+{
+    const int64_t step = std::max<int64_t>(1, args_->thread / 8);
+    int64_t best = activeThreads_;
+    double bestRate = 0;
     
-    json j;
-    for (const auto &pair : tracks)
+    for (int64_t n = best; keepTraining(ntokens); n = std::min(args_->thread, n + step))
     {
-        const trackEntry &entry = pair.second;
-        const std::string &track_id = entry.track_id;
+        setActiveThreads(n);
         
-        getTrackEmbeddingVector(vec, entry.idx, entry.artist_matrix_indices, entry.genre_matrix_indices);
+        // woken trainers report their first tokens after lrUpdateRate of them,
+        // so the first window only warms up
+        std::this_thread::sleep_for(std::chrono::seconds(args_->autoWindow));
+        const int64_t tokens = processedTotalTokenCount_;
+        const auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(args_->autoWindow));
+        const double rate = (processedTotalTokenCount_ - tokens) /
+                            utils::getDuration(start, std::chrono::steady_clock::now());
         
-        j.clear();
-        j["track_id"] = track_id;
-        j["vector"] = vec.data();
-        ofs << j << std::endl;
+        if (args_->verbose > 0)
+        {
+            std::cerr << ">> Auto thread " << n << ": " << int64_t(rate) << " tokens/sec (";
+            std::cerr << int64_t(rate / n) << " tokens/sec/thread)" << std::endl;
+        }
+        updateLoss();
+        printProgress(ntokens, callback);
+        
+        if (n > best && (rate - bestRate) / (n - best) < args_->autoGain * bestRate / best)
+            break;
+        
+        best = n;
+        bestRate = rate;
+        
+        if (n == args_->thread)
+            break;
     }
     
-    ofs.close();
+    setActiveThreads(best);
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << ">> Auto thread: training on " << best << " of " << args_->thread << " threads" << std::endl;
+    }
 }
-void Track2Vec::getTrackEmbeddingVector(Vector &vec,
-                                        int64_t trackIdx,
-                                        const std::vector<int64_t> &artistInices,
-                                        const std::vector<int64_t> &genreInices) const
+
+void Track2Vec::printProgress(int64_t ntokens, const LogCallback &callback)
 {
-    Vector in(args_->dim);
-    getInputVector(in, trackIdx);
-    
-    for (int64_t artistIdx : artistInices)
+    if (log_loss_ >= 0)
     {
-        getInputVector(in, artistIdx);
+        double progress = double(processedTotalTokenCount_) / (args_->epoch * ntokens);
+        printInfo(progress, log_loss_, callback);
     }
+}
+
+// tokens of one pass: the in-memory corpus, or the meta counts when streaming
+int64_t Track2Vec::trainTokens() const
+{
+    return args_->memory > 0 ? data_->ntokens() : dict_->ntokens();
+}
+
+bool Track2Vec::keepTraining(const int64_t ntokens) const
+{
+    return processedTotalTokenCount_ < args_->epoch * ntokens && !failed_ && !stop_;
+}
+
+void Track2Vec::reportLoss(model::State &state)
+{
+    const int64_t n = state.nexamples();
+    if (n == 0)
+        return;
     
-    for (int64_t genreIdx : genreInices)
+    const double loss = state.getLoss();
+    std::lock_guard<std::mutex> lock(lossMutex_);
+    lossSum_ += loss * n;
+    lossCount_ += n;
+}
+
+// Folds the losses the trainers reported since the last call into log_loss_,
+// a moving average over the report windows of all threads. False when no
+// trainer reported since.
+bool Track2Vec::updateLoss()
+{
+    double sum;
+    int64_t n;
     {
-        getInputVector(in, genreIdx);
+        std::lock_guard<std::mutex> lock(lossMutex_);
+        sum = lossSum_;
+        n = lossCount_;
+        lossSum_ = 0;
+        lossCount_ = 0;
     }
     
-    size_t z = 1 + artistInices.size() + genreInices.size();
-    in.mul(1.0 / z);
-    
-    Vector out(args_->dim);
-    getOutputVector(out, trackIdx);
+    if (n == 0)
+        return false;
     
-    vec = in.avg(out);
+    const double loss = sum / n;
+    log_loss_ = log_loss_ < 0 ? loss : LOSS_SMOOTHING * loss + (1 - LOSS_SMOOTHING) * log_loss_;
+    return true;
 }
 
-void Track2Vec::saveArtistInputVectors(const std::string &filename)
+// True once the smoothed loss is below -es, or has not improved on its best
+// by -esDelta (relative) for -esPatience reports in a row.
+bool Track2Vec::converged()
 {
-    if (!input_)
+    if (log_loss_ < 0)
+        return false;
+    
+    if (args_->es > 0 && log_loss_ < args_->es)
     {
-        throw std::runtime_error("Model never trained");
+        if (args_->verbose > 0)
+            std::cerr << ">> Early stop: loss " << log_loss_ << " is below " << args_->es << std::endl;
+        return true;
     }
     
-    std::ofstream ofs(filename, std::ofstream::binary);
-    if (!ofs.is_open())
+    if (args_->esPatience <= 0)
+        return false;
+    
+    if (bestLoss_ < 0 || log_loss_ < bestLoss_ * (1 - args_->esDelta))
     {
-        throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
+        bestLoss_ = log_loss_;
+        staleReports_ = 0;
+        return false;
     }
     
-    Vector vec(args_->dim);
-    const std::unordered_map<std::string, artistEntry> &artists = dict_->getArtistEntries();
+    if (++staleReports_ < args_->esPatience)
+        return false;
     
-    json j;
-    for (const auto &pair : artists)
+    if (args_->verbose > 0)
     {
-        const artistEntry &entry = pair.second;
-        getInputVector(vec, entry.idx);
-        
-        j.clear();
-        j["artist_id"] = entry.artist_id;
-        j["vector"] = vec.data();
-        ofs << j << std::endl;
+        std::cerr << ">> Early stop: loss " << log_loss_ << " has not improved on " << bestLoss_;
+        std::cerr << " for " << staleReports_ << " reports" << std::endl;
     }
-    
-    ofs.close();
+    return true;
 }
 
-void Track2Vec::saveGenreInputVectors(const std::string &filename)
+void Track2Vec::printInfo(double progress, double loss, const LogCallback &callback)
 {
-    if (!input_)
-    {
-        throw std::runtime_error("Model never trained");
-    }
-    
-    std::ofstream ofs(filename, std::ofstream::binary);
-    if (!ofs.is_open())
-    {
-        throw std::invalid_argument(filename + " cannot be opened for saving vectors!");
-    }
+    double ratio;
+    double lr;
+    int64_t eta;
+    std::tie<double, double, int64_t>(ratio, lr, eta) = progressInfo(progress);
+    callback(progress, loss, ratio, lr, eta, metrics());
+}
+
+std::tuple<double, double, int64_t> Track2Vec::progressInfo(double progress)
+{
+    int64_t t = int64_t(utils::getDuration(start_, std::chrono::steady_clock::now()));
+    double lr = schedule_->lr();
+    double process_ratio = 0;
     
-    Vector vec(args_->dim);
-    const std::unordered_map<std::string, genreEntry> &genres = dict_->getGenreEntries();
+    int64_t eta = 2592000; // Default to one month in seconds (720 * 3600)
     
-    json j;
-    for (const auto &pair : genres)
+    if (progress > 0 && t >= 0)
     {
-        const genreEntry &entry = pair.second;
-        getInputVector(vec, entry.idx);
-        j.clear();
-        j["genre_id"] = entry.genre_id;
-        j["vector"] = vec.data();
-        ofs << j << std::endl;
+        eta = t * (1 - progress) / progress;
+        process_ratio = double(processedTotalTokenCount_) / t / activeThreads_;
     }
     
-    ofs.close();
+    return std::tuple<double, double, int64_t>(process_ratio, lr, eta);
 }
 
-void Track2Vec::startThreads(const LogCallback &callback)
+std::shared_ptr<Model> Track2Vec::createModel(std::shared_ptr<Matrix> input,
+                                              std::shared_ptr<Matrix> output) const
 {
-    start_ = std::chrono::steady_clock::now();
-    std::vector<std::thread> threads;
-    const int64_t ntokens = dict_->ntokens();
-    
-    for (int64_t i = 0; i < args_->thread; i++)
+    std::shared_ptr<Loss> loss;
+    if (args_->loss == "hs")
     {
-        if (args_->memory > 0)
-        {
-            threads.push_back(std::thread([=]() { trainThreadInMemory(i); }));
-        }
-        else
-        {
-            threads.push_back(std::thread([=]() { trainThread(i); }));
-        }
-    }
-    
-    if (args_->verbose > 0) {
-        std::cerr << "Number of thread: " << args_->thread << std::endl;
+        loss = std::make_shared<HierarchicalSoftmaxLoss>(output, tree_);
     }
-    
-    while (keepTraining(ntokens))
+    else
     {
-        std::this_thread::sleep_for(std::chrono::seconds(args_->printInterval));
-        
-        if (log_loss_ >= 0)
-        {
-            double progress = double(processedTotalTokenCount_) / (args_->epoch * ntokens);
-            printInfo(progress, log_loss_, callback);
-        }
+        auto negativeSampling = std::make_shared<NegativeSamplingLoss>(output, args_->neg, args_->prefetch > 0);
+        auto track_cnt = dict_->getTrackCount();
+        negativeSampling->initNegative(track_cnt);
+        loss = negativeSampling;
     }
+    auto model = std::make_shared<Model>(input, output, loss);
     
-    for (int64_t i = 0; i < threads.size(); i++)
+    if (args_->optimizer == "adagrad")
     {
-        threads[i].join();
+        model->setAdagrad(std::make_shared<Adagrad>(input->rows()), std::make_shared<Adagrad>(output->rows()));
     }
-    if (trainException_)
+    
+    if (args_->hotCount > 0)
     {
-        std::exception_ptr exception = trainException_;
-        trainException_ = nullptr;
-        std::rethrow_exception(exception);
+        model->setHotRows(dict_->getHotIndices(args_->hotCount), args_->hotFlush);
     }
     
-    printInfo(1.0, log_loss_, callback);
+    return model;
 }
 
-void Track2Vec::skipgram(model::State &state, double lr, const std::vector<std::string> &sequence)
+// Model a trainer works on. This also pins the calling thread, to its own cpu
+// with -affinity, otherwise to the cpus of its replica.
+std::shared_ptr<Model> Track2Vec::threadModel(int64_t threadId) const
 {
-    std::uniform_int_distribution<> uniform(1, args_->ws);
-    
-    for (int64_t idx = 0; idx < sequence.size(); idx++)
+    if (!threadCpus_.empty())
     {
-        const std::string &track_id = sequence[idx];
-        int64_t input_idx = dict_->getTrackIdx(track_id);
-        
-        if (input_idx < 0)
-            continue;
-            
-        const trackEntry &entry = dict_->getTrackEntry(track_id);
-        double lr_alpha = entry.lr_alpha * lr;
-        
-        const std::vector<int64_t> &artist_indices = dict_->getArtistMatrixIndices(track_id);
-        const std::vector<int64_t> &genre_indices = dict_->getGenreMatrixIndices(track_id);
-        
-        int64_t boundary = uniform(state.rng);
-        std::set<int64_t> output_set;
-        
-        for (int64_t c = -boundary; c <= boundary; c++)
+        if (!topology::pinThread({threadCpus_[threadId]}) && args_->verbose > 1)
         {
-            if (c != 0 && idx + c >= 0 && idx + c < sequence.size())
-            {
-                const std::string& target = sequence[idx + c];
-                const int64_t output_idx = dict_->getTrackIdx(target);
-                output_set.insert(output_idx);
-            }
+            std::cerr << ">> Failed to pin thread [" << threadId << "]" << std::endl;
         }
-        
-        for (int64_t output_idx: output_set) {
-            model_->update(input_idx, artist_indices, genre_indices, output_idx, output_set, lr_alpha, state);
+    }
+    
+    if (replicas_)
+    {
+        int64_t replica = replicas_->replicaOf(threadId);
+        if (threadCpus_.empty())
+        {
+            replicas_->pin(replica);
         }
-        
+        return replicas_->model(replica);
     }
+    return model_;
 }
 
-void Track2Vec::trainThread(int64_t threadId) 
+// Picks one cpu per trainer. Physical cores are filled before SMT siblings so
+// two trainers only share a core once every core is busy, and with replicas
+// each trainer stays inside the partition of its replica. The first
+// -reserveCores cores are kept for the monitor and replica sync threads.
+void Track2Vec::planAffinity()
 {
-    std::ifstream ifs(args_->input);
-    if (!ifs.is_open())
-    {
-        throw std::invalid_argument(args_->input + " cannot be opened for loading data!");
-    }
-    
-    utils::gotoLine(ifs, threadId * args_->threadInterval);
-    
-    if (args_->verbose > 2)
+    threadCpus_.clear();
+    reservedCpus_.clear();
+    if (args_->affinity == 0)
     {
-        std::cerr << ">> trainThread [" << threadId << "] started from poistion [";
-        std::cerr << threadId * args_->threadInterval << "]" << std::endl;
+        return;
     }
     
-    model::State state(args_->dim, output_->size(0), threadId + args_->seed);
-    
-    const int64_t ntokens = dict_->ntokens();
-    
-    int64_t localTokenCount = 0;
-    std::vector<std::string> sequence;
-    double lr = args_->lr;
+    const std::vector<int64_t> online = topology::onlineCpus();
+    const int64_t ncores = topology::physicalFirst(online, false).size();
+    reservedCpus_ = topology::firstCores(online, std::min(args_->reserveCores, ncores - 1));
     
-    try
+    std::vector<std::vector<int64_t>> pools;
+    const int64_t npools = replicas_ ? replicas_->size() : 1;
+    for (int64_t r = 0; r < npools; r++)
     {
-        while (keepTraining(ntokens))
+        std::vector<int64_t> pool;
+        for (int64_t cpu : replicas_ ? replicas_->cpus(r) : online)
         {
-            localTokenCount += dict_->getSequence(ifs, sequence, state.rng);
-            skipgram(state, lr, sequence);
-            
-            if (localTokenCount > args_->lrUpdateRate)
+            if (std::find(reservedCpus_.begin(), reservedCpus_.end(), cpu) == reservedCpus_.end())
             {
-                processedTotalTokenCount_ += localTokenCount;
-                localTokenCount = 0;
-                if (threadId == 0)
-                {
-                    log_loss_ = state.getLoss();
-                }
-                
-                double progress = double(processedTotalTokenCount_) / (args_->epoch * ntokens);
-                double lr = args_->lr * (1.0 - progress);
-                lr = lr < 0.001 ? 0.001 : lr;
+                pool.push_back(cpu);
             }
         }
-    }
-    catch (Matrix::EncounteredNaNError &)
-    {
-        trainException_ = std::current_exception();
+        if (pool.empty())
+        {
+            pool = replicas_ ? replicas_->cpus(r) : online;
+        }
+        pools.push_back(topology::physicalFirst(pool, args_->smt > 0));
     }
     
-    if (threadId == 0)
-        log_loss_ = state.getLoss();
-    
-    ifs.close();
-}
-
-void Track2Vec::trainThreadInMemory(int64_t threadId)
-{
-    int64_t idx = threadId * data_.size() / args_->thread;
-    
-    if (args_->verbose > 1)
+    for (int64_t i = 0; i < args_->thread; i++)
     {
-        std::cerr << ">> trainThreadInMemory [" << threadId << "] started from poistion [";
-        std::cerr << threadId * args_->threadInterval << "]" << std::endl;
+        const std::vector<int64_t> &pool = pools[i % npools];
+        threadCpus_.push_back(pool[(i / npools) % pool.size()]);
     }
     
-    std::uniform_real_distribution<> uniform(0, 1);
-    model::State state(args_->dim, output_->size(0), threadId + args_->seed);
-    const int64_t ntokens = dict_->ntokens();
-    int64_t localTokenCount = 0;
-    double lr = args_->lr;
-    
-    try
+    if (args_->verbose > 0)
     {
-        while (keepTraining(ntokens))
+        std::cerr << "Affinity: " << args_->thread << " threads on " << ncores << " physical cores / ";
+        std::cerr << online.size() << " cpus";
+        if (!reservedCpus_.empty())
         {
-            if (0 == data_.count(idx))
-                idx = 0;
-            
-            const std::vector<std::string> &tracks = data_[idx++];
-            std::vector<std::string> sequence;
-            localTokenCount += tracks.size();
-            
-            for (const auto &track : tracks)
-            {
-                if (false == dict_->discard(track, uniform(state.rng)))
-                    sequence.push_back(track);
-            }
-            
-            skipgram(state, lr, sequence);
-            
-            if (localTokenCount > args_->lrUpdateRate)
-            {
-                processedTotalTokenCount_ += localTokenCount;
-                localTokenCount = 0;
-                
-                if (threadId == 0)
-                    log_loss_ = state.getLoss();
-                
-                double progress = double(processedTotalTokenCount_) / (args_->epoch * ntokens);
-                double lr = args_->lr * (1.0 - progress);
-                lr = lr < 0.001 ? 0.001 : lr;
-            }
+            std::cerr << ", reserved cpus: " << topology::toString(reservedCpus_);
         }
+        std::cerr << std::endl;
     }
-    catch (Matrix::EncounteredNaNError &)
+    if (args_->verbose > 1)
     {
-        trainException_ = std::current_exception();
+        for (int64_t i = 0; i < args_->thread; i++)
+        {
+            const topology::Cpu cpu = topology::describe(threadCpus_[i]);
+            std::cerr << "Thread [" << i << "] -> cpu " << cpu.id << " (package " << cpu.package;
+            std::cerr << ", core " << cpu.core << ")" << std::endl;
+        }
     }
-    
-    if (threadId == 0)
-        log_loss_ = state.getLoss();
-}
-
-bool Track2Vec::keepTraining(const int64_t ntokens) const
-{
-    return processedTotalTokenCount_ < args_->epoch * ntokens && !trainException_;
-}
-
-void Track2Vec::printInfo(double progress, double loss, const LogCallback &callback)
-{
-    double ratio;
-    double lr;
-    int64_t eta;
-    std::tie<double, double, int64_t>(ratio, lr, eta) = progressInfo(progress);
-    callback(progress, loss, ratio, lr, eta);
 }
 
-std::tuple<int64_t, double, double> Track2Vec::progressInfo(double progress)
+// Rows are laid out by descending count, so the -lockRows most frequent
+// tracks are a prefix of the input matrix and, unless -loss hs, of the
+// output. Artist and genre rows are shared by many tracks and always locked.
+void Track2Vec::lockHotRows()
 {
-    int64_t t = int64_t(utils::getDuration(start_, std::chrono::steady_clock::now()));
-    double lr = args_->lr * (1.0 - progress);
-    double process_ratio = 0;
-    
-    int64_t eta = 2592000; // Default to one month in seconds (720 * 3600)
-    
-    if (progress > 0 && t >= 0)
+    const int64_t ntracks = dict_->ntracks();
+    const int64_t nlock = std::min(args_->lockRows, ntracks);
+    
+    bool locked = input_->lockRows(0, nlock);
+    locked = input_->lockRows(ntracks, input_->size(0)) && locked;
+    // inner nodes are numbered by count, the hot ones are next to the root
+    if (tree_)
+        locked = output_->lockRows(std::max<int64_t>(0, output_->size(0) - nlock), output_->size(0)) && locked;
+    else
+        locked = output_->lockRows(0, nlock) && locked;
+    
+    if (!locked)
     {
-        eta = t * (1 - progress) / progress;
-        process_ratio = double(processedTotalTokenCount_) / t / args_->thread;
+        std::cerr << "Failed to lock hot rows in memory, raise the memlock limit (ulimit -l)" << std::endl;
+    }
+    else if (args_->verbose > 0)
+    {
+        const int64_t rows = 2 * nlock + input_->size(0) - ntracks;
+        std::cerr << "Locked " << rows << " hot rows in memory, matrix files in " << args_->mmapDir << std::endl;
     }
-    
-    return std::tuple<double, double, int64_t>(process_ratio, lr, eta);
 }
 
 std::shared_ptr<Matrix> Track2Vec::createRandomMatrix() const
 {
     int64_t m = dict_->ntracks() + dict_->ngenres() + dict_->nartists();
-    std::shared_ptr<Matrix> input = std::make_shared<Matrix>(m, args_->dim);
-    input->randomInit(args_->seed);
+    std::shared_ptr<Matrix> input = std::make_shared<Matrix>(m, args_->dim, allocator_);
+    input->randomInit(args_->seed, args_->thread);
     
     return input;
 }
 
+// a row per track, or per inner node of the tree with -loss hs
 std::shared_ptr<Matrix> Track2Vec::createTrainOutputMatrix() const
 {
-    int64_t m = dict_->ntracks();
-    std::shared_ptr<Matrix> output = std::make_shared<Matrix>(m, args_->dim);
-    output->zero();
+    int64_t m = tree_ ? std::max<int64_t>(1, tree_->left.size()) : dict_->ntracks();
+    std::shared_ptr<Matrix> output = std::make_shared<Matrix>(m, args_->dim, allocator_);
+    output->zero(args_->thread);
     
     return output;
 }
@@ -545,8 +2195,14 @@ void Track2Vec::setOutputMatrixFromFile(const std::string &outputDir)
         throw std::runtime_error("input matrix is not available");
     }
     
-    std::string output_filename = outputDir + "/" + model_output_track;
-    loadOutputMatrix(output_filename);
+    if (tree_)
+    {
+        loadOutputNodes(outputDir + "/" + model_output_node);
+    }
+    else
+    {
+        loadOutputMatrix(outputDir + "/" + model_output_track);
+    }
 }
 
 void Track2Vec::loadTrackInputVectors(const std::string &filename)
@@ -563,12 +2219,10 @@ void Track2Vec::loadTrackInputVectors(const std::string &filename)
         return;
     }
     
-    int64_t track_cnt = 0;
+    std::atomic<int64_t> track_cnt(0);
     
-    for (std::string line; std::getline(ifs, line);)
-    {
-        json j = json::parse(line);
-        
+    // every line names a distinct row, so the rows are updated in parallel
+    forEachJsonLine(ifs, [&](const json &j) {
         std::string track_id = j["track_id"];
         std::vector<double> vec = j["vector"];
         assert(args_->dim == vec.size());
@@ -576,14 +2230,14 @@ void Track2Vec::loadTrackInputVectors(const std::string &filename)
         int64_t idx = dict_->getTrackIdx(track_id);
         
         if (0 > idx)
-            continue;
+            return;
         
         auto &trackEntry = dict_->getTrackEntry(track_id);
-        trackEntry.lr_alpha = args_->pretrained_lr;
+        trackEntry.pretrained = true;
         input_->addVectorToRow(vec, idx);
         
         track_cnt++;
-    }
+    });
     
     ifs.close();
     
@@ -606,23 +2260,21 @@ void Track2Vec::loadArtistInputVectors(const std::string &filename)
         return;
     }
     
-    int artist_cnt = 0;
+    std::atomic<int64_t> artist_cnt(0);
     
-    for (std::string line; std::getline(ifs, line);)
-    {
-        json j = json::parse(line);
-        
+    // every line names a distinct row, so the rows are updated in parallel
+    forEachJsonLine(ifs, [&](const json &j) {
         std::string artist_id = j["artist_id"];
         std::vector<double> vec = j["vector"];
         assert(args_->dim == vec.size());
         
         int64_t idx = dict_->getArtistIdx(artist_id);
         if (0 > idx)
-            continue;
+            return;
         
         input_->addVectorToRow(vec, idx);
         artist_cnt++;
-    }
+    });
     
     ifs.close();
     
@@ -645,12 +2297,10 @@ void Track2Vec::loadGenreInputVectors(const std::string &filename)
         return;
     }
     
-    int64_t genre_cnt = 0;
+    std::atomic<int64_t> genre_cnt(0);
     
-    for (std::string line; std::getline(ifs, line);)
-    {
-        json j = json::parse(line);
-        
+    // every line names a distinct row, so the rows are updated in parallel
+    forEachJsonLine(ifs, [&](const json &j) {
         std::string genre_id = j["genre_id"];
         std::vector<double> vec = j["vector"];
         assert(args_->dim == vec.size());
@@ -658,11 +2308,11 @@ void Track2Vec::loadGenreInputVectors(const std::string &filename)
         int64_t idx = dict_->getGenreIdx(genre_id);
         
         if (0 > idx)
-            continue;
+            return;
         
         input_->addVectorToRow(vec, idx);
         genre_cnt++;
-    }
+    });
     
     ifs.close();
     
@@ -678,7 +2328,7 @@ void Track2Vec::loadOutputMatrix(const std::string &filename)
         throw std::runtime_error("output matrix is not available");
     }
     
-    int64_t output_cnt = 0;
+    std::atomic<int64_t> output_cnt(0);
     std::ifstream ifs(filename, std::ofstream::binary);
     if (!ifs.is_open())
     {
@@ -686,21 +2336,19 @@ void Track2Vec::loadOutputMatrix(const std::string &filename)
         return;
     }
     
-    for (std::string line; std::getline(ifs, line);)
-    {
-        json j = json::parse(line);
-        
+    // every line names a distinct row, so the rows are updated in parallel
+    forEachJsonLine(ifs, [&](const json &j) {
         std::string track_id = j["track_id"];
         std::vector<double> vec = j["vector"];
         assert(args_->dim == vec.size());
         
         int64_t idx = dict_->getTrackIdx(track_id);
         if (0 > idx)
-            continue;
+            return;
         
         output_->addVectorToRow(vec, idx);
         output_cnt++;
-    }
+    });
     ifs.close();
     
     if( args_->verbose > 0) {
@@ -708,6 +2356,51 @@ void Track2Vec::loadOutputMatrix(const std::string &filename)
     }
 }
 
+// Node rows are only loaded when every node of the file has the children it
+// has in this run's tree, otherwise the output rows start from zero.
+void Track2Vec::loadOutputNodes(const std::string &filename)
+{
+    std::ifstream ifs(filename, std::ifstream::binary);
+    if (!ifs.is_open())
+    {
+        std::cerr << ">> " << filename << " does not exists" << std::endl;
+        return;
+    }
+    
+    const int64_t nnodes = tree_->left.size();
+    auto same = [&](const json &c, int64_t expected) {
+        if (expected < 0)
+            return c.is_string() && dict_->getTrackIdx(c.get<std::string>()) == -1 - expected;
+        return c.is_number_integer() && c.get<int64_t>() == expected;
+    };
+    
+    std::atomic<int64_t> matching(0);
+    forEachJsonLine(ifs, [&](const json &j) {
+        int64_t node = j["node"];
+        if (node >= 0 && node < nnodes && same(j["left"], tree_->left[node]) && same(j["right"], tree_->right[node]))
+            matching++;
+    });
+    if (matching != nnodes)
+    {
+        std::cerr << ">> " << filename << " was trained on another tree, output rows start from zero" << std::endl;
+        return;
+    }
+    
+    ifs.clear();
+    ifs.seekg(0);
+    forEachJsonLine(ifs, [&](const json &j) {
+        std::vector<double> vec = j["vector"];
+        assert(args_->dim == vec.size());
+        output_->addVectorToRow(vec, j["node"].get<int64_t>());
+    });
+    ifs.close();
+    
+    if (args_->verbose > 0)
+    {
+        std::cerr << "Load pretrained output nodes [" << nnodes << "]: " << filename << std::endl;
+    }
+}
+
 void Track2Vec::loadData()
 {
     std::ifstream ifs(args_->input);
@@ -718,22 +2411,48 @@ void Track2Vec::loadData()
     }
     
     int64_t idx = 0;
+    // the corpus is streamed every epoch, keep it off the matrix files
+    if (allocator_->name() == "mmap")
+    {
+        data_ = std::make_shared<Corpus>(Allocator::create("aligned", args_->pad > 0));
+    }
+    else
+    {
+        data_ = std::make_shared<Corpus>(allocator_);
+    }
+    std::vector<std::string> lines;
+    std::vector<std::vector<int64_t>> records;
     
-    do
+    // records are parsed on the pool and appended in file order
+    while (utils::readLines(ifs, lines, LINE_BLOCK))
     {
-        std::vector<std::string> tracks;
+        records.resize(lines.size());
+        ThreadPool::global().parallelFor(lines.size(), [&](int64_t begin, int64_t end) {
+            for (int64_t i = begin; i < end; i++)
+            {
+                records[i].clear();
+                dict_->parseRecord(lines[i], records[i]);
+            }
+        });
         
-        if (dict_->getRecord(ifs, tracks))
+        for (const std::vector<int64_t> &tracks : records)
         {
-            data_.emplace(idx++, std::move(tracks));
+            if (tracks.empty())
+                continue;
+            
+            // each rank of a distributed run keeps every world-th sequence
+            if (idx % args_->world == args_->rank)
+            {
+                data_->add(tracks);
+            }
+            idx++;
             
             if (args_->verbose > 2 && idx % 1000 == 0)
             {
                 std::cerr << ">> Load [" << idx / 1000 << "K] characters into memory" << std::endl;
             }
         }
-        
-    } while (false == ifs.eof());
+    }
     
     ifs.close();
 }
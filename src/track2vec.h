@@ -8,18 +8,34 @@
 #include <time.h>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #include "args.h"
+#include "checkpoint.h"
+#include "corpus.h"
+#include "delta.h"
 #include "dictionary.h"
+#include "evaluator.h"
+#include "guard.h"
+#include "loss.h"
 #include "matrix.h"
+#include "memory.h"
 #include "model.h"
+#include "schedule.h"
+#include "scheduler.h"
 #include "vector.h"
 
 namespace track2vec
 {
 
+class Peer;
+class Replicas;
+class SessionSource;
+
 class Track2Vec
 {
 private:
@@ -29,17 +45,95 @@ private:
     std::shared_ptr<Matrix> output_;
     std::shared_ptr<Dictionary> dict_;
     std::shared_ptr<Model> model_;
+    std::shared_ptr<Replicas> replicas_;
+    std::shared_ptr<Peer> peer_;
+    std::shared_ptr<Scheduler> scheduler_;
+    std::shared_ptr<LrSchedule> schedule_;
+    std::shared_ptr<const HierarchicalSoftmaxLoss::Tree> tree_;
+    
+    //Deterministic mode
+    std::shared_ptr<Barrier> barrier_;
+    std::vector<Delta> inputDeltas_;
+    std::vector<Delta> outputDeltas_;
+    std::atomic<int64_t> roundNext_{};
+    bool roundStop_;
+    
+    //Thread affinity
+    std::vector<int64_t> threadCpus_;
+    std::vector<int64_t> reservedCpus_;
+    
+    //First pool worker of trainer 0, sweep configurations train side by side
+    int64_t firstWorker_;
+    
+    //Keep probabilities by track index for this run's -discard_t
+    std::vector<double> pdiscard_;
+    
+    //Thread auto-tuning, trainers at or above activeThreads_ wait in park()
+    std::atomic<int64_t> activeThreads_{};
+    std::mutex parkMutex_;
+    std::condition_variable parkCv_;
+    
+    //Divergence check by the monitor, which holds the trainers for a rollback.
+    //idle_ counts trainers that are paused, parked or done.
+    std::shared_ptr<Guard> guard_;
+    std::atomic<bool> pauseRequested_{};
+    int64_t idle_;
+    std::chrono::steady_clock::time_point lastCheck_;
+    
+    //Checkpoints, captured by the monitor under hold() or at the end of a
+    //deterministic round and written by checkpointThread_ while training goes
+    //on. Trainers leave their RNG and position in trainerStates_ when paused.
+    std::shared_ptr<Checkpoint> resume_;
+    std::vector<Checkpoint::Trainer> trainerStates_;
+    std::thread checkpointThread_;
+    std::atomic<bool> checkpointWriting_{};
+    std::atomic<bool> checkpointDue_{};
+    std::chrono::steady_clock::time_point lastCheckpoint_;
+    int64_t lastCheckpointTokens_;
+    bool interrupted_;
+    
+    //Live exports of the vectors to -output/snapshot_<tokens>, copied row by
+    //row and written by exportThread_ while the trainers keep going
+    std::thread exportThread_;
+    std::atomic<bool> exporting_{};
+    int64_t lastExportEpoch_;
+    std::chrono::steady_clock::time_point lastExport_;
+    
+    //serve-train, counts by track index of the sessions streamed since the
+    //last refresh
+    std::shared_ptr<SessionSource> source_;
+    std::unique_ptr<std::atomic<int64_t>[]> streamCounts_;
+    std::chrono::steady_clock::time_point lastRefresh_;
     
     //Variable
     std::atomic<int64_t> processedTotalTokenCount_{};
     std::atomic<double> log_loss_{};
     std::chrono::steady_clock::time_point start_;
     
+    //Early stopping, trainers report their loss every lrUpdateRate tokens
+    static constexpr double LOSS_SMOOTHING = 0.3;
+    std::mutex lossMutex_;
+    double lossSum_;
+    int64_t lossCount_;
+    double bestLoss_;
+    int64_t staleReports_;
+    std::atomic<bool> stop_{};
+    
+    //Held-out evaluation, run every -evalInterval seconds by evalThread_
+    std::shared_ptr<Evaluator> evaluator_;
+    std::thread evalThread_;
+    std::mutex evalMutex_;
+    std::condition_variable evalCv_;
+    bool evalRunning_;
+    Evaluator::Metrics metrics_;
+    
     //Data
-    std::unordered_map<int64_t, std::vector<std::string>> data_;
+    std::shared_ptr<Allocator> allocator_;
+    std::shared_ptr<Corpus> data_;
     
     // output file path
     static const std::string model_output_track;
+    static const std::string model_output_node;
     static const std::string model_input_track;
     static const std::string model_input_artist;
     static const std::string model_input_genre;
@@ -49,30 +143,76 @@ private:
     static const std::string genre_vec;
     
     //Misc
+    // the first failure of the run, set by fail() under parkMutex_; failed_
+    // lets the trainers and the monitor see it without the lock
     std::exception_ptr trainException_;
-    
+    std::atomic<bool> failed_{};
+
 public:
     using TrainCallback = std::function<void(int64_t)>;
-    using LogCallback = std::function<void(double, double, double, double, int64_t)>;
+    using Metrics = Evaluator::Metrics;
+    using LogCallback = std::function<void(double, double, double, double, int64_t, const Metrics &)>;
     
-    Track2Vec(std::shared_ptr<Args> args);
+    Track2Vec(std::shared_ptr<Args> args, int64_t firstWorker = 0);
+    void load();
     void loadData();
     void train(const LogCallback &callback = {});
+    
+    // trains on the dictionary and in-memory corpus another instance loaded
+    void train(std::shared_ptr<Dictionary>, std::shared_ptr<Corpus>, const LogCallback &callback = {});
+    
+    // trains on sessions streamed to -input until SIGTERM or SIGINT
+    void serve(const LogCallback &callback = {});
     void saveModel(const std::string &);
     void saveVectors(const std::string &);
     
+    inline std::shared_ptr<Dictionary> dictionary() const
+    {
+        return dict_;
+    }
+    inline std::shared_ptr<Corpus> corpus() const
+    {
+        return data_;
+    }
+    inline double loss() const
+    {
+        return log_loss_;
+    }
+    
+    // stopped by SIGTERM after a checkpoint, the vectors are not final
+    inline bool interrupted() const
+    {
+        return interrupted_;
+    }
+    
+    // install or release the SIGTERM handler of checkpointing runs
+    static void handleTerminate(bool);
+    Metrics metrics();
+
 private:
+    // the copies of one matrix, one per -numa replica, read as their average
+    using Matrices = std::vector<std::shared_ptr<Matrix>>;
+    
     void saveOutputMatrix(const std::string &);
-    void saveTrackEmbeddingVectors(const std::string &);
+    void saveOutputNodes(const std::string &);
+    void writeVectors(const std::string &, const Matrices &, const Matrices &);
+    void saveTrackEmbeddingVectors(const std::string &, const Matrices &, const Matrices &);
     void saveTrackInputVectors(const std::string &);
-    void saveArtistInputVectors(const std::string &);
-    void saveGenreInputVectors(const std::string &);
+    void saveArtistInputVectors(const std::string &, const Matrices &);
+    void saveGenreInputVectors(const std::string &, const Matrices &);
     
     void loadTrackInputVectors(const std::string &);
     void loadArtistInputVectors(const std::string &);
     void loadGenreInputVectors(const std::string &);
     void loadOutputMatrix(const std::string &);
+    void loadOutputNodes(const std::string &);
     
+    void initModel();
+    std::shared_ptr<Model> createModel(std::shared_ptr<Matrix>, std::shared_ptr<Matrix>) const;
+    std::shared_ptr<Model> threadModel(int64_t) const;
+    void planAffinity();
+    void lockHotRows();
+    void phase(const std::string &, const std::function<void()> &) const;
     std::shared_ptr<Matrix> createRandomMatrix() const;
     std::shared_ptr<Matrix> createTrainOutputMatrix() const;
     void setInputMatrixFromFile(const std::string &);
@@ -81,15 +221,51 @@ private:
     void startThreads(const LogCallback &);
     void trainThread(int64_t);
     void trainThreadInMemory(int64_t);
+    void trainThreadDeterministic(int64_t);
+    void trainThreadServe(int64_t);
+    void runTrainer(int64_t, void (Track2Vec::*)(int64_t));
+    void fail(std::exception_ptr);
+    void refreshCounts();
+    void park(int64_t, int64_t);
+    void setActiveThreads(int64_t);
+    void pausePoint(int64_t);
+    void retire();
+    void hold(const std::function<void()> &);
+    void watch(int64_t);
+    void rollback(double, bool);
+    void checkpoint();
+    std::shared_ptr<Checkpoint> capture();
+    void writeCheckpoint(std::shared_ptr<Checkpoint>);
+    std::string checkpointFile() const;
+    void resume();
+    void exportSnapshot(int64_t);
+    void startExport();
+    void tuneThreads(int64_t, const LogCallback &);
+    void printProgress(int64_t, const LogCallback &);
+    int64_t trainTokens() const;
     bool keepTraining(const int64_t) const;
+    void reportLoss(model::State &);
+    bool updateLoss();
+    bool converged();
+    void evaluate();
+    void evalLoop();
     void printInfo(double, double, const LogCallback & = {});
-    std::tuple<int64_t, double, double> progressInfo(double);
+    std::tuple<double, double, int64_t> progressInfo(double);
     
-    void skipgram(model::State &, double, const std::vector<std::string> &);
-    void getTrackEmbeddingVector(Vector&, int64_t,
+    void learn(Model &, model::State &, double, double, const std::vector<int64_t> &);
+    void skipgram(Model &, model::State &, double, double, const std::vector<int64_t> &);
+    void cbow(Model &, model::State &, double, double, const std::vector<int64_t> &);
+    void getTrackEmbeddingVector(Vector&, const Matrices&, const Matrices&, int64_t,
                                  const std::vector<int64_t>&,
                                  const std::vector<int64_t>&) const;
     
+    static void addRow(Vector &, const Matrices &, int64_t);
+    
+    inline bool discard(int64_t idx, double rand) const
+    {
+        return rand > pdiscard_[idx];
+    }
+    
     inline void getOutputVector(Vector& vec, int64_t idx) const
     {
         vec.addRow(*output_, idx);
@@ -5,6 +5,10 @@
 
 #include "utils.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 namespace track2vec
 {
 namespace utils
@@ -34,5 +38,27 @@ void gotoLine(std::ifstream &ifs, int64_t num)
     }
 }
 
+bool readLines(std::istream &ifs, std::vector<std::string> &lines, size_t n)
+{
+    lines.clear();
+    for (std::string line; lines.size() < n && std::getline(ifs, line);)
+    {
+        if (!line.empty())
+        {
+            lines.push_back(std::move(line));
+        }
+    }
+    return !lines.empty();
+}
+
+uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
 } // namespace utils
 } // namespace track2vec
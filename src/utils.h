@@ -8,6 +8,7 @@
 #include <chrono>
 #include <fstream>
 #include <ostream>
+#include <string>
 #include <vector>
 
 namespace track2vec
@@ -21,5 +22,11 @@ double getDuration(const std::chrono::steady_clock::time_point&,
 
 void gotoLine(std::ifstream&, int64_t);
 
+// up to n non-empty lines, false once nothing is left
+bool readLines(std::istream&, std::vector<std::string>&, size_t);
+
+// time stamp counter where available, 0 otherwise
+uint64_t cycles();
+
 } // namespace utils
 } // namespace track2vec
@@ -6,6 +6,7 @@
 #include "vector.h"
 #include "matrix.h"
 
+#include <cassert>
 #include <iomanip>
 #include <cmath>
 
@@ -39,6 +40,24 @@ void Vector::zero()
     std::fill(data_.begin(), data_.end(), 0.0);
 }
 
+void Vector::add(const Vector &ref)
+{
+    assert(size() == ref.size());
+    for (int64_t i = 0; i < size(); i++)
+    {
+        data_[i] += ref[i];
+    }
+}
+
+void Vector::add(const Vector &ref, double a)
+{
+    assert(size() == ref.size());
+    for (int64_t i = 0; i < size(); i++)
+    {
+        data_[i] += a * ref[i];
+    }
+}
+
 void Vector::mul(double a)
 {
     for (int64_t i = 0; i < size(); i++)
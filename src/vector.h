@@ -50,6 +50,8 @@ public:
     }
     
     void zero();
+    void add(const Vector &);
+    void add(const Vector &, double);
     void mul(double);
     Vector avg(const Vector &);
     double norm() const;